@@ -599,10 +599,11 @@ int main(int argc, char** argv)
         rgb[3 * ((height - y - 1) * width + x) + 2] = fabsf(normal[2]);
       }
 #else // multi-hit ray traversal.
-      nanort::StackVector<nanort::TriangleIntersector, 128> isects;
+      nanort::TriangleIntersector<> triangle_intersector(mesh.vertices, mesh.faces, sizeof(float) * 3);
+      nanort::StackVector<nanort::TriangleIntersection<>, 128> isects;
       int max_isects = 8;
       nanort::BVHTraceOptions trace_options;
-      bool hit = accel.MultiHitTraverse(ray, trace_options, max_isects, &isects);
+      bool hit = accel.MultiHitTraverse(ray, max_isects, triangle_intersector, &isects, trace_options);
       if (hit) {
         float col[3];
         IdToCol(col, isects->size()-1);
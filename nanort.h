@@ -38,10 +38,52 @@ THE SOFTWARE.
 #include <functional>
 #include <limits>
 #include <memory>
+#include <new>
 #include <queue>
 #include <string>
 #include <vector>
 
+#if !defined(NANORT_DISABLE_SIMD)
+#if defined(__SSE__) || defined(_M_X64) || \
+    (defined(_M_IX86_FP) && (_M_IX86_FP >= 1))
+#define NANORT_USE_SSE
+#include <xmmintrin.h>
+#endif
+#if defined(__AVX2__)
+#define NANORT_USE_AVX2
+#include <immintrin.h>
+#endif
+#endif
+
+// OpenMP 3.0 task is required for task parallel BVH build.
+#if defined(_OPENMP) && (_OPENMP >= 200805)
+#define NANORT_USE_OPENMP_TASK
+#endif
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+// Built-in std::thread task scheduler(see NANORT_USE_STD_THREAD below).
+#if defined(NANORT_USE_STD_THREAD) && !defined(_OPENMP)
+#define NANORT_USE_TASK_SCHEDULER
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+#endif
+
+#if defined(NANORT_USE_TASK_SCHEDULER)
+#include <chrono>
+#elif !defined(_OPENMP)
+#if defined(__unix__) || defined(__APPLE__)
+#include <sys/time.h>
+#else
+#include <ctime>
+#endif
+#endif
+
 namespace nanort {
 
 #ifdef __clang__
@@ -55,6 +97,11 @@ namespace nanort {
 // thus turn off if you face a problem when building BVH.
 #define NANORT_ENABLE_PARALLEL_BUILD (1)
 
+// Define NANORT_USE_STD_THREAD before including nanort.h to build BVH in
+// parallel with built-in work stealing scheduler on std::thread(requires
+// C++11) when OpenMP is not available. Build tasks can also run on your own
+// thread pool. See TaskScheduler and BVHAccel::SetTaskScheduler().
+
 // ----------------------------------------------------------------------------
 // Small vector class useful for multi-threaded environment.
 //
@@ -365,6 +412,45 @@ inline const real *get_vertex_addr(const real *p, const size_t idx,
       reinterpret_cast<const unsigned char *>(p) + idx * stride_bytes);
 }
 
+/// Returns `a * b - c * d`. Products of float values are exact in double, so
+/// the result does not change when the compiler contracts the expression into
+/// FMA(e.g. -mfma), and it is exactly zero when `a * b == c * d`.
+template <typename T>
+inline T DifferenceOfProducts(T a, T b, T c, T d) {
+  const double ab = static_cast<double>(a) * static_cast<double>(b);
+  const double cd = static_cast<double>(c) * static_cast<double>(d);
+  return static_cast<T>(ab - cd);
+}
+
+/// Double products are not exact. When the compiler may contract into FMA,
+/// the rounding error of `c * d` is added back with explicit FMA(Kahan's
+/// algorithm) so that the result does not depend on contraction and is
+/// exactly zero when `a * b == c * d`.
+inline double DifferenceOfProducts(double a, double b, double c, double d) {
+#if defined(FP_FAST_FMA) || defined(__FMA__) || defined(__AVX2__)
+  const double cd = c * d;
+  const double err = std::fma(-c, d, cd);
+  const double dop = std::fma(a, b, -cd);
+  return dop + err;
+#else
+  return a * b - c * d;
+#endif
+}
+
+/// Returns the index of the lowest set bit. `x` must not be zero.
+inline int CountTrailingZeros(unsigned int x) {
+#if defined(__GNUC__)
+  return __builtin_ctz(x);
+#else
+  int n = 0;
+  while (!(x & 1u)) {
+    x >>= 1;
+    n++;
+  }
+  return n;
+#endif
+}
+
 template <typename T = float>
 class Ray {
  public:
@@ -385,6 +471,100 @@ class Ray {
   int dir_sign[3];  // filled internally
 };
 
+/// Structure-of-arrays packet of `N` rays(N <= 32), traced together with
+/// BVHAccel::TraversePacket(). `N` of 4, 8 or 16 maps to SIMD lanes.
+template <typename T = float, int N = 4>
+class RayPacket {
+ public:
+  RayPacket() {
+    for (int k = 0; k < N; k++) {
+      org[0][k] = static_cast<T>(0.0);
+      org[1][k] = static_cast<T>(0.0);
+      org[2][k] = static_cast<T>(0.0);
+      dir[0][k] = static_cast<T>(0.0);
+      dir[1][k] = static_cast<T>(0.0);
+      dir[2][k] = static_cast<T>(-1.0);
+      min_t[k] = static_cast<T>(0.0);
+      max_t[k] = std::numeric_limits<T>::max();
+    }
+  }
+
+  /// Stores `ray` to `k` th lane of the packet.
+  void SetRay(int k, const Ray<T> &ray) {
+    for (int i = 0; i < 3; i++) {
+      org[i][k] = ray.org[i];
+      dir[i][k] = ray.dir[i];
+    }
+    min_t[k] = ray.min_t;
+    max_t[k] = ray.max_t;
+  }
+
+  /// Loads `k` th lane of the packet to `ray`.
+  void GetRay(int k, Ray<T> *ray) const {
+    for (int i = 0; i < 3; i++) {
+      ray->org[i] = org[i][k];
+      ray->dir[i] = dir[i][k];
+    }
+    ray->min_t = min_t[k];
+    ray->max_t = max_t[k];
+  }
+
+  T org[3][N];  // must set
+  T dir[3][N];  // must set
+  T min_t[N];   // minimum ray hit distance.
+  T max_t[N];   // maximum ray hit distance.
+};
+
+// Allocator which returns memory aligned to `Alignment` bytes.
+// Used to place BVH nodes on cache line boundaries so that a node never
+// straddles two cache lines.
+template <typename T, size_t Alignment>
+class AlignedAllocator : public std::allocator<T> {
+ public:
+  typedef typename std::allocator<T>::pointer pointer;
+  typedef typename std::allocator<T>::size_type size_type;
+
+  template <typename U>
+  struct rebind {
+    typedef AlignedAllocator<U, Alignment> other;
+  };
+
+  AlignedAllocator() {}
+  AlignedAllocator(const AlignedAllocator<T, Alignment> &rhs)
+      : std::allocator<T>(rhs) {}
+  template <typename U>
+  AlignedAllocator(const AlignedAllocator<U, Alignment> &rhs) {
+    (void)rhs;
+  }
+
+  pointer allocate(size_type n, const void *hint = 0) {
+    (void)hint;
+
+    // Over-allocate and remember the address returned by operator new just
+    // before the aligned address.
+    unsigned char *raw = reinterpret_cast<unsigned char *>(
+        ::operator new(n * sizeof(T) + Alignment + sizeof(void *)));
+
+    size_t addr = reinterpret_cast<size_t>(raw + sizeof(void *));
+    addr = (addr + Alignment - 1) & ~(Alignment - 1);
+
+    unsigned char *aligned = reinterpret_cast<unsigned char *>(addr);
+    memcpy(aligned - sizeof(void *), &raw, sizeof(void *));
+
+    return reinterpret_cast<pointer>(aligned);
+  }
+
+  void deallocate(pointer p, size_type n) {
+    (void)n;
+    if (p) {
+      unsigned char *raw = NULL;
+      memcpy(&raw, reinterpret_cast<unsigned char *>(p) - sizeof(void *),
+             sizeof(void *));
+      ::operator delete(raw);
+    }
+  }
+};
+
 template <typename T = float>
 class BVHNode {
  public:
@@ -393,12 +573,10 @@ class BVHNode {
     bmin[0] = rhs.bmin[0];
     bmin[1] = rhs.bmin[1];
     bmin[2] = rhs.bmin[2];
-    flag = rhs.flag;
 
     bmax[0] = rhs.bmax[0];
     bmax[1] = rhs.bmax[1];
     bmax[2] = rhs.bmax[2];
-    axis = rhs.axis;
 
     data[0] = rhs.data[0];
     data[1] = rhs.data[1];
@@ -408,12 +586,10 @@ class BVHNode {
     bmin[0] = rhs.bmin[0];
     bmin[1] = rhs.bmin[1];
     bmin[2] = rhs.bmin[2];
-    flag = rhs.flag;
 
     bmax[0] = rhs.bmax[0];
     bmax[1] = rhs.bmax[1];
     bmax[2] = rhs.bmax[2];
-    axis = rhs.axis;
 
     data[0] = rhs.data[0];
     data[1] = rhs.data[1];
@@ -423,52 +599,436 @@ class BVHNode {
 
   ~BVHNode() {}
 
+  static const unsigned int kLeafBit = 0x80000000u;
+  static const unsigned int kAxisShift = 30;
+  static const unsigned int kChildMask = 0x3FFFFFFFu;
+
+  bool IsLeaf() const { return (data[0] & kLeafBit) != 0; }
+
+  // branch
+  int GetAxis() const { return static_cast<int>(data[1] >> kAxisShift); }
+  unsigned int GetChild(int i) const {
+    return (i == 0) ? data[0] : (data[1] & kChildMask);
+  }
+
+  // leaf
+  unsigned int GetNumPrimitives() const { return data[0] & (~kLeafBit); }
+  unsigned int GetIndexOffset() const { return data[1]; }
+
+  void SetLeaf(unsigned int npoints, unsigned int index) {
+    assert(npoints < kLeafBit);
+    data[0] = kLeafBit | npoints;
+    data[1] = index;
+  }
+
+  void SetBranch(int axis, unsigned int child0, unsigned int child1) {
+    assert((axis >= 0) && (axis < 3));
+    assert(child0 <= kChildMask);
+    assert(child1 <= kChildMask);
+    data[0] = child0;
+    data[1] = (static_cast<unsigned int>(axis) << kAxisShift) | child1;
+  }
+
+  void SetChild(int i, unsigned int child) {
+    assert(child <= kChildMask);
+    if (i == 0) {
+      data[0] = child;
+    } else {
+      data[1] = (data[1] & (~kChildMask)) | child;
+    }
+  }
+
   T bmin[3];
   T bmax[3];
 
-  int flag;  // 1 = leaf node, 0 = branch node
-  int axis;
-
+  // Leaf flag, split axis and child/primitive offsets are packed into
+  // `data` so that BVHNode<float> is exactly 32 bytes.
+  //
   // leaf
-  //   data[0] = npoints
+  //   data[0] = kLeafBit | npoints
   //   data[1] = index
   //
   // branch
   //   data[0] = child[0]
-  //   data[1] = child[1]
+  //   data[1] = (axis << 30) | child[1]
+  //
+  // Thus up to 1G nodes can be addressed.
   unsigned int data[2];
 };
 
+// Compile-time check of the node size(C++03 compatible static assert).
+typedef char BVHNodeSizeCheck[(sizeof(BVHNode<float>) == 32) ? 1 : -1];
+
+/// N-wide BVH node collapsed from the binary BVH.
+/// Bounding boxes of children are stored in SoA layout so that all children
+/// can be tested against a ray at once with SIMD.
+template <typename T, int N>
+class WideBVHNode {
+ public:
+  static const unsigned int kInvalidIndex = 0xFFFFFFFFu;
+
+  void SetEmpty(int i) {
+    bmin[0][i] = bmin[1][i] = bmin[2][i] = std::numeric_limits<T>::max();
+    bmax[0][i] = bmax[1][i] = bmax[2][i] = -std::numeric_limits<T>::max();
+    child[i] = kInvalidIndex;
+    num_primitives[i] = 0;
+  }
+
+  bool IsLeaf(int i) const { return num_primitives[i] > 0; }
+
+  T bmin[3][N];  // [xyz][child]
+  T bmax[3][N];  // [xyz][child]
+
+  // leaf
+  //   child[i] = index
+  //   num_primitives[i] = npoints(> 0)
+  //
+  // branch
+  //   child[i] = index of wide node
+  //   num_primitives[i] = 0
+  //
+  // empty slot has an inverted bounding box, thus never be hit.
+  unsigned int child[N];
+  unsigned int num_primitives[N];
+};
+
+/// Returns 2^e. `e` must be in [-126, 127].
+template <typename T>
+inline T ExponentToScale(int e) {
+  return static_cast<T>(std::ldexp(1.0, e));
+}
+
+template <>
+inline float ExponentToScale<float>(int e) {
+  // Construct IEEE754 bits directly. Faster than ldexp().
+  unsigned int bits = static_cast<unsigned int>(e + 127) << 23;
+  float f;
+  memcpy(&f, &bits, sizeof(float));
+  return f;
+}
+
+/// Compressed 4-wide BVH node.
+/// Child bounds are stored as 8-bit offsets on a grid relative to the parent
+/// bounds(origin + q * 2^exponent), rounded conservatively so that a decoded
+/// box always contains the original box. 64 bytes for `float`.
+template <typename T>
+class QuantizedBVHNode {
+ public:
+  static const unsigned int kMaxLeafPrimitives = 0xFFFFu;
+  static const unsigned int kInvalidIndex = 0xFFFFFFFFu;
+
+  /// Decodes child bounds into SoA layout. Bounds of empty slots are
+  /// meaningless; use ChildMask() to exclude them.
+  void Decode(T bmin[3][4], T bmax[3][4]) const {
+    for (int k = 0; k < 3; k++) {
+      const T scale = ExponentToScale<T>(exponent[k]);
+      for (int i = 0; i < 4; i++) {
+        // q * scale is exact since scale is power of two.
+        bmin[k][i] = origin[k] + static_cast<T>(qmin[k][i]) * scale;
+        bmax[k][i] = origin[k] + static_cast<T>(qmax[k][i]) * scale;
+      }
+    }
+  }
+
+  bool IsLeaf(int i) const { return num_primitives[i] > 0; }
+
+  /// Returns bitmask of non-empty child slots.
+  unsigned int ChildMask() const {
+    unsigned int mask = 0;
+    for (int i = 0; i < 4; i++) {
+      mask |= (child[i] != kInvalidIndex) ? (1u << i) : 0u;
+    }
+    return mask;
+  }
+
+  T origin[3];
+  signed char exponent[3];
+  unsigned char pad;
+
+  // Empty child slot has child = kInvalidIndex, qmin = 255 and qmax = 0.
+  // The inverted box alone does not mark the slot empty: when the node has
+  // zero extent on an axis, `origin + q * scale` equals `origin` for any q.
+  unsigned char qmin[3][4];  // [xyz][child]
+  unsigned char qmax[3][4];  // [xyz][child]
+
+  // Same as WideBVHNode, but up to 65535 primitives in a leaf.
+  unsigned int child[4];
+  unsigned short num_primitives[4];
+};
+
+// Number of entries of the fixed size traversal stacks. Traversal keeps at
+// most one pending node per tree level, so trees deeper than
+// `kTraversalStackSize - 1` can not be traversed(see BVHAccel::Insert()).
+static const int kTraversalStackSize = 512;
+
+// Entry of the BVH traversal stack: node index and the ray's entry
+// distance into the node. Index and distance share one slot, so a pop reads
+// a single 8 byte(float) entry.
+template <typename T>
+struct NodeStackEntry {
+  unsigned int index;
+  T t;
+};
+
+// Entry of the packet traversal stack(see BVHAccel::TraversePacket()):
+// node index, rays of the packet which hit the node's box and their
+// smallest entry distance.
+template <typename T>
+struct PacketStackEntry {
+  unsigned int index;
+  unsigned int lane_mask;
+  T t;
+};
+
+// Returns the smallest of `tmins` over rays in `lane_mask`.
+template <typename T>
+inline T PacketMinEntry(const T *tmins, unsigned int lane_mask) {
+  T t = std::numeric_limits<T>::max();
+  for (; lane_mask; lane_mask &= lane_mask - 1) {
+    t = std::min(t, tmins[CountTrailingZeros(lane_mask)]);
+  }
+  return t;
+}
+
 template <class H>
 class IntersectComparator {
  public:
   bool operator()(const H &a, const H &b) const { return a.t < b.t; }
 };
 
+// Maximum number of hits collected by BVHAccel::MultiHitTraverse(). Equals
+// the inline capacity of its StackVector output.
+static const int kMaxMultiHits = 128;
+
+/// Fixed capacity buffer of the nearest hits along a ray, sorted front to
+/// back. Used by BVHAccel::MultiHitTraverse() without heap allocation.
+template <typename T>
+class MultiHitBuffer {
+ public:
+  explicit MultiHitBuffer(int capacity) : size_(0) {
+    capacity_ = std::max(0, std::min(capacity, kMaxMultiHits));
+  }
+
+  int size() const { return size_; }
+  bool full() const { return size_ >= capacity_; }
+
+  /// Returns the distance hits must be closer than to enter the buffer.
+  T GetMaxT(T ray_max_t) const { return full() ? t_[size_ - 1] : ray_max_t; }
+
+  /// Inserts a hit in sorted position. The farthest hit is dropped when the
+  /// buffer is full. Returns false if the hit is not inserted, i.e. it is
+  /// too far or `prim_id` is already in the buffer.
+  bool Insert(T t, unsigned int prim_id, unsigned int slot) {
+    if (capacity_ == 0) {
+      return false;
+    }
+
+    if (full() && !(t < t_[size_ - 1])) {
+      return false;
+    }
+
+    // A primitive can be referenced from several leaves(spatial split).
+    for (int i = 0; i < size_; i++) {
+      if (prim_ids_[i] == prim_id) {
+        return false;
+      }
+    }
+
+    int i = full() ? (size_ - 1) : size_++;
+    while ((i > 0) && (t < t_[i - 1])) {
+      t_[i] = t_[i - 1];
+      prim_ids_[i] = prim_ids_[i - 1];
+      slots_[i] = slots_[i - 1];
+      i--;
+    }
+    t_[i] = t;
+    prim_ids_[i] = prim_id;
+    slots_[i] = slot;
+
+    return true;
+  }
+
+  T GetT(int i) const { return t_[i]; }
+  unsigned int GetPrimId(int i) const { return prim_ids_[i]; }
+  unsigned int GetSlot(int i) const { return slots_[i]; }
+
+ private:
+  int capacity_;
+  int size_;
+  T t_[kMaxMultiHits];
+  unsigned int prim_ids_[kMaxMultiHits];
+  unsigned int slots_[kMaxMultiHits];  // index in BVH indices.
+};
+
+// Returns wall clock time in seconds. Used for build time measurement.
+inline double GetWallClockSecs() {
+#if defined(_OPENMP)
+  return omp_get_wtime();
+#elif defined(NANORT_USE_TASK_SCHEDULER)
+  return std::chrono::duration<double>(
+             std::chrono::steady_clock::now().time_since_epoch())
+      .count();
+#elif defined(__unix__) || defined(__APPLE__)
+  timeval tv;
+  gettimeofday(&tv, NULL);
+  return static_cast<double>(tv.tv_sec) +
+         static_cast<double>(tv.tv_usec) * 1.0e-6;
+#else
+  return static_cast<double>(std::clock()) / CLOCKS_PER_SEC;
+#endif
+}
+
+// Returns true when `deadline_secs`(GetWallClockSecs() time, 0 = none) has
+// passed.
+inline bool IsPastDeadline(double deadline_secs) {
+  return (deadline_secs > 0.0) && (GetWallClockSecs() > deadline_secs);
+}
+
+/// BVH build method.
+enum BVHBuildMethod {
+  kBVHBuildSAH = 0,   // Binned SAH. Best trace performance.
+  kBVHBuildLBVH = 1,  // Linear BVH from Morton codes. Fastest build.
+  kBVHBuildHLBVH = 2  // LBVH treelets with binned SAH top levels.
+};
+
+/// BVH build quality preset. See BVHBuildOptions::SetQuality().
+enum BVHBuildQuality {
+  kBVHBuildQualityFast = 0,      // LBVH. e.g. interactive preview.
+  kBVHBuildQualityBalanced = 1,  // Binned SAH(default options).
+  kBVHBuildQualityHigh = 2       // SBVH + tree rotation. e.g. final frame.
+};
+
 /// BVH build option.
 template <typename T = float>
 struct BVHBuildOptions {
   T cost_t_aabb;
+
+  // Spatial split is tried only when overlap area of the best object split
+  // children exceeds `spatial_split_alpha` * (surface area of the root).
+  T spatial_split_alpha;
+
+  // Max number of additional primitive references created by spatial
+  // split, relative to the number of primitives(e.g. 0.5 = up to 50% more).
+  T spatial_split_budget;
   unsigned int min_leaf_primitives;
+
+  // Nodes with up to `max_leaf_primitives` primitives become leaves when no
+  // split has lower SAH cost than intersecting all of their primitives.
+  // Used by binned SAH build(kBVHBuildSAH without `spatial_split`).
+  unsigned int max_leaf_primitives;
   unsigned int max_tree_depth;
   unsigned int bin_size;
+
+  // Nodes with up to `sweep_sah_threshold` primitives are split by sweep
+  // SAH, which evaluates every primitive boundary on each axis instead of
+  // `bin_size` bins. Used by binned SAH build. 0 = always use bins.
+  unsigned int sweep_sah_threshold;
+
+  // Depth of the tree built serially before building subtrees in parallel.
+  // Used only when OpenMP task is not available(e.g. OpenMP 2.0).
   unsigned int shallow_depth;
+
+  // Build BVH in parallel when the number of primitives exceeds this value.
   unsigned int min_primitives_for_parallel_build;
 
+  // Collapse binary BVH into `wide_bvh_width`-wide BVH after build and use
+  // it in Traverse(). 0 = disabled(default), 4 = BVH4, 8 = BVH8.
+  // BVH8 requires AVX2 and `float` BVH. Otherwise binary BVH is used.
+  unsigned int wide_bvh_width;
+
+  // Build method. kBVHBuildLBVH builds much faster than kBVHBuildSAH(e.g.
+  // for rebuilding BVH of animated scene every frame), at the cost of
+  // trace performance. kBVHBuildHLBVH is in between: close to LBVH build
+  // speed with most of SAH trace performance. Parallel build options are
+  // only used by kBVHBuildSAH.
+  BVHBuildMethod build_method;
+
+  // Length of Morton codes used by kBVHBuildLBVH and kBVHBuildHLBVH: 30(10
+  // bits per axis) or 63(21 bits per axis). 63 bit codes take longer to
+  // sort, but large dense meshes(~1M primitives or more) get much fewer
+  // duplicate codes, which LBVH can only split at the object median.
+  unsigned int morton_code_bits;
+
   // Cache bounding box computation.
   // Requires more memory, but BVHbuild can be faster.
   bool cache_bbox;
-  unsigned char pad[3];
+
+  // Compute primitive bounds and centroids once before build, then bin and
+  // partition these compact arrays instead of calling `P` and `Pred` at
+  // every tree level. Makes binned SAH build mostly independent of vertex
+  // layout. Implies `cache_bbox`. Used with kBVHBuildSAH without
+  // `spatial_split`. Partition uses bounding box centers instead of `Pred`.
+  bool cache_centroids;
+
+  // Compress BVH into quantized 4-wide nodes after build to reduce memory.
+  // Binary BVH nodes are released, thus only Traverse() is available.
+  // Saves about 2x on nodes only(64 byte node per 4 children vs. 32 byte
+  // binary node); `indices_` is kept as is, so BVH memory as a whole shrinks
+  // by about 1.7x(e.g. 2.5 MB -> 1.5 MB for 100K triangles).
+  bool compressed_bvh;
+
+  // Reorder nodes in depth first order after build. The child with larger
+  // surface area is placed next to its parent, which improves memory
+  // locality in traversal.
+  bool depth_first_layout;
+
+  // Build spatial split BVH(SBVH) which also splits primitive references by
+  // planes. Improves trace performance for long, thin triangles which
+  // overlap a lot, at the cost of slower build. Used with kBVHBuildSAH.
+  // A primitive may be referenced from multiple leaves, thus GetIndices()
+  // may contain the same primitive more than once.
+  bool spatial_split;
+
+  // Number of tree rotation passes to improve built tree(0 = disabled).
+  // See BVHAccel::OptimizeTree().
+  unsigned int tree_rotation_passes;
+
+  // Time budget of Build() in seconds(0 = unlimited). Once it is used up,
+  // remaining subtrees are split at the spatial median instead of by SAH,
+  // spatial split is no longer tried and remaining tree rotation passes are
+  // skipped. Build() may still exceed the budget by the time to finish the
+  // tree with these faster strategies.
+  float build_time_budget;
 
   // Set default value: Taabb = 0.2
   BVHBuildOptions()
       : cost_t_aabb(static_cast<T>(0.2)),
+        spatial_split_alpha(static_cast<T>(1.0e-5)),
+        spatial_split_budget(static_cast<T>(0.5)),
         min_leaf_primitives(4),
+        max_leaf_primitives(8),
         max_tree_depth(256),
         bin_size(64),
+        sweep_sah_threshold(32),
         shallow_depth(3),
         min_primitives_for_parallel_build(1024 * 128),
-        cache_bbox(false) {}
+        wide_bvh_width(0),
+        build_method(kBVHBuildSAH),
+        morton_code_bits(30),
+        cache_bbox(false),
+        cache_centroids(false),
+        compressed_bvh(false),
+        depth_first_layout(false),
+        spatial_split(false),
+        tree_rotation_passes(0),
+        build_time_budget(0.0f) {}
+
+  // Sets build method and related options for `quality`. Other options(e.g.
+  // `build_time_budget`, parallel build and node layout) are kept.
+  void SetQuality(BVHBuildQuality quality) {
+    BVHBuildOptions<T> defaults;
+    build_method = defaults.build_method;
+    spatial_split = defaults.spatial_split;
+    tree_rotation_passes = defaults.tree_rotation_passes;
+    sweep_sah_threshold = defaults.sweep_sah_threshold;
+
+    if (quality == kBVHBuildQualityFast) {
+      build_method = kBVHBuildLBVH;
+    } else if (quality == kBVHBuildQualityHigh) {
+      spatial_split = true;
+      tree_rotation_passes = 4;
+    }
+  }
 };
 
 /// BVH build statistics.
@@ -477,14 +1037,20 @@ class BVHBuildStatistics {
   unsigned int max_tree_depth;
   unsigned int num_leaf_nodes;
   unsigned int num_branch_nodes;
-  float build_secs;
+  float build_secs;  // Wall clock time of Build().
+
+  // SAH cost of the tree: sum of box test cost of branch nodes and
+  // intersection cost of leaves, weighted by their surface area relative to
+  // the root. Uses BVHBuildOptions::cost_t_aabb as in build.
+  float sah_cost;
 
   // Set default value: Taabb = 0.2
   BVHBuildStatistics()
       : max_tree_depth(0),
         num_leaf_nodes(0),
         num_branch_nodes(0),
-        build_secs(0.0f) {}
+        build_secs(0.0f),
+        sah_cost(0.0f) {}
 };
 
 /// BVH trace option.
@@ -503,6 +1069,216 @@ class BVHTraceOptions {
   }
 };
 
+#if defined(NANORT_USE_TASK_SCHEDULER)
+// ----------------------------------------------------------------------------
+// Task scheduler for parallel BVH build with std::thread.
+//
+
+///
+/// Interface of the scheduler which runs BVH build tasks. Implement this to
+/// run tasks on your own thread pool and pass it to
+/// BVHAccel::SetTaskScheduler(). Build waits for its tasks by calling
+/// RunPendingTask() repeatedly(also from inside tasks), thus workers must
+/// not block while waiting.
+///
+class TaskScheduler {
+ public:
+  virtual ~TaskScheduler() {}
+
+  /// Queues `task` to run on any thread.
+  virtual void Enqueue(const std::function<void()> &task) = 0;
+
+  /// Runs one queued task on the calling thread.
+  /// Returns false when no task is available.
+  virtual bool RunPendingTask() = 0;
+};
+
+/// Set of tasks to wait for.
+class TaskGroup {
+ public:
+  TaskGroup() : num_pending(0) {}
+
+  std::atomic<unsigned int> num_pending;
+};
+
+inline void SpawnTask(TaskScheduler *scheduler, TaskGroup *group,
+                      const std::function<void()> &task) {
+  group->num_pending++;
+  scheduler->Enqueue([group, task]() {
+    task();
+    group->num_pending--;
+  });
+}
+
+/// Runs queued tasks until all tasks in `group` finished.
+inline void WaitTaskGroup(TaskScheduler *scheduler, TaskGroup *group) {
+  while (group->num_pending > 0) {
+    if (!scheduler->RunPendingTask()) {
+      std::this_thread::yield();
+    }
+  }
+}
+
+/// Calls `func(begin, end)` for chunks of [0, n) in parallel.
+template <class F>
+inline void ParallelFor(TaskScheduler *scheduler, unsigned int n,
+                        unsigned int chunk_size, const F &func) {
+  TaskGroup group;
+  for (unsigned int begin = 0; begin < n; begin += chunk_size) {
+    const unsigned int end = std::min(n, begin + chunk_size);
+    SpawnTask(scheduler, &group, [&func, begin, end]() { func(begin, end); });
+  }
+  WaitTaskGroup(scheduler, &group);
+}
+
+///
+/// Built-in work stealing scheduler. Each worker thread pushes and pops
+/// tasks at the back of its own queue, and steals from the front of other
+/// queues when its queue is empty. Tasks queued from other threads go to a
+/// shared queue.
+///
+class WorkStealingTaskScheduler : public TaskScheduler {
+ public:
+  /// `num_threads` = 0 uses one worker per hardware thread except the
+  /// calling thread, which runs tasks while waiting.
+  explicit WorkStealingTaskScheduler(unsigned int num_threads = 0)
+      : num_queued_(0), stop_(false) {
+    if (num_threads == 0) {
+      const unsigned int num_cores = std::thread::hardware_concurrency();
+      num_threads = (num_cores > 1) ? (num_cores - 1) : 1;
+    }
+
+    // Worker queues and the shared queue(last).
+    for (unsigned int i = 0; i < num_threads + 1; i++) {
+      queues_.push_back(std::unique_ptr<Queue>(new Queue()));
+    }
+
+    for (unsigned int i = 0; i < num_threads; i++) {
+      workers_.push_back(std::thread(&WorkStealingTaskScheduler::WorkerMain,
+                                     this, static_cast<size_t>(i)));
+    }
+  }
+
+  ~WorkStealingTaskScheduler() {
+    {
+      std::lock_guard<std::mutex> lock(sleep_mutex_);
+      stop_ = true;
+    }
+    wake_.notify_all();
+    for (size_t i = 0; i < workers_.size(); i++) {
+      workers_[i].join();
+    }
+  }
+
+  void Enqueue(const std::function<void()> &task) {
+    Queue &queue = *queues_[GetQueueIndex()];
+    {
+      std::lock_guard<std::mutex> lock(sleep_mutex_);
+      num_queued_++;
+    }
+    {
+      std::lock_guard<std::mutex> lock(queue.mutex);
+      queue.tasks.push_back(task);
+    }
+    wake_.notify_one();
+  }
+
+  bool RunPendingTask() {
+    std::function<void()> task;
+    if (!PopTask(GetQueueIndex(), &task)) {
+      return false;
+    }
+    task();
+    return true;
+  }
+
+ private:
+  struct Queue {
+    std::mutex mutex;
+    std::deque<std::function<void()> > tasks;
+  };
+
+  // Per-thread worker state. `scheduler` is null for non-worker threads.
+  struct WorkerState {
+    const WorkStealingTaskScheduler *scheduler;
+    size_t queue_index;
+  };
+
+  static WorkerState &GetWorkerState() {
+    static thread_local WorkerState state = {nullptr, 0};
+    return state;
+  }
+
+  size_t GetQueueIndex() const {
+    const WorkerState &state = GetWorkerState();
+    return (state.scheduler == this) ? state.queue_index : workers_.size();
+  }
+
+  // Pops from the back of own queue, or steals from the front of others.
+  bool PopTask(size_t queue_index, std::function<void()> *task) {
+    {
+      Queue &queue = *queues_[queue_index];
+      std::lock_guard<std::mutex> lock(queue.mutex);
+      if (!queue.tasks.empty()) {
+        task->swap(queue.tasks.back());
+        queue.tasks.pop_back();
+        num_queued_--;
+        return true;
+      }
+    }
+
+    for (size_t i = 1; i < queues_.size(); i++) {
+      Queue &queue = *queues_[(queue_index + i) % queues_.size()];
+      std::lock_guard<std::mutex> lock(queue.mutex);
+      if (!queue.tasks.empty()) {
+        task->swap(queue.tasks.front());
+        queue.tasks.pop_front();
+        num_queued_--;
+        return true;
+      }
+    }
+
+    return false;
+  }
+
+  void WorkerMain(size_t queue_index) {
+    WorkerState &state = GetWorkerState();
+    state.scheduler = this;
+    state.queue_index = queue_index;
+
+    for (;;) {
+      std::function<void()> task;
+      if (PopTask(queue_index, &task)) {
+        task();
+        continue;
+      }
+
+      std::unique_lock<std::mutex> lock(sleep_mutex_);
+      while (!stop_ && (num_queued_ == 0)) {
+        wake_.wait(lock);
+      }
+      if (stop_ && (num_queued_ == 0)) {
+        return;
+      }
+    }
+  }
+
+  std::vector<std::unique_ptr<Queue> > queues_;
+  std::vector<std::thread> workers_;
+  std::mutex sleep_mutex_;
+  std::condition_variable wake_;
+  std::atomic<size_t> num_queued_;
+  bool stop_;
+};
+
+/// Returns the scheduler shared by BVHAccel instances which have no
+/// scheduler set.
+inline TaskScheduler *GetDefaultTaskScheduler() {
+  static WorkStealingTaskScheduler scheduler;
+  return &scheduler;
+}
+#endif  // NANORT_USE_TASK_SCHEDULER
+
 template <typename T>
 class BBox {
  public:
@@ -552,12 +1328,66 @@ class NodeHitComparator {
   }
 };
 
+struct BinBuffer;
+
 template <typename T>
-class BVHAccel {
+struct SweepBuffer;
+
+template <typename T>
+struct SBVHReference;
+
+template <typename T>
+struct SBVHBuildState;
+
+template <typename T>
+struct StreamRay;
+
+template <typename T>
+struct StreamBuffer;
+
+template <typename T, class I>
+class RayStreamIntersector;
+
+// Value of BVHAccel::GetIndices() entries released by BVHAccel::Remove().
+// No leaf references them until BVHAccel::Insert() reuses the slot.
+static const unsigned int kFreePrimitiveIndex = 0xFFFFFFFFu;
+
+template <typename T>
+class BVHAccel {
  public:
-  BVHAccel() : pad0_(0) { (void)pad0_; }
+  // BVH nodes are stored in cache line aligned memory.
+  typedef std::vector<BVHNode<T>, AlignedAllocator<BVHNode<T>, 64> >
+      BVHNodeArray;
+  typedef std::vector<WideBVHNode<T, 4>,
+                      AlignedAllocator<WideBVHNode<T, 4>, 64> >
+      BVH4NodeArray;
+  typedef std::vector<WideBVHNode<T, 8>,
+                      AlignedAllocator<WideBVHNode<T, 8>, 64> >
+      BVH8NodeArray;
+  typedef std::vector<QuantizedBVHNode<T>,
+                      AlignedAllocator<QuantizedBVHNode<T>, 64> >
+      QuantizedBVHNodeArray;
+
+#if defined(NANORT_USE_TASK_SCHEDULER)
+  BVHAccel()
+      : build_deadline_secs_(0.0), task_scheduler_(nullptr), pad0_(0) {
+    (void)pad0_;
+  }
+#else
+  BVHAccel() : build_deadline_secs_(0.0), pad0_(0) { (void)pad0_; }
+#endif
   ~BVHAccel() {}
 
+#if defined(NANORT_USE_TASK_SCHEDULER)
+  ///
+  /// Set scheduler to run parallel build tasks on. `scheduler` must be alive
+  /// during Build(). nullptr(default) uses GetDefaultTaskScheduler().
+  ///
+  void SetTaskScheduler(TaskScheduler *scheduler) {
+    task_scheduler_ = scheduler;
+  }
+#endif
+
   ///
   /// Build BVH for input primitives.
   ///
@@ -565,6 +1395,91 @@ class BVHAccel {
   bool Build(const unsigned int num_primitives, const P &p, const Pred &pred,
              const BVHBuildOptions<T> &options = BVHBuildOptions<T>());
 
+  ///
+  /// Collapse built binary BVH into `width`-wide BVH, which is then used in
+  /// Traverse(). Supported `width` is 4 or 8. 0 discards wide BVH.
+  /// BVH8 is only built for `float` BVH with AVX2 enabled, otherwise binary
+  /// BVH is kept used.
+  /// Returns false when binary BVH is not built or `width` is not supported.
+  ///
+  bool BuildWideBVH(unsigned int width);
+
+  ///
+  /// Renumber binary BVH nodes in depth first order. The child with larger
+  /// surface area(more likely to be traversed) is placed right after its
+  /// parent. Tree structure is not changed.
+  ///
+  void ReorderNodes();
+
+  ///
+  /// Compress built binary BVH into quantized 4-wide nodes, which is then
+  /// used in Traverse(). Binary and wide BVH nodes are released to save
+  /// memory, thus functions other than Traverse() are not available after
+  /// compression.
+  /// Returns false when binary BVH is not built or BVH could not be encoded
+  /// (e.g. a leaf has more than 65535 primitives).
+  ///
+  bool BuildCompressedBVH();
+
+  ///
+  /// Gather triangle vertices in BVH leaf order(9 values per entry of
+  /// GetIndices()) for use with LeafTriangleIntersector, so that leaf
+  /// triangles are read from contiguous memory instead of through `faces`.
+  /// Gathered data is a copy: call this again after vertices are updated or
+  /// BVH is rebuilt.
+  /// Returns false when BVH is not built.
+  ///
+  bool BuildLeafTriangles(const T *vertices, const unsigned int *faces,
+                          size_t vertex_stride_bytes);
+
+  ///
+  /// Recompute node bounds from `p` after primitives moved, keeping tree
+  /// structure and indices(e.g. for skinned or deforming meshes with fixed
+  /// topology). Much cheaper than Build(), but trace performance degrades as
+  /// primitives move far from their positions at build time.
+  /// Wide BVH is rebuilt from refitted nodes. Leaf triangles gathered by
+  /// BuildLeafTriangles() are not updated.
+  /// Returns false when BVH is not built or compressed.
+  ///
+  template <class P>
+  bool Refit(const P &p);
+
+  ///
+  /// Improve tree quality with local tree rotations which reduce surface
+  /// area of branch nodes(Kensler 2008), e.g. after LBVH build or many
+  /// Refit() calls. Runs at most `max_passes` post order passes over the
+  /// tree and stops early when no rotation is applied. Subtrees are
+  /// processed in parallel. Node layout and wide BVH are rebuilt afterwards.
+  /// Returns false when BVH is not built or compressed.
+  ///
+  bool OptimizeTree(unsigned int max_passes);
+
+  ///
+  /// Insert primitive `prim_id` of `p` into built BVH without rebuild.
+  /// New leaf is placed next to the node which minimizes surface area
+  /// increase of the tree(branch and bound search, Bittner et al. 2012), thus
+  /// cost is proportional to tree depth rather than the number of primitives.
+  /// Ancestors of the new leaf are rotated as in OptimizeTree() when it does
+  /// not make the tree deeper, which keeps sequential inserts shallow.
+  /// Wide BVH and leaf triangles are invalidated: call BuildWideBVH() and
+  /// BuildLeafTriangles() again after edits. Trace performance degrades over
+  /// many edits; call OptimizeTree() or Build() occasionally.
+  /// Returns false when BVH is not built, compressed or built with spatial
+  /// splits, when `prim_id` is already in BVH, or when the new leaf would be
+  /// deeper than traversal stacks support(see kTraversalStackSize).
+  ///
+  template <class P>
+  bool Insert(unsigned int prim_id, const P &p);
+
+  ///
+  /// Remove primitive `prim_id` from built BVH without rebuild.
+  /// `p` is used to recompute bounds of the leaf which contained the
+  /// primitive. See Insert() for invalidated data.
+  /// Returns false when `prim_id` is not in BVH.
+  ///
+  template <class P>
+  bool Remove(unsigned int prim_id, const P &p);
+
   ///
   /// Get statistics of built BVH tree. Valid after Build()
   ///
@@ -572,11 +1487,19 @@ class BVHAccel {
 
   ///
   /// Dump built BVH to the file.
+  /// Nodes are written as is(packed 32 bytes `BVHNode<float>` layout)
+  /// after a small header(magic, format version and node size). When tree
+  /// rotation or Remove() left a child before its parent, nodes are written
+  /// in depth first order instead.
   ///
   bool Dump(const char *filename);
 
   ///
   /// Load BVH binary
+  /// Returns false when the file was not written by Dump() with the same
+  /// format version and precision, when it is truncated or contains out
+  /// of range offsets or a child placed before its parent, or when the tree
+  /// is deeper than traversal stacks support(see kTraversalStackSize).
   ///
   bool Load(const char *filename);
 
@@ -590,16 +1513,61 @@ class BVHAccel {
   bool Traverse(const Ray<T> &ray, const I &intersector, H *isect,
                 const BVHTraceOptions &options = BVHTraceOptions()) const;
 
-#if 0
-  /// Multi-hit ray traversal
-  /// Returns `max_intersections` frontmost intersections
-  template<class I, class H, class Comp>
-  bool MultiHitTraverse(const Ray<T> &ray,
-                        int max_intersections,
-                        const I &intersector,
-                        StackVector<H, 128> *isects,
-                        const BVHTraceOptions &options = BVHTraceOptions()) const;
-#endif
+  ///
+  /// Traverse into BVH with a packet of rays and find closest hit point &
+  /// primitive of each ray whose bit is set in `active_mask`.
+  /// Node boxes are fetched once per packet and tested against all active
+  /// rays. `isects[k]` is filled if `k` th ray hits.
+  /// Returns bitmask of rays which hit.
+  ///
+  template <int N, class I, class H>
+  unsigned int TraversePacket(
+      const RayPacket<T, N> &packet, unsigned int active_mask,
+      const I &intersector, H isects[N],
+      const BVHTraceOptions &options = BVHTraceOptions()) const;
+
+  ///
+  /// Traverse into BVH with a stream of `num_rays` rays and find closest hit
+  /// point & primitive of each ray.
+  /// Rays are traced in chunks. Each chunk walks the tree once, filtering
+  /// its ray index list against child boxes, so that a node or leaf is
+  /// fetched once per chunk instead of once per ray. Chunks are traced in
+  /// parallel with OpenMP, and each thread uses its own copy of
+  /// `intersector`.
+  /// `isects[i]` is filled and `hits[i]`(if not NULL) is set to 1 if `i` th
+  /// ray hits, 0 otherwise.
+  /// Returns the number of rays which hit.
+  ///
+  template <class I, class H>
+  size_t TraverseStream(
+      const Ray<T> *rays, size_t num_rays, const I &intersector, H *isects,
+      unsigned char *hits = NULL,
+      const BVHTraceOptions &options = BVHTraceOptions()) const;
+
+  ///
+  /// Occlusion(any hit) query for shadow rays. Returns true as soon as a
+  /// primitive is hit within [ray.min_t, ray.max_t]; the closest hit is not
+  /// searched. Primitives are tested with OccludedLeafPrimitive(), so that
+  /// intersectors can provide a cheaper hit only test.
+  ///
+  template <class I>
+  bool Occluded(const Ray<T> &ray, const I &intersector,
+                const BVHTraceOptions &options = BVHTraceOptions()) const;
+
+  ///
+  /// Multi-hit ray traversal.
+  /// Finds up to `max_intersections`(at most kMaxMultiHits) frontmost hits
+  /// along the ray and stores them to `isects` in front to back order.
+  /// Once `max_intersections` hits are found, the search range is shrunk to
+  /// the farthest of them. A primitive is reported at most once, even if
+  /// it is referenced from several leaves(spatial split BVH).
+  /// Returns true if there is any hit.
+  ///
+  template <class I, class H>
+  bool MultiHitTraverse(
+      const Ray<T> &ray, int max_intersections, const I &intersector,
+      StackVector<H, 128> *isects,
+      const BVHTraceOptions &options = BVHTraceOptions()) const;
 
   ///
   /// List up nodes which intersects along the ray.
@@ -610,8 +1578,13 @@ class BVHAccel {
                              const I &intersector,
                              StackVector<NodeHit<T>, 128> *hits) const;
 
-  const std::vector<BVHNode<T> > &GetNodes() const { return nodes_; }
+  const BVHNodeArray &GetNodes() const { return nodes_; }
+  const BVH4NodeArray &GetBVH4Nodes() const { return nodes4_; }
+  const BVH8NodeArray &GetBVH8Nodes() const { return nodes8_; }
+  const QuantizedBVHNodeArray &GetQuantizedNodes() const { return qnodes_; }
+  // May contain kFreePrimitiveIndex after Remove().
   const std::vector<unsigned int> &GetIndices() const { return indices_; }
+  const std::vector<T> &GetLeafTriangles() const { return leaf_triangles_; }
 
   ///
   /// Returns bounding box of built BVH.
@@ -620,6 +1593,20 @@ class BVHAccel {
     if (nodes_.empty()) {
       bmin[0] = bmin[1] = bmin[2] = std::numeric_limits<T>::max();
       bmax[0] = bmax[1] = bmax[2] = -std::numeric_limits<T>::max();
+
+      if (!qnodes_.empty()) {
+        // Union of decoded(slightly enlarged) root children.
+        T child_bmin[3][4], child_bmax[3][4];
+        qnodes_[0].Decode(child_bmin, child_bmax);
+        const unsigned int child_mask = qnodes_[0].ChildMask();
+        for (int i = 0; i < 4; i++) {
+          if (!(child_mask & (1u << i))) continue;  // empty
+          for (int k = 0; k < 3; k++) {
+            bmin[k] = std::min(bmin[k], child_bmin[k][i]);
+            bmax[k] = std::max(bmax[k], child_bmax[k][i]);
+          }
+        }
+      }
     } else {
       bmin[0] = nodes_[0].bmin[0];
       bmin[1] = nodes_[0].bmin[1];
@@ -630,7 +1617,7 @@ class BVHAccel {
     }
   }
 
-  bool IsValid() const { return nodes_.size() > 0; }
+  bool IsValid() const { return (nodes_.size() > 0) || (qnodes_.size() > 0); }
 
  private:
 #if NANORT_ENABLE_PARALLEL_BUILD
@@ -645,24 +1632,344 @@ class BVHAccel {
 
   /// Builds shallow BVH tree recursively.
   template <class P, class Pred>
-  unsigned int BuildShallowTree(std::vector<BVHNode<T> > *out_nodes,
+  unsigned int BuildShallowTree(BVHNodeArray *out_nodes,
                                 unsigned int left_idx, unsigned int right_idx,
                                 unsigned int depth,
                                 unsigned int max_shallow_depth, const P &p,
                                 const Pred &pred);
 #endif
 
+#if NANORT_ENABLE_PARALLEL_BUILD && defined(NANORT_USE_OPENMP_TASK)
+  /// Builds BVH subtree for [left_idx, right_idx) at `nodes[node_index]`
+  /// with OpenMP tasks. Children are written to the pair of slots allocated
+  /// from `num_nodes`, thus `nodes` must have room for 2 * n - 1 nodes.
+  /// Tree is independent of task scheduling but node order is not.
+  /// Must be called inside a parallel region.
+  template <class P, class Pred>
+  void BuildTreeTask(BVHNode<T> *nodes, unsigned int *num_nodes,
+                     unsigned int node_index, unsigned int left_idx,
+                     unsigned int right_idx, unsigned int depth, const P &p,
+                     const Pred &pred);
+
+  /// Computes bounding box of [left_idx, right_idx) with OpenMP tasks.
+  template <class P>
+  void ComputeBoundingBoxTask(real3<T> *bmin, real3<T> *bmax,
+                              unsigned int left_idx, unsigned int right_idx,
+                              const P &p);
+
+  /// Bins [left_idx, right_idx) with OpenMP tasks.
+  template <class P>
+  void ContributeBinBufferTask(BinBuffer *bins, const real3<T> &bmin,
+                               const real3<T> &bmax, unsigned int left_idx,
+                               unsigned int right_idx, const P &p);
+
+  /// Partitions [left_idx, right_idx) of indices_ with OpenMP tasks.
+  /// Returns the index of the first element of the second group.
+  template <class Pred>
+  unsigned int PartitionTask(unsigned int left_idx, unsigned int right_idx,
+                             const Pred &pred);
+
+  /// Same as NodeSplitter, but with OpenMP tasks.
+  struct TaskNodeSplitter {
+    explicit TaskNodeSplitter(BVHAccel *accel) : accel_(accel) {}
+
+    template <class P>
+    void ContributeBins(BinBuffer *bins, const real3<T> &bmin,
+                        const real3<T> &bmax, unsigned int left_idx,
+                        unsigned int right_idx, const P &p) const {
+      accel_->ContributeBinBufferTask(bins, bmin, bmax, left_idx, right_idx,
+                                      p);
+    }
+
+    template <class Pred>
+    unsigned int Partition(unsigned int left_idx, unsigned int right_idx,
+                           const Pred &pred) const {
+      return accel_->PartitionTask(left_idx, right_idx, pred);
+    }
+
+    BVHAccel *accel_;
+  };
+
+#endif
+
+#if NANORT_ENABLE_PARALLEL_BUILD && defined(NANORT_USE_TASK_SCHEDULER)
+  TaskScheduler *GetTaskScheduler() const {
+    return task_scheduler_ ? task_scheduler_ : GetDefaultTaskScheduler();
+  }
+
+  /// Same as the OpenMP version, but runs tasks on `scheduler` and adds them
+  /// to `group`. `bins` and `sweep` are the scratch buffers of the calling
+  /// task.
+  template <class P, class Pred>
+  void BuildTreeTask(TaskScheduler *scheduler, TaskGroup *group,
+                     BVHNode<T> *nodes, std::atomic<unsigned int> *num_nodes,
+                     unsigned int node_index, unsigned int left_idx,
+                     unsigned int right_idx, unsigned int depth,
+                     BinBuffer *bins, SweepBuffer<T> *sweep, const P &p,
+                     const Pred &pred);
+
+  template <class P>
+  void ComputeBoundingBoxTask(TaskScheduler *scheduler, real3<T> *bmin,
+                              real3<T> *bmax, unsigned int left_idx,
+                              unsigned int right_idx, const P &p);
+
+  template <class P>
+  void ContributeBinBufferTask(TaskScheduler *scheduler, BinBuffer *bins,
+                               const real3<T> &bmin, const real3<T> &bmax,
+                               unsigned int left_idx, unsigned int right_idx,
+                               const P &p);
+
+  template <class Pred>
+  unsigned int PartitionTask(TaskScheduler *scheduler, unsigned int left_idx,
+                             unsigned int right_idx, const Pred &pred);
+
+  /// Same as NodeSplitter, but with tasks on `scheduler`.
+  struct SchedulerNodeSplitter {
+    SchedulerNodeSplitter(BVHAccel *accel, TaskScheduler *scheduler)
+        : accel_(accel), scheduler_(scheduler) {}
+
+    template <class P>
+    void ContributeBins(BinBuffer *bins, const real3<T> &bmin,
+                        const real3<T> &bmax, unsigned int left_idx,
+                        unsigned int right_idx, const P &p) const {
+      accel_->ContributeBinBufferTask(scheduler_, bins, bmin, bmax, left_idx,
+                                      right_idx, p);
+    }
+
+    template <class Pred>
+    unsigned int Partition(unsigned int left_idx, unsigned int right_idx,
+                           const Pred &pred) const {
+      return accel_->PartitionTask(scheduler_, left_idx, right_idx, pred);
+    }
+
+    BVHAccel *accel_;
+    TaskScheduler *scheduler_;
+  };
+#endif
+
+  /// Builds binary BVH with binned SAH.
+  template <class P, class Pred>
+  void BuildSAHTree(unsigned int num_primitives, const P &p,
+                    const Pred &pred);
+
+  /// Computes primitive bounding boxes(when not cached in bboxes_) and
+  /// Morton codes of their centroids, then sorts indices_ and `codes` by
+  /// the codes. Returns primitive bounding boxes(bboxes_ or `local_bboxes`).
+  /// `K` is Morton code type(see MortonCodeTraits).
+  template <class K, class P>
+  const BBox<T> *SortByMortonCodes(unsigned int num_primitives, const P &p,
+                                   std::vector<BBox<T> > *local_bboxes,
+                                   std::vector<K> *codes);
+
+  /// Builds linear BVH from Morton codes(of type `K`) of primitive
+  /// centroids.
+  template <class K, class P>
+  bool BuildLBVH(unsigned int num_primitives, const P &p);
+
+  /// Builds LBVH treelets for primitives sharing upper Morton code bits,
+  /// then builds top levels over treelet bounds with binned SAH.
+  template <class K, class P>
+  bool BuildHLBVH(unsigned int num_primitives, const P &p);
+
+  /// Builds top levels of HLBVH for treelets [left_idx, right_idx) of
+  /// `treelet_ids`. Branch nodes are allocated from `next_slot`.
+  /// Returns node index of the subtree root.
+  unsigned int BuildHLBVHTopNode(BVHNode<T> *nodes, unsigned int *treelet_ids,
+                                 unsigned int left_idx, unsigned int right_idx,
+                                 const std::vector<BBox<T> > &treelet_bboxes,
+                                 const std::vector<unsigned int> &treelet_roots,
+                                 unsigned int *next_slot);
+
+  /// Emits LBVH subtree for sorted Morton codes [left_idx, right_idx) at
+  /// `nodes[node_index]`. The subtree owns node slots
+  /// [node_index, node_index + 2 * n - 1) as in BuildTreeTask().
+  template <class K>
+  void EmitLBVHNode(BVHNode<T> *nodes, unsigned int node_index,
+                    const K *codes, const BBox<T> *prim_bboxes,
+                    unsigned int left_idx, unsigned int right_idx,
+                    unsigned int depth, int axis);
+
+  /// Builds spatial split BVH.
+  template <class P>
+  void BuildSBVH(unsigned int num_primitives, const P &p);
+
+  /// Builds SBVH subtree for `refs` recursively. `refs` is released before
+  /// building child subtrees.
+  template <class P>
+  unsigned int BuildSBVHNode(std::vector<SBVHReference<T> > *refs,
+                             unsigned int depth, const P &p,
+                             SBVHBuildState<T> *state);
+
+  /// Applies tree rotations to the subtree at `node_index` in post order.
+  /// Returns the number of rotations applied.
+  unsigned int RotateSubtree(unsigned int node_index, unsigned int depth);
+
+  /// Applies the best rotation at `node_index` if it reduces surface area.
+  bool RotateNode(unsigned int node_index);
+
+  /// Runs at most `max_passes` tree rotation passes. No more pass is started
+  /// after `deadline_secs`(see IsPastDeadline()).
+  void RotateTree(unsigned int max_passes, double deadline_secs = 0.0);
+
+  /// Copies nodes reachable from the root to `out_nodes` in depth first
+  /// order(see ReorderNodes()). Children are always placed after their
+  /// parent.
+  void GetDepthFirstNodes(BVHNodeArray *out_nodes) const;
+
+  /// Sets split axis of the branch node from its children's centers so that
+  /// near child is traversed first, then recomputes bounds.
+  void UpdateBranchNode(unsigned int node_index);
+
+  /// Fills parents_, heights_ and prim_leaves_ for Insert()/Remove().
+  /// Returns false when a primitive is referenced from multiple leaves.
+  bool BuildParentLinks();
+
+  /// Returns a free node slot in nodes_.
+  unsigned int AllocateNode();
+
+  /// Returns the node which the new leaf with bounds `bmin`, `bmax` is placed
+  /// next to by Insert().
+  unsigned int FindInsertSibling(const real3<T> &bmin,
+                                 const real3<T> &bmax) const;
+
+  /// Sets parents_ and heights_ of the children of branch node `node_index`
+  /// and of the node itself, e.g. after RotateNode().
+  void UpdateChildLinks(unsigned int node_index);
+
+  /// Recomputes bounds and heights of `node_index` and its ancestors. With
+  /// `rotate`, RotateNode() is applied to each ancestor as well, unless the
+  /// rotation makes the ancestor's subtree taller.
+  void UpdateAncestors(unsigned int node_index, bool rotate);
+
+  /// Recomputes bounds of the subtree at `node_index` in post order.
+  template <class P>
+  void RefitNode(unsigned int node_index, unsigned int depth, const P &p);
+
+  /// Copies nodes reachable from `sparse_nodes[0]` to nodes_ in depth first
+  /// order(same layout as BuildTree()) and fills statistics.
+  void CompactNodes(const BVHNodeArray &sparse_nodes);
+
+  /// Recomputes node counts, tree depth and SAH cost of stats_ from nodes_.
+  void UpdateStatistics();
+
+  /// Allocates binning and sweep buffers for each thread(kept across builds).
+  void PrepareThreadBinBuffers();
+
+  /// Returns binning buffer of the calling thread.
+  BinBuffer *GetThreadBinBuffer();
+
+  /// Returns sweep SAH buffer of the calling thread.
+  SweepBuffer<T> *GetThreadSweepBuffer();
+
+  /// Splits primitives in [left_idx, right_idx) with sweep SAH. indices_ in
+  /// the range are sorted along `cut_axis` and [left_idx, `mid_idx`) goes to
+  /// the left child. `split_cost` is the SAH cost of the split.
+  template <class P>
+  void FindSweepSplit(unsigned int *mid_idx, int *cut_axis, T *split_cost,
+                      SweepBuffer<T> *sweep, const real3<T> &bmin,
+                      const real3<T> &bmax, unsigned int left_idx,
+                      unsigned int right_idx, const P &p);
+
+  /// Returns true when primitives in [left_idx, right_idx) fit in a leaf and
+  /// the leaf is not more expensive than splitting them at `mid_idx`(SAH).
+  template <class P>
+  bool IsLeafCheaper(const real3<T> &bmin, const real3<T> &bmax,
+                     unsigned int left_idx, unsigned int mid_idx,
+                     unsigned int right_idx, const P &p);
+
+  /// Same as above for a split whose SAH cost is already known.
+  bool IsLeafCheaper(unsigned int n, T split_cost) const;
+
+  /// Bins and partitions primitives of a node on the calling thread for
+  /// FindNodeSplit().
+  struct NodeSplitter {
+    explicit NodeSplitter(BVHAccel *accel) : accel_(accel) {}
+
+    template <class P>
+    void ContributeBins(BinBuffer *bins, const real3<T> &bmin,
+                        const real3<T> &bmax, unsigned int left_idx,
+                        unsigned int right_idx, const P &p) const {
+      ContributeBinBuffer(bins, bmin, bmax, &accel_->indices_.at(0), left_idx,
+                          right_idx, p);
+    }
+
+    template <class Pred>
+    unsigned int Partition(unsigned int left_idx, unsigned int right_idx,
+                           const Pred &pred) const {
+      unsigned int *begin = &accel_->indices_[left_idx];
+      unsigned int *mid =
+          std::partition(begin, begin + (right_idx - left_idx), pred);
+      return left_idx + static_cast<unsigned int>(mid - begin);
+    }
+
+    BVHAccel *accel_;
+  };
+
+  /// Finds the split of a branch node holding [left_idx, right_idx) with
+  /// bounds `bmin`, `bmax`, shared by BuildTree() and BuildTreeTask(). Nodes
+  /// with up to `sweep_sah_threshold` primitives use sweep SAH. Otherwise the
+  /// binned SAH cut(spatial median once the build time budget is used up) is
+  /// tried on each axis until it separates the primitives, falling back to
+  /// object median. `splitter` bins and partitions indices_ using `bins`
+  /// (see NodeSplitter). Returns true when a leaf is cheaper than the split.
+  template <class P, class Pred, class S>
+  bool FindNodeSplit(unsigned int *mid_idx, int *cut_axis, BinBuffer *bins,
+                     SweepBuffer<T> *sweep, const real3<T> &bmin,
+                     const real3<T> &bmax, unsigned int left_idx,
+                     unsigned int right_idx, const P &p, const Pred &pred,
+                     const S &splitter);
+
   /// Builds BVH tree recursively.
   template <class P, class Pred>
   unsigned int BuildTree(BVHBuildStatistics *out_stat,
-                         std::vector<BVHNode<T> > *out_nodes,
+                         BVHNodeArray *out_nodes,
                          unsigned int left_idx, unsigned int right_idx,
                          unsigned int depth, const P &p, const Pred &pred);
 
+  template <int N>
+  void BuildWideNodes(
+      std::vector<WideBVHNode<T, N>, AlignedAllocator<WideBVHNode<T, N>, 64> >
+          *out_nodes) const;
+
+  /// Collapses binary BVH subtree at `node_index` into N-wide nodes.
+  template <int N>
+  unsigned int CollapseBVHNode(
+      std::vector<WideBVHNode<T, N>, AlignedAllocator<WideBVHNode<T, N>, 64> >
+          *out_nodes,
+      unsigned int node_index) const;
+
+  /// Traverses N-wide BVH. `A` is an array of WideBVHNode or
+  /// QuantizedBVHNode.
+  template <int N, class A, class I, class H>
+  bool TraverseWide(const A &wide_nodes, const Ray<T> &ray,
+                    const I &intersector, H *isect,
+                    const BVHTraceOptions &options) const;
+
+  template <int N, class A, class I>
+  bool OccludedWide(const A &wide_nodes, const Ray<T> &ray,
+                    const I &intersector, const BVHTraceOptions &options) const;
+
+  template <class I>
+  bool OccludedLeafPrimitives(unsigned int offset,
+                              unsigned int num_primitives, T max_t,
+                              const I &intersector) const;
+
+  template <class I, class H>
+  size_t TraverseStreamChunk(const Ray<T> *rays, size_t num_rays,
+                             const I &intersector,
+                             RayStreamIntersector<T, I> *stream_intersector,
+                             StreamBuffer<T> *buffer, H *isects,
+                             unsigned char *hits,
+                             const BVHTraceOptions &options) const;
+
   template <class I>
   bool TestLeafNode(const BVHNode<T> &node, const Ray<T> &ray,
                     const I &intersector) const;
 
+  template <class I>
+  bool TestLeafPrimitives(unsigned int offset, unsigned int num_primitives,
+                          const I &intersector) const;
+
   template <class I>
   bool TestLeafNodeIntersections(
       const BVHNode<T> &node, const Ray<T> &ray, const int max_intersections,
@@ -670,19 +1977,44 @@ class BVHAccel {
       std::priority_queue<NodeHit<T>, std::vector<NodeHit<T> >,
                           NodeHitComparator<T> > *isect_pq) const;
 
-#if 0
-  template<class I, class H, class Comp>
-  bool MultiHitTestLeafNode(std::priority_queue<H, std::vector<H>, Comp> *isect_pq,
-                            int max_intersections,
-                            const BVHNode<T> &node, const Ray<T> &ray,
-                            const I &intersector) const;
-#endif
+  template <int N, class A, class I>
+  void MultiHitTraverseWide(const A &wide_nodes, const Ray<T> &ray,
+                            const I &intersector,
+                            MultiHitBuffer<T> *buffer) const;
 
-  std::vector<BVHNode<T> > nodes_;
+  template <class I>
+  void MultiHitTestLeafPrimitives(unsigned int offset,
+                                  unsigned int num_primitives, T max_t,
+                                  const I &intersector,
+                                  MultiHitBuffer<T> *buffer) const;
+
+  BVHNodeArray nodes_;
+  BVH4NodeArray nodes4_;
+  BVH8NodeArray nodes8_;
+  QuantizedBVHNodeArray qnodes_;
   std::vector<unsigned int> indices_;  // max 4G triangles.
+  std::vector<T> leaf_triangles_;      // 9 values per indices_ entry.
   std::vector<BBox<T> > bboxes_;
+  std::vector<BinBuffer> thread_bins_;  // Scratch for BuildTree().
+  std::vector<SweepBuffer<T> > thread_sweeps_;
+
+  // Used by Insert()/Remove(). parents_, heights_ and prim_leaves_ are built
+  // on demand and cleared whenever node indices change.
+  std::vector<unsigned int> parents_;      // node index -> parent node index
+  std::vector<unsigned int> heights_;      // node index -> subtree height
+  std::vector<unsigned int> prim_leaves_;  // primitive -> leaf node index
+  std::vector<unsigned int> free_nodes_;
+  std::vector<unsigned int> free_indices_;
+
   BVHBuildOptions<T> options_;
   BVHBuildStatistics stats_;
+
+  // End of BVHBuildOptions::build_time_budget in GetWallClockSecs() time.
+  // 0 = no budget. Only used by Build().
+  double build_deadline_secs_;
+#if defined(NANORT_USE_TASK_SCHEDULER)
+  TaskScheduler *task_scheduler_;
+#endif
   unsigned int pad0_;
 };
 
@@ -780,6 +2112,111 @@ class TriangleMesh {
   const size_t vertex_stride_bytes_;
 };
 
+///
+/// Computes bounds of the part of `prim_index` th primitive inside the clip
+/// box [clip_bmin, clip_bmax]. Used to split primitive references in
+/// spatial split BVH build. Returns false if the primitive does not overlap
+/// the clip box.
+/// This generic version intersects primitive bounds with the clip box.
+/// Overload this function for your geometry class to get tighter bounds.
+///
+template <typename T, class P>
+inline bool ClipPrimitiveBounds(real3<T> *bmin, real3<T> *bmax, const P &p,
+                                unsigned int prim_index,
+                                const real3<T> &clip_bmin,
+                                const real3<T> &clip_bmax) {
+  p.BoundingBox(bmin, bmax, prim_index);
+  for (int k = 0; k < 3; k++) {
+    (*bmin)[k] = std::max((*bmin)[k], clip_bmin[k]);
+    (*bmax)[k] = std::min((*bmax)[k], clip_bmax[k]);
+    if ((*bmin)[k] > (*bmax)[k]) {
+      return false;
+    }
+  }
+  return true;
+}
+
+/// Clips the triangle polygon by the clip box.
+template <typename T>
+inline bool ClipPrimitiveBounds(real3<T> *bmin, real3<T> *bmax,
+                                const TriangleMesh<T> &mesh,
+                                unsigned int prim_index,
+                                const real3<T> &clip_bmin,
+                                const real3<T> &clip_bmax) {
+  // Each clip plane adds at most one vertex: 3 + 6 = 9.
+  real3<T> polygons[2][9];
+  int num_vertices = 3;
+  int cur = 0;
+
+  for (int i = 0; i < 3; i++) {
+    polygons[0][i] = real3<T>(
+        get_vertex_addr(mesh.vertices_, mesh.faces_[3 * prim_index + i],
+                        mesh.vertex_stride_bytes_));
+  }
+
+  // Sutherland-Hodgman clipping against 6 planes of the clip box.
+  for (int k = 0; k < 3; k++) {
+    for (int side = 0; side < 2; side++) {
+      const T plane = (side == 0) ? clip_bmin[k] : clip_bmax[k];
+      const real3<T> *in = polygons[cur];
+      real3<T> *out = polygons[1 - cur];
+      int n = 0;
+
+      // Skip the plane if the polygon is entirely inside.
+      bool inside = true;
+      for (int i = 0; i < num_vertices; i++) {
+        if ((side == 0) ? (in[i][k] < plane) : (in[i][k] > plane)) {
+          inside = false;
+          break;
+        }
+      }
+      if (inside) {
+        continue;
+      }
+
+      for (int i = 0; i < num_vertices; i++) {
+        const real3<T> &a = in[i];
+        const real3<T> &b = in[(i + 1) % num_vertices];
+        // Signed distance, positive inside.
+        const T da = (side == 0) ? (a[k] - plane) : (plane - a[k]);
+        const T db = (side == 0) ? (b[k] - plane) : (plane - b[k]);
+
+        if (da >= static_cast<T>(0.0)) {
+          out[n++] = a;
+        }
+        if ((da < static_cast<T>(0.0)) != (db < static_cast<T>(0.0))) {
+          real3<T> q = a + (b - a) * (da / (da - db));
+          q[k] = plane;
+          out[n++] = q;
+        }
+      }
+
+      num_vertices = n;
+      cur = 1 - cur;
+      if (num_vertices == 0) {
+        return false;
+      }
+    }
+  }
+
+  (*bmin) = polygons[cur][0];
+  (*bmax) = polygons[cur][0];
+  for (int i = 1; i < num_vertices; i++) {
+    for (int k = 0; k < 3; k++) {
+      (*bmin)[k] = std::min((*bmin)[k], polygons[cur][i][k]);
+      (*bmax)[k] = std::max((*bmax)[k], polygons[cur][i][k]);
+    }
+  }
+
+  // Make sure rounding error does not push bounds out of the clip box.
+  for (int k = 0; k < 3; k++) {
+    (*bmin)[k] = std::max((*bmin)[k], clip_bmin[k]);
+    (*bmax)[k] = std::min((*bmax)[k], clip_bmax[k]);
+  }
+
+  return true;
+}
+
 template <typename T = float>
 class TriangleIntersection {
  public:
@@ -791,6 +2228,22 @@ class TriangleIntersection {
   unsigned int prim_id;
 };
 
+/// Per-ray coefficients of watertight ray/triangle intersection for a packet
+/// of `N` rays(see TriangleIntersector::PreparePacketTraversal()).
+template <typename T, int N>
+struct TrianglePacketCoeff {
+  T org_x[N];  // ray origin permuted to (kx, ky, kz) axes.
+  T org_y[N];
+  T org_z[N];
+  T Sx[N];
+  T Sy[N];
+  T Sz[N];
+  int kx[N];
+  int ky[N];
+  int kz[N];
+  T min_t[N];
+};
+
 template <typename T = float, class H = TriangleIntersection<T> >
 class TriangleIntersector {
  public:
@@ -813,6 +2266,13 @@ class TriangleIntersector {
     int kz;
   } RayCoeff;
 
+  /// Ray dependent state set by PrepareTraversal()(see PrepareRayState()).
+  typedef struct {
+    real3<T> org;
+    RayCoeff coeff;
+    T min_t;
+  } RayState;
+
   /// Do ray interesection stuff for `prim_index` th primitive and return hit
   /// distance `t`,
   /// varycentric coordinate `u` and `v`.
@@ -831,81 +2291,27 @@ class TriangleIntersector {
     const real3<T> p1(get_vertex_addr(vertices_, f1 + 0, vertex_stride_bytes_));
     const real3<T> p2(get_vertex_addr(vertices_, f2 + 0, vertex_stride_bytes_));
 
-    const real3<T> A = p0 - ray_org_;
-    const real3<T> B = p1 - ray_org_;
-    const real3<T> C = p2 - ray_org_;
-
-    const T Ax = A[ray_coeff_.kx] - ray_coeff_.Sx * A[ray_coeff_.kz];
-    const T Ay = A[ray_coeff_.ky] - ray_coeff_.Sy * A[ray_coeff_.kz];
-    const T Bx = B[ray_coeff_.kx] - ray_coeff_.Sx * B[ray_coeff_.kz];
-    const T By = B[ray_coeff_.ky] - ray_coeff_.Sy * B[ray_coeff_.kz];
-    const T Cx = C[ray_coeff_.kx] - ray_coeff_.Sx * C[ray_coeff_.kz];
-    const T Cy = C[ray_coeff_.ky] - ray_coeff_.Sy * C[ray_coeff_.kz];
-
-    T U = Cx * By - Cy * Bx;
-    T V = Ax * Cy - Ay * Cx;
-    T W = Bx * Ay - By * Ax;
-
-#ifdef __clang__
-#pragma clang diagnostic push
-#pragma clang diagnostic ignored "-Wfloat-equal"
-#endif
-
-    // Fall back to test against edges using double precision.
-    if (U == static_cast<T>(0.0) || V == static_cast<T>(0.0) || W == static_cast<T>(0.0)) {
-      double CxBy = static_cast<double>(Cx) * static_cast<double>(By);
-      double CyBx = static_cast<double>(Cy) * static_cast<double>(Bx);
-      U = static_cast<T>(CxBy - CyBx);
-
-      double AxCy = static_cast<double>(Ax) * static_cast<double>(Cy);
-      double AyCx = static_cast<double>(Ay) * static_cast<double>(Cx);
-      V = static_cast<T>(AxCy - AyCx);
-
-      double BxAy = static_cast<double>(Bx) * static_cast<double>(Ay);
-      double ByAx = static_cast<double>(By) * static_cast<double>(Ax);
-      W = static_cast<T>(BxAy - ByAx);
-    }
-
-    if (trace_options_.cull_back_face) {
-      if (U < static_cast<T>(0.0) || V < static_cast<T>(0.0) || W < static_cast<T>(0.0)) return false;
-    } else {
-      if ((U < static_cast<T>(0.0) || V < static_cast<T>(0.0) || W < static_cast<T>(0.0)) && (U > static_cast<T>(0.0) || V > static_cast<T>(0.0) || W > static_cast<T>(0.0))) {
-        return false;
-      }
-    }
-
-    T det = U + V + W;
-    if (det == static_cast<T>(0.0)) return false;
-
-#ifdef __clang__
-#pragma clang diagnostic pop
-#endif
-
-    const T Az = ray_coeff_.Sz * A[ray_coeff_.kz];
-    const T Bz = ray_coeff_.Sz * B[ray_coeff_.kz];
-    const T Cz = ray_coeff_.Sz * C[ray_coeff_.kz];
-    const T D = U * Az + V * Bz + W * Cz;
-
-    const T rcpDet = static_cast<T>(1.0) / det;
-    T tt = D * rcpDet;
+    return IntersectTriangle(t_inout, p0, p1, p2);
+  }
 
-    if (tt > (*t_inout)) {
+  /// Hit only test for occlusion query(see BVHAccel::Occluded()).
+  /// Returns true if `prim_index` th primitive is hit within
+  /// [ray.min_t, max_t]. Cheaper than Intersect() since hit distance and
+  /// barycentric coordinate are not computed.
+  bool Occluded(T max_t, const unsigned int prim_index) const {
+    if (!IsInPrimRange(prim_index)) {
       return false;
     }
 
-    if (tt < t_min_) {
-      return false;
-    }
+    const unsigned int f0 = faces_[3 * prim_index + 0];
+    const unsigned int f1 = faces_[3 * prim_index + 1];
+    const unsigned int f2 = faces_[3 * prim_index + 2];
 
-    (*t_inout) = tt;
-    // Use Thomas-Mueller style barycentric coord.
-    // U + V + W = 1.0 and interp(p) = U * p0 + V * p1 + W * p2
-    // We want interp(p) = (1 - u - v) * p0 + u * v1 + v * p2;
-    // => u = V, v = W.
-    u_ = V * rcpDet;
-    v_ = W * rcpDet;
+    const real3<T> p0(get_vertex_addr(vertices_, f0 + 0, vertex_stride_bytes_));
+    const real3<T> p1(get_vertex_addr(vertices_, f1 + 0, vertex_stride_bytes_));
+    const real3<T> p2(get_vertex_addr(vertices_, f2 + 0, vertex_stride_bytes_));
 
-    return true;
+    return OccludeTriangle(max_t, p0, p1, p2);
   }
 
   /// Returns the nearest hit distance.
@@ -921,38 +2327,57 @@ class TriangleIntersector {
   /// This function is called only once in BVH traversal.
   void PrepareTraversal(const Ray<T> &ray,
                         const BVHTraceOptions &trace_options) const {
-    ray_org_[0] = ray.org[0];
-    ray_org_[1] = ray.org[1];
-    ray_org_[2] = ray.org[2];
+    RayState state;
+    PrepareRayState(ray, &state);
+    SetRayState(state);
+
+    trace_options_ = trace_options;
+  }
+
+  /// Computes ray dependent state of PrepareTraversal() into `state`, so
+  /// that a ray can be selected again with SetRayState() without
+  /// recomputing it(see BVHAccel::TraverseStream()).
+  void PrepareRayState(const Ray<T> &ray, RayState *state) const {
+    state->org[0] = ray.org[0];
+    state->org[1] = ray.org[1];
+    state->org[2] = ray.org[2];
+
+    RayCoeff &coeff = state->coeff;
 
     // Calculate dimension where the ray direction is maximal.
-    ray_coeff_.kz = 0;
+    coeff.kz = 0;
     T absDir = std::fabs(ray.dir[0]);
     if (absDir < std::fabs(ray.dir[1])) {
-      ray_coeff_.kz = 1;
+      coeff.kz = 1;
       absDir = std::fabs(ray.dir[1]);
     }
     if (absDir < std::fabs(ray.dir[2])) {
-      ray_coeff_.kz = 2;
+      coeff.kz = 2;
       absDir = std::fabs(ray.dir[2]);
     }
 
-    ray_coeff_.kx = ray_coeff_.kz + 1;
-    if (ray_coeff_.kx == 3) ray_coeff_.kx = 0;
-    ray_coeff_.ky = ray_coeff_.kx + 1;
-    if (ray_coeff_.ky == 3) ray_coeff_.ky = 0;
+    coeff.kx = coeff.kz + 1;
+    if (coeff.kx == 3) coeff.kx = 0;
+    coeff.ky = coeff.kx + 1;
+    if (coeff.ky == 3) coeff.ky = 0;
 
     // Swap kx and ky dimension to preserve widing direction of triangles.
-    if (ray.dir[ray_coeff_.kz] < static_cast<T>(0.0)) std::swap(ray_coeff_.kx, ray_coeff_.ky);
+    if (ray.dir[coeff.kz] < static_cast<T>(0.0)) std::swap(coeff.kx, coeff.ky);
 
     // Calculate shear constants.
-    ray_coeff_.Sx = ray.dir[ray_coeff_.kx] / ray.dir[ray_coeff_.kz];
-    ray_coeff_.Sy = ray.dir[ray_coeff_.ky] / ray.dir[ray_coeff_.kz];
-    ray_coeff_.Sz = static_cast<T>(1.0) / ray.dir[ray_coeff_.kz];
+    coeff.Sx = ray.dir[coeff.kx] / ray.dir[coeff.kz];
+    coeff.Sy = ray.dir[coeff.ky] / ray.dir[coeff.kz];
+    coeff.Sz = static_cast<T>(1.0) / ray.dir[coeff.kz];
 
-    trace_options_ = trace_options;
+    state->min_t = ray.min_t;
+  }
 
-    t_min_ = ray.min_t;
+  /// Selects the ray of `state` computed by PrepareRayState(). Trace options
+  /// of the last PrepareTraversal() call are kept.
+  void SetRayState(const RayState &state) const {
+    ray_org_ = state.org;
+    ray_coeff_ = state.coeff;
+    t_min_ = state.min_t;
 
     u_ = static_cast<T>(0.0);
     v_ = static_cast<T>(0.0);
@@ -970,52 +2395,728 @@ class TriangleIntersector {
     (void)ray;
   }
 
- private:
-  const T *vertices_;
-  const unsigned int *faces_;
-  const size_t vertex_stride_bytes_;
-
-  mutable real3<T> ray_org_;
-  mutable RayCoeff ray_coeff_;
-  mutable BVHTraceOptions trace_options_;
-  mutable T t_min_;
-
-  mutable T t_;
-  mutable T u_;
-  mutable T v_;
-  mutable unsigned int prim_id_;
-  int _pad_;
-};
-
-//
-// Robust BVH Ray Traversal : http://jcgt.org/published/0002/02/02/paper.pdf
-//
+  /// Packet version of PrepareTraversal(). Per-ray state is stored to
+  /// `coeff` instead of the intersector.
+  template <int N>
+  void PreparePacketTraversal(const RayPacket<T, N> &packet,
+                              const BVHTraceOptions &trace_options,
+                              TrianglePacketCoeff<T, N> *coeff) const {
+    for (int k = 0; k < N; k++) {
+      const T dx = packet.dir[0][k];
+      const T dy = packet.dir[1][k];
+      const T dz = packet.dir[2][k];
+
+      int kz = 0;
+      T absDir = std::fabs(dx);
+      if (absDir < std::fabs(dy)) {
+        kz = 1;
+        absDir = std::fabs(dy);
+      }
+      if (absDir < std::fabs(dz)) {
+        kz = 2;
+      }
 
-// NaN-safe min and max function.
-template <class T>
-const T &safemin(const T &a, const T &b) {
-  return (a < b) ? a : b;
-}
-template <class T>
-const T &safemax(const T &a, const T &b) {
-  return (a > b) ? a : b;
-}
+      int kx = kz + 1;
+      if (kx == 3) kx = 0;
+      int ky = kx + 1;
+      if (ky == 3) ky = 0;
+
+      const T dir_kz = packet.dir[kz][k];
+      if (dir_kz < static_cast<T>(0.0)) std::swap(kx, ky);
+
+      coeff->org_x[k] = packet.org[kx][k];
+      coeff->org_y[k] = packet.org[ky][k];
+      coeff->org_z[k] = packet.org[kz][k];
+      coeff->Sx[k] = packet.dir[kx][k] / dir_kz;
+      coeff->Sy[k] = packet.dir[ky][k] / dir_kz;
+      coeff->Sz[k] = static_cast<T>(1.0) / dir_kz;
+      coeff->kx[k] = kx;
+      coeff->ky[k] = ky;
+      coeff->kz[k] = kz;
+      coeff->min_t[k] = packet.min_t[k];
+    }
 
-//
-// SAH functions
-//
-struct BinBuffer {
-  explicit BinBuffer(unsigned int size) {
-    bin_size = size;
-    bin.resize(2 * 3 * size);
-    clear();
+    trace_options_ = trace_options;
   }
 
-  void clear() { memset(&bin[0], 0, sizeof(size_t) * 2 * 3 * bin_size); }
+  /// Intersects `prim_index` th primitive with rays of a packet whose bit is
+  /// set in `lane_mask`. Hit distance and barycentric coordinate of rays
+  /// which find a closer hit than `t_inout` are updated.
+  /// Returns bitmask of updated rays.
+  template <int N>
+  unsigned int IntersectPacket(T t_inout[N], T u_out[N], T v_out[N],
+                               unsigned int lane_mask,
+                               const TrianglePacketCoeff<T, N> &coeff,
+                               const unsigned int prim_index) const {
+    if (!IsInPrimRange(prim_index)) {
+      return 0;
+    }
 
-  std::vector<size_t> bin;  // (min, max) * xyz * binsize
-  unsigned int bin_size;
-  unsigned int pad0;
+    const unsigned int f0 = faces_[3 * prim_index + 0];
+    const unsigned int f1 = faces_[3 * prim_index + 1];
+    const unsigned int f2 = faces_[3 * prim_index + 2];
+
+    const real3<T> p0(get_vertex_addr(vertices_, f0 + 0, vertex_stride_bytes_));
+    const real3<T> p1(get_vertex_addr(vertices_, f1 + 0, vertex_stride_bytes_));
+    const real3<T> p2(get_vertex_addr(vertices_, f2 + 0, vertex_stride_bytes_));
+
+    return IntersectTrianglePacket(t_inout, u_out, v_out, lane_mask, coeff, p0,
+                                   p1, p2);
+  }
+
+ protected:
+  /// Returns true if `prim_index` is within trace option's prim_ids_range.
+  bool IsInPrimRange(const unsigned int prim_index) const {
+    return (prim_index >= trace_options_.prim_ids_range[0]) &&
+           (prim_index < trace_options_.prim_ids_range[1]);
+  }
+
+  /// Watertight ray/triangle intersection for triangle (p0, p1, p2).
+  bool IntersectTriangle(T *t_inout, const real3<T> &p0, const real3<T> &p1,
+                         const real3<T> &p2) const {
+    T U, V, W, det, D;
+    if (!TestTriangleEdges(&U, &V, &W, &det, &D, p0, p1, p2)) {
+      return false;
+    }
+
+    const T rcpDet = static_cast<T>(1.0) / det;
+    T tt = D * rcpDet;
+
+    if (tt > (*t_inout)) {
+      return false;
+    }
+
+    if (tt < t_min_) {
+      return false;
+    }
+
+    (*t_inout) = tt;
+    // Use Thomas-Mueller style barycentric coord.
+    // U + V + W = 1.0 and interp(p) = U * p0 + V * p1 + W * p2
+    // We want interp(p) = (1 - u - v) * p0 + u * v1 + v * p2;
+    // => u = V, v = W.
+    u_ = V * rcpDet;
+    v_ = W * rcpDet;
+
+    return true;
+  }
+
+  /// Packet version of IntersectTriangle(). See IntersectPacket().
+  template <int N>
+  unsigned int IntersectTrianglePacket(T t_inout[N], T u_out[N], T v_out[N],
+                                       unsigned int lane_mask,
+                                       const TrianglePacketCoeff<T, N> &coeff,
+                                       const real3<T> &p0, const real3<T> &p1,
+                                       const real3<T> &p2) const {
+    // Branch free shear of TestTriangleEdges() for all lanes, so that the
+    // compiler can vectorize it. Axes are selected per lane.
+    T Ax[N], Ay[N], Bx[N], By[N], Cx[N], Cy[N];
+    T Az[N], Bz[N], Cz[N];
+    for (int k = 0; k < N; k++) {
+      // Select vertex coordinates before subtracting ray origin. Selecting
+      // the differences instead prevents if-conversion of the loop.
+      const int kx = coeff.kx[k];
+      const int ky = coeff.ky[k];
+      const int kz = coeff.kz[k];
+
+      const T akx = ((kx == 0) ? p0[0] : ((kx == 1) ? p0[1] : p0[2])) -
+                    coeff.org_x[k];
+      const T aky = ((ky == 0) ? p0[0] : ((ky == 1) ? p0[1] : p0[2])) -
+                    coeff.org_y[k];
+      const T akz = ((kz == 0) ? p0[0] : ((kz == 1) ? p0[1] : p0[2])) -
+                    coeff.org_z[k];
+      const T bkx = ((kx == 0) ? p1[0] : ((kx == 1) ? p1[1] : p1[2])) -
+                    coeff.org_x[k];
+      const T bky = ((ky == 0) ? p1[0] : ((ky == 1) ? p1[1] : p1[2])) -
+                    coeff.org_y[k];
+      const T bkz = ((kz == 0) ? p1[0] : ((kz == 1) ? p1[1] : p1[2])) -
+                    coeff.org_z[k];
+      const T ckx = ((kx == 0) ? p2[0] : ((kx == 1) ? p2[1] : p2[2])) -
+                    coeff.org_x[k];
+      const T cky = ((ky == 0) ? p2[0] : ((ky == 1) ? p2[1] : p2[2])) -
+                    coeff.org_y[k];
+      const T ckz = ((kz == 0) ? p2[0] : ((kz == 1) ? p2[1] : p2[2])) -
+                    coeff.org_z[k];
+
+      Ax[k] = akx - coeff.Sx[k] * akz;
+      Ay[k] = aky - coeff.Sy[k] * akz;
+      Bx[k] = bkx - coeff.Sx[k] * bkz;
+      By[k] = bky - coeff.Sy[k] * bkz;
+      Cx[k] = ckx - coeff.Sx[k] * ckz;
+      Cy[k] = cky - coeff.Sy[k] * ckz;
+
+      Az[k] = coeff.Sz[k] * akz;
+      Bz[k] = coeff.Sz[k] * bkz;
+      Cz[k] = coeff.Sz[k] * ckz;
+    }
+
+    unsigned int hit_mask = 0;
+
+    for (int k = 0; k < N; k++) {
+      if (!(lane_mask & (1u << k))) continue;
+
+      T u, v, w, det;
+      if (!TestShearedEdges(&u, &v, &w, &det, Ax[k], Ay[k], Bx[k], By[k],
+                            Cx[k], Cy[k])) {
+        continue;
+      }
+
+      const T D = u * Az[k] + v * Bz[k] + w * Cz[k];
+      const T rcpDet = static_cast<T>(1.0) / det;
+      const T tt = D * rcpDet;
+
+      if ((tt > t_inout[k]) || (tt < coeff.min_t[k])) continue;
+
+      t_inout[k] = tt;
+      u_out[k] = v * rcpDet;
+      v_out[k] = w * rcpDet;
+      hit_mask |= (1u << k);
+    }
+
+    return hit_mask;
+  }
+
+  /// Hit only version of IntersectTriangle(). Returns true if triangle
+  /// (p0, p1, p2) is hit within [min_t, max_t]. Neither hit distance nor
+  /// barycentric coordinate is computed.
+  bool OccludeTriangle(T max_t, const real3<T> &p0, const real3<T> &p1,
+                       const real3<T> &p2) const {
+    T U, V, W, det, D;
+    if (!TestTriangleEdges(&U, &V, &W, &det, &D, p0, p1, p2)) {
+      return false;
+    }
+
+    // Compare unnormalized distance `D` to avoid division.
+    if (det < static_cast<T>(0.0)) {
+      det = -det;
+      D = -D;
+    }
+
+    return (D >= t_min_ * det) && (D <= max_t * det);
+  }
+
+  /// Returns edge function `ax * by - ay * bx` of watertight
+  /// ray/triangle intersection. See DifferenceOfProducts() for how the result
+  /// is kept independent of FMA contraction, so that edges of a zero-area
+  /// triangle are exactly zero.
+  static T EdgeFunction(T ax, T ay, T bx, T by) {
+    return DifferenceOfProducts(ax, by, ay, bx);
+  }
+
+  /// Edge test of watertight ray/triangle intersection on vertices already
+  /// translated to ray origin and sheared, shared by TestTriangleEdges() and
+  /// IntersectTrianglePacket(). Returns false if the ray misses the triangle
+  /// or hits a culled back face. Otherwise returns scaled barycentric
+  /// coordinate (U, V, W) and its sum `det`.
+  bool TestShearedEdges(T *U_out, T *V_out, T *W_out, T *det_out, T Ax, T Ay,
+                        T Bx, T By, T Cx, T Cy) const {
+    const T U = EdgeFunction(Cx, Cy, Bx, By);
+    const T V = EdgeFunction(Ax, Ay, Cx, Cy);
+    const T W = EdgeFunction(Bx, By, Ax, Ay);
+
+#ifdef __clang__
+#pragma clang diagnostic push
+#pragma clang diagnostic ignored "-Wfloat-equal"
+#endif
+
+    if (trace_options_.cull_back_face) {
+      if (U < static_cast<T>(0.0) || V < static_cast<T>(0.0) || W < static_cast<T>(0.0)) return false;
+    } else {
+      if ((U < static_cast<T>(0.0) || V < static_cast<T>(0.0) || W < static_cast<T>(0.0)) && (U > static_cast<T>(0.0) || V > static_cast<T>(0.0) || W > static_cast<T>(0.0))) {
+        return false;
+      }
+    }
+
+    const T det = U + V + W;
+    if (det == static_cast<T>(0.0)) return false;
+
+#ifdef __clang__
+#pragma clang diagnostic pop
+#endif
+
+    (*U_out) = U;
+    (*V_out) = V;
+    (*W_out) = W;
+    (*det_out) = det;
+
+    return true;
+  }
+
+  /// Edge test of watertight ray/triangle intersection.
+  /// Returns false if the ray misses triangle (p0, p1, p2). Otherwise returns
+  /// scaled barycentric coordinate (U, V, W), its sum `det` and scaled hit
+  /// distance `D`(hit distance = D / det).
+  bool TestTriangleEdges(T *U_out, T *V_out, T *W_out, T *det_out, T *D_out,
+                         const real3<T> &p0, const real3<T> &p1,
+                         const real3<T> &p2) const {
+    const real3<T> A = p0 - ray_org_;
+    const real3<T> B = p1 - ray_org_;
+    const real3<T> C = p2 - ray_org_;
+
+    const T Ax = A[ray_coeff_.kx] - ray_coeff_.Sx * A[ray_coeff_.kz];
+    const T Ay = A[ray_coeff_.ky] - ray_coeff_.Sy * A[ray_coeff_.kz];
+    const T Bx = B[ray_coeff_.kx] - ray_coeff_.Sx * B[ray_coeff_.kz];
+    const T By = B[ray_coeff_.ky] - ray_coeff_.Sy * B[ray_coeff_.kz];
+    const T Cx = C[ray_coeff_.kx] - ray_coeff_.Sx * C[ray_coeff_.kz];
+    const T Cy = C[ray_coeff_.ky] - ray_coeff_.Sy * C[ray_coeff_.kz];
+
+    T U, V, W, det;
+    if (!TestShearedEdges(&U, &V, &W, &det, Ax, Ay, Bx, By, Cx, Cy)) {
+      return false;
+    }
+
+    const T Az = ray_coeff_.Sz * A[ray_coeff_.kz];
+    const T Bz = ray_coeff_.Sz * B[ray_coeff_.kz];
+    const T Cz = ray_coeff_.Sz * C[ray_coeff_.kz];
+
+    (*U_out) = U;
+    (*V_out) = V;
+    (*W_out) = W;
+    (*det_out) = det;
+    (*D_out) = U * Az + V * Bz + W * Cz;
+
+    return true;
+  }
+
+ private:
+  const T *vertices_;
+  const unsigned int *faces_;
+  const size_t vertex_stride_bytes_;
+
+  mutable real3<T> ray_org_;
+  mutable RayCoeff ray_coeff_;
+  mutable BVHTraceOptions trace_options_;
+  mutable T t_min_;
+
+  mutable T t_;
+  mutable T u_;
+  mutable T v_;
+  mutable unsigned int prim_id_;
+  int _pad_;
+};
+
+/// Triangle intersector which reads triangle vertices gathered in BVH leaf
+/// order(see BVHAccel::BuildLeafTriangles()) instead of going through
+/// `faces` and vertex stride, so leaf primitives are read linearly.
+template <typename T = float, class H = TriangleIntersection<T> >
+class LeafTriangleIntersector : public TriangleIntersector<T, H> {
+ public:
+  LeafTriangleIntersector(const T *vertices, const unsigned int *faces,
+                          const size_t vertex_stride_bytes,
+                          const T *leaf_triangles)  // 9 values per index.
+      : TriangleIntersector<T, H>(vertices, faces, vertex_stride_bytes),
+        leaf_triangles_(leaf_triangles) {}
+
+  using TriangleIntersector<T, H>::Intersect;
+
+  /// Intersect `prim_index` th primitive stored at `slot` th entry of BVH
+  /// indices.
+  bool Intersect(T *t_inout, const unsigned int prim_index,
+                 const unsigned int slot) const {
+    if (!this->IsInPrimRange(prim_index)) {
+      return false;
+    }
+
+    const T *p = leaf_triangles_ + 9 * static_cast<size_t>(slot);
+    const real3<T> p0(p + 0);
+    const real3<T> p1(p + 3);
+    const real3<T> p2(p + 6);
+
+    return this->IntersectTriangle(t_inout, p0, p1, p2);
+  }
+
+  using TriangleIntersector<T, H>::Occluded;
+
+  /// Hit only test of `prim_index` th primitive stored at `slot` th entry of
+  /// BVH indices.
+  bool Occluded(T max_t, const unsigned int prim_index,
+                const unsigned int slot) const {
+    if (!this->IsInPrimRange(prim_index)) {
+      return false;
+    }
+
+    const T *p = leaf_triangles_ + 9 * static_cast<size_t>(slot);
+    const real3<T> p0(p + 0);
+    const real3<T> p1(p + 3);
+    const real3<T> p2(p + 6);
+
+    return this->OccludeTriangle(max_t, p0, p1, p2);
+  }
+
+  using TriangleIntersector<T, H>::IntersectPacket;
+
+  /// Packet version of Intersect() for `prim_index` th primitive stored at
+  /// `slot` th entry of BVH indices.
+  template <int N>
+  unsigned int IntersectPacket(T t_inout[N], T u_out[N], T v_out[N],
+                               unsigned int lane_mask,
+                               const TrianglePacketCoeff<T, N> &coeff,
+                               const unsigned int prim_index,
+                               const unsigned int slot) const {
+    if (!this->IsInPrimRange(prim_index)) {
+      return 0;
+    }
+
+    const T *p = leaf_triangles_ + 9 * static_cast<size_t>(slot);
+    const real3<T> p0(p + 0);
+    const real3<T> p1(p + 3);
+    const real3<T> p2(p + 6);
+
+    return this->IntersectTrianglePacket(t_inout, u_out, v_out, lane_mask,
+                                         coeff, p0, p1, p2);
+  }
+
+ private:
+  const T *leaf_triangles_;
+};
+
+/// Intersects `prim_index` th primitive, which is stored at `slot` th entry
+/// of BVH indices. Intersectors which store primitive data in BVH leaf order
+/// can overload this function to read their data linearly.
+template <typename T, class I>
+inline bool IntersectLeafPrimitive(const I &intersector, T *t_inout,
+                                   unsigned int prim_index,
+                                   unsigned int slot) {
+  (void)slot;
+  return intersector.Intersect(t_inout, prim_index);
+}
+
+template <typename T, class H>
+inline bool IntersectLeafPrimitive(
+    const LeafTriangleIntersector<T, H> &intersector, T *t_inout,
+    unsigned int prim_index, unsigned int slot) {
+  return intersector.Intersect(t_inout, prim_index, slot);
+}
+
+/// Returns true if `prim_index` th primitive, stored at `slot` th entry of
+/// BVH indices, is hit within [ray.min_t, max_t]. Used by
+/// BVHAccel::Occluded(). Intersectors can overload this function to provide
+/// a cheaper hit only test. By default, primitive is intersected with
+/// IntersectLeafPrimitive().
+template <typename T, class I>
+inline bool OccludedLeafPrimitive(const I &intersector, T max_t,
+                                  unsigned int prim_index, unsigned int slot) {
+  T t = max_t;
+  return IntersectLeafPrimitive(intersector, &t, prim_index, slot);
+}
+
+template <typename T, class H>
+inline bool OccludedLeafPrimitive(const TriangleIntersector<T, H> &intersector,
+                                  T max_t, unsigned int prim_index,
+                                  unsigned int slot) {
+  (void)slot;
+  return intersector.Occluded(max_t, prim_index);
+}
+
+template <typename T, class H>
+inline bool OccludedLeafPrimitive(
+    const LeafTriangleIntersector<T, H> &intersector, T max_t,
+    unsigned int prim_index, unsigned int slot) {
+  return intersector.Occluded(max_t, prim_index, slot);
+}
+
+/// Intersects BVH leaf primitives with a packet of rays in
+/// BVHAccel::TraversePacket(). This generic version intersects each ray in
+/// turn through the scalar intersector interface. Intersectors can provide a
+/// specialization which tests all rays of the packet at once.
+template <typename T, int N, class I>
+class RayPacketIntersector {
+ public:
+  explicit RayPacketIntersector(const I &intersector)
+      : intersector_(intersector), packet_(NULL), current_lane_(-1) {}
+
+  void PrepareTraversal(const RayPacket<T, N> &packet,
+                        const BVHTraceOptions &options) {
+    packet_ = &packet;
+    options_ = options;
+    current_lane_ = -1;
+    for (int k = 0; k < N; k++) {
+      prim_ids_[k] = static_cast<unsigned int>(-1);
+      slots_[k] = 0;
+    }
+  }
+
+  /// Intersects `num_primitives` primitives from `offset` th entry of
+  /// `indices` with rays selected by `lane_mask`. `hit_t` is updated.
+  void IntersectLeaf(const unsigned int *indices, unsigned int offset,
+                     unsigned int num_primitives, unsigned int lane_mask,
+                     T hit_t[N]) {
+    while (lane_mask) {
+      const int k = CountTrailingZeros(lane_mask);
+      lane_mask &= lane_mask - 1;
+
+      // Ray state is kept while leaves are intersected with the same ray.
+      if (k != current_lane_) {
+        Ray<T> ray;
+        packet_->GetRay(k, &ray);
+        intersector_.PrepareTraversal(ray, options_);
+        current_lane_ = k;
+      }
+      intersector_.Update(hit_t[k], prim_ids_[k]);
+
+      T t = hit_t[k];
+      for (unsigned int i = 0; i < num_primitives; i++) {
+        const unsigned int prim_idx = indices[offset + i];
+
+        T local_t = t;
+        if (IntersectLeafPrimitive(intersector_, &local_t, prim_idx,
+                                   offset + i)) {
+          t = local_t;
+          intersector_.Update(t, prim_idx);
+          prim_ids_[k] = prim_idx;
+          slots_[k] = offset + i;
+        }
+      }
+      hit_t[k] = t;
+    }
+  }
+
+  /// Fills `isects[k]` of rays in `hit_mask`. The closest primitive is
+  /// intersected again so that the intersector restores its hit state.
+  template <class H>
+  void PostTraversal(const T hit_t[N], unsigned int hit_mask, H isects[N]) {
+    while (hit_mask) {
+      const int k = CountTrailingZeros(hit_mask);
+      hit_mask &= hit_mask - 1;
+
+      Ray<T> ray;
+      packet_->GetRay(k, &ray);
+      intersector_.PrepareTraversal(ray, options_);
+
+      T t = hit_t[k];
+      IntersectLeafPrimitive(intersector_, &t, prim_ids_[k], slots_[k]);
+      intersector_.Update(hit_t[k], prim_ids_[k]);
+      intersector_.PostTraversal(ray, true, &isects[k]);
+    }
+    current_lane_ = -1;
+  }
+
+ private:
+  const I &intersector_;
+  const RayPacket<T, N> *packet_;
+  BVHTraceOptions options_;
+  unsigned int prim_ids_[N];
+  unsigned int slots_[N];
+  int current_lane_;  // lane whose ray is prepared in `intersector_`.
+};
+
+/// Intersects `prim_index` th primitive, stored at `slot` th entry of BVH
+/// indices, with rays of a packet(see TriangleIntersector::IntersectPacket()).
+template <typename T, int N, class H>
+inline unsigned int IntersectLeafPrimitivePacket(
+    const TriangleIntersector<T, H> &intersector, T t_inout[N], T u_out[N],
+    T v_out[N], unsigned int lane_mask, const TrianglePacketCoeff<T, N> &coeff,
+    unsigned int prim_index, unsigned int slot) {
+  (void)slot;
+  return intersector.IntersectPacket(t_inout, u_out, v_out, lane_mask, coeff,
+                                     prim_index);
+}
+
+template <typename T, int N, class H>
+inline unsigned int IntersectLeafPrimitivePacket(
+    const LeafTriangleIntersector<T, H> &intersector, T t_inout[N], T u_out[N],
+    T v_out[N], unsigned int lane_mask, const TrianglePacketCoeff<T, N> &coeff,
+    unsigned int prim_index, unsigned int slot) {
+  return intersector.IntersectPacket(t_inout, u_out, v_out, lane_mask, coeff,
+                                     prim_index, slot);
+}
+
+/// Packet intersector for TriangleIntersector and intersectors derived from
+/// it. Tests a triangle against all rays of the packet at once(see
+/// TriangleIntersector::IntersectPacket()).
+template <typename T, int N, class I, class H>
+class TriangleRayPacketIntersector {
+ public:
+  explicit TriangleRayPacketIntersector(const I &intersector)
+      : intersector_(intersector) {}
+
+  void PrepareTraversal(const RayPacket<T, N> &packet,
+                        const BVHTraceOptions &options) {
+    intersector_.PreparePacketTraversal(packet, options, &coeff_);
+    for (int k = 0; k < N; k++) {
+      u_[k] = static_cast<T>(0.0);
+      v_[k] = static_cast<T>(0.0);
+      prim_ids_[k] = static_cast<unsigned int>(-1);
+    }
+  }
+
+  void IntersectLeaf(const unsigned int *indices, unsigned int offset,
+                     unsigned int num_primitives, unsigned int lane_mask,
+                     T hit_t[N]) {
+    for (unsigned int i = 0; i < num_primitives; i++) {
+      const unsigned int prim_idx = indices[offset + i];
+
+      unsigned int mask = IntersectLeafPrimitivePacket(
+          intersector_, hit_t, u_, v_, lane_mask, coeff_, prim_idx,
+          offset + i);
+      while (mask) {
+        const int k = CountTrailingZeros(mask);
+        mask &= mask - 1;
+        prim_ids_[k] = prim_idx;
+      }
+    }
+  }
+
+  void PostTraversal(const T hit_t[N], unsigned int hit_mask, H isects[N]) {
+    while (hit_mask) {
+      const int k = CountTrailingZeros(hit_mask);
+      hit_mask &= hit_mask - 1;
+
+      isects[k].t = hit_t[k];
+      isects[k].u = u_[k];
+      isects[k].v = v_[k];
+      isects[k].prim_id = prim_ids_[k];
+    }
+  }
+
+ private:
+  const I &intersector_;
+  TrianglePacketCoeff<T, N> coeff_;
+  T u_[N];
+  T v_[N];
+  unsigned int prim_ids_[N];
+};
+
+template <typename T, int N, class H>
+class RayPacketIntersector<T, N, TriangleIntersector<T, H> >
+    : public TriangleRayPacketIntersector<T, N, TriangleIntersector<T, H>,
+                                          H> {
+ public:
+  explicit RayPacketIntersector(const TriangleIntersector<T, H> &intersector)
+      : TriangleRayPacketIntersector<T, N, TriangleIntersector<T, H>, H>(
+            intersector) {}
+};
+
+template <typename T, int N, class H>
+class RayPacketIntersector<T, N, LeafTriangleIntersector<T, H> >
+    : public TriangleRayPacketIntersector<T, N, LeafTriangleIntersector<T, H>,
+                                          H> {
+ public:
+  explicit RayPacketIntersector(
+      const LeafTriangleIntersector<T, H> &intersector)
+      : TriangleRayPacketIntersector<T, N, LeafTriangleIntersector<T, H>, H>(
+            intersector) {}
+};
+
+/// Selects a ray of a stream in the intersector in
+/// BVHAccel::TraverseStream(). Rays are switched each time a leaf is
+/// intersected with another ray of the stream. This generic version calls
+/// PrepareTraversal() of the intersector for each switch. Intersectors can
+/// provide a specialization which computes per-ray state only once.
+/// One instance is reused for all chunks traced by a thread(see SetRays()).
+template <typename T, class I>
+class RayStreamIntersector {
+ public:
+  RayStreamIntersector(const I &intersector, const BVHTraceOptions &options)
+      : intersector_(intersector), rays_(NULL), options_(options) {}
+
+  /// Sets `num_rays` rays of the next chunk.
+  void SetRays(const Ray<T> *rays, size_t num_rays) {
+    rays_ = rays;
+    (void)num_rays;
+  }
+
+  void SetRay(unsigned int ray_index) const {
+    intersector_.PrepareTraversal(rays_[ray_index], options_);
+  }
+
+ private:
+  const I &intersector_;
+  const Ray<T> *rays_;
+  BVHTraceOptions options_;
+};
+
+/// Stream intersector for TriangleIntersector and intersectors derived from
+/// it. Shear constants of all rays are computed once(see
+/// TriangleIntersector::PrepareRayState()).
+template <typename T, class I>
+class TriangleRayStreamIntersector {
+ public:
+  TriangleRayStreamIntersector(const I &intersector,
+                               const BVHTraceOptions &options)
+      : intersector_(intersector), options_(options) {}
+
+  /// Sets `num_rays` rays of the next chunk. Storage of previous chunks is
+  /// reused.
+  void SetRays(const Ray<T> *rays, size_t num_rays) {
+    states_.resize(num_rays);
+    for (size_t i = 0; i < num_rays; i++) {
+      intersector_.PrepareRayState(rays[i], &states_[i]);
+    }
+    if (num_rays > 0) {
+      // Set trace options.
+      intersector_.PrepareTraversal(rays[0], options_);
+    }
+  }
+
+  void SetRay(unsigned int ray_index) const {
+    intersector_.SetRayState(states_[ray_index]);
+  }
+
+ private:
+  const I &intersector_;
+  BVHTraceOptions options_;
+  std::vector<typename I::RayState> states_;
+};
+
+template <typename T, class H>
+class RayStreamIntersector<T, TriangleIntersector<T, H> >
+    : public TriangleRayStreamIntersector<T, TriangleIntersector<T, H> > {
+ public:
+  RayStreamIntersector(const TriangleIntersector<T, H> &intersector,
+                       const BVHTraceOptions &options)
+      : TriangleRayStreamIntersector<T, TriangleIntersector<T, H> >(
+            intersector, options) {}
+};
+
+template <typename T, class H>
+class RayStreamIntersector<T, LeafTriangleIntersector<T, H> >
+    : public TriangleRayStreamIntersector<T, LeafTriangleIntersector<T, H> > {
+ public:
+  RayStreamIntersector(const LeafTriangleIntersector<T, H> &intersector,
+                       const BVHTraceOptions &options)
+      : TriangleRayStreamIntersector<T, LeafTriangleIntersector<T, H> >(
+            intersector, options) {}
+};
+
+//
+// Robust BVH Ray Traversal : http://jcgt.org/published/0002/02/02/paper.pdf
+//
+
+// NaN-safe min and max function.
+template <class T>
+const T &safemin(const T &a, const T &b) {
+  return (a < b) ? a : b;
+}
+template <class T>
+const T &safemax(const T &a, const T &b) {
+  return (a > b) ? a : b;
+}
+
+//
+// SAH functions
+//
+struct BinBuffer {
+  explicit BinBuffer(unsigned int size) {
+    bin_size = size;
+    bin.resize(2 * 3 * size);
+    clear();
+  }
+
+  void clear() { memset(&bin[0], 0, sizeof(size_t) * 2 * 3 * bin_size); }
+
+  std::vector<size_t> bin;  // (min, max) * xyz * binsize
+  unsigned int bin_size;
+  unsigned int pad0;
+};
+
+// Scratch buffer for sweep SAH. Grows to `sweep_sah_threshold` entries.
+template <typename T>
+struct SweepBuffer {
+  std::vector<BBox<T> > bboxes;  // Primitive bounds, in indices_ order.
+  std::vector<std::pair<T, unsigned int> > keys[3];  // (centroid, bbox index)
+  std::vector<T> right_areas;
+  std::vector<unsigned int> prim_ids;
 };
 
 template <typename T>
@@ -1240,6 +3341,22 @@ inline bool FindCutFromBinBuffer(T *cut_pos,        // [out] xyz
   return true;
 }
 
+// Cuts at the center of the longest axis of [bmin, bmax]. Used instead of
+// FindCutFromBinBuffer() when build time budget is used up, since it does
+// not visit primitives.
+template <typename T>
+inline void FindSpatialMedianCut(T *cut_pos,    // [out] xyz
+                                 int *cut_axis,  // [out]
+                                 const real3<T> &bmin, const real3<T> &bmax) {
+  (*cut_axis) = 0;
+  for (int k = 0; k < 3; k++) {
+    cut_pos[k] = static_cast<T>(0.5) * (bmin[k] + bmax[k]);
+    if ((bmax[k] - bmin[k]) > (bmax[*cut_axis] - bmin[*cut_axis])) {
+      (*cut_axis) = k;
+    }
+  }
+}
+
 #ifdef _OPENMP
 template <typename T, class P>
 void ComputeBoundingBoxOMP(real3<T> *bmin, real3<T> *bmax,
@@ -1348,6 +3465,357 @@ inline void GetBoundingBox(real3<T> *bmin, real3<T> *bmax,
   }
 }
 
+#if defined(NANORT_USE_SSE)
+// SSE version for float. Each box is loaded as (bmin, bmax[0]) and
+// (bmin[2], bmax), which does not read past the box.
+inline void GetBoundingBox(real3<float> *bmin, real3<float> *bmax,
+                           const std::vector<BBox<float> > &bboxes,
+                           unsigned int *indices, unsigned int left_index,
+                           unsigned int right_index) {
+  const float *first = bboxes[indices[left_index]].bmin.v;
+  __m128 vmin = _mm_loadu_ps(first);
+  __m128 vmax = _mm_loadu_ps(first + 2);
+
+  for (unsigned int i = left_index + 1; i < right_index; i++) {
+    const float *b = bboxes[indices[i]].bmin.v;
+    vmin = _mm_min_ps(vmin, _mm_loadu_ps(b));
+    vmax = _mm_max_ps(vmax, _mm_loadu_ps(b + 2));
+  }
+
+  float min_values[4], max_values[4];
+  _mm_storeu_ps(min_values, vmin);
+  _mm_storeu_ps(max_values, vmax);
+
+  (*bmin) = real3<float>(min_values[0], min_values[1], min_values[2]);
+  (*bmax) = real3<float>(max_values[1], max_values[2], max_values[3]);
+}
+#endif
+
+// Computes centroids of `bboxes` [begin, end).
+template <typename T>
+inline void ComputeCentroids(real3<T> *centroids, const BBox<T> *bboxes,
+                             unsigned int begin, unsigned int end) {
+  for (unsigned int i = begin; i < end; i++) {
+    for (int k = 0; k < 3; k++) {
+      centroids[i][k] =
+          static_cast<T>(0.5) * (bboxes[i].bmin[k] + bboxes[i].bmax[k]);
+    }
+  }
+}
+
+#if defined(NANORT_USE_SSE)
+// SSE version for float. 4 boxes(24 floats) are added as overlapping
+// (bmin, bmax) loads, and the 4 centroids(12 floats) are packed into 3
+// stores. Loads stay within the 4 boxes.
+inline void ComputeCentroids(real3<float> *centroids,
+                             const BBox<float> *bboxes, unsigned int begin,
+                             unsigned int end) {
+  const __m128 half = _mm_set1_ps(0.5f);
+
+  unsigned int i = begin;
+  for (; i + 4 <= end; i += 4) {
+    const float *b = bboxes[i].bmin.v;
+
+    // Lanes 0-2 of a, b and c, and lanes 1-3 of d are box centers(x2).
+    const __m128 a = _mm_add_ps(_mm_loadu_ps(b + 0), _mm_loadu_ps(b + 3));
+    const __m128 bb = _mm_add_ps(_mm_loadu_ps(b + 6), _mm_loadu_ps(b + 9));
+    const __m128 c = _mm_add_ps(_mm_loadu_ps(b + 12), _mm_loadu_ps(b + 15));
+    const __m128 d = _mm_add_ps(_mm_loadu_ps(b + 17), _mm_loadu_ps(b + 20));
+
+    // (a0 a1 a2 b0), (b1 b2 c0 c1), (c2 d1 d2 d3)
+    const __m128 ab = _mm_shuffle_ps(a, bb, _MM_SHUFFLE(0, 0, 2, 2));
+    const __m128 cd = _mm_shuffle_ps(c, d, _MM_SHUFFLE(1, 1, 2, 2));
+    const __m128 out0 = _mm_shuffle_ps(a, ab, _MM_SHUFFLE(2, 0, 1, 0));
+    const __m128 out1 = _mm_shuffle_ps(bb, c, _MM_SHUFFLE(1, 0, 2, 1));
+    const __m128 out2 = _mm_shuffle_ps(cd, d, _MM_SHUFFLE(3, 2, 2, 0));
+
+    float *dst = centroids[i].v;
+    _mm_storeu_ps(dst + 0, _mm_mul_ps(out0, half));
+    _mm_storeu_ps(dst + 4, _mm_mul_ps(out1, half));
+    _mm_storeu_ps(dst + 8, _mm_mul_ps(out2, half));
+  }
+
+  for (; i < end; i++) {
+    for (int k = 0; k < 3; k++) {
+      centroids[i][k] = 0.5f * (bboxes[i].bmin[k] + bboxes[i].bmax[k]);
+    }
+  }
+}
+#endif
+
+// Computes bounding box of each primitive into `bboxes`(indexed by primitive
+// id) and their union, in parallel with per-thread bounds.
+template <typename T, class P>
+inline void ComputePrimitiveBoundingBoxes(real3<T> *bmin, real3<T> *bmax,
+                                          BBox<T> *bboxes,
+                                          unsigned int num_primitives,
+                                          const P &p) {
+  BBox<T> scene_bbox;
+
+#ifdef _OPENMP
+#pragma omp parallel if (num_primitives > 1024 * 16)
+#endif
+  {
+    BBox<T> local_bbox;
+
+#ifdef _OPENMP
+#pragma omp for
+#endif
+    for (int i = 0; i < static_cast<int>(num_primitives); i++) {
+      BBox<T> &bbox = bboxes[i];
+      p.BoundingBox(&(bbox.bmin), &(bbox.bmax), static_cast<unsigned int>(i));
+
+      for (int k = 0; k < 3; k++) {
+        local_bbox.bmin[k] = std::min(local_bbox.bmin[k], bbox.bmin[k]);
+        local_bbox.bmax[k] = std::max(local_bbox.bmax[k], bbox.bmax[k]);
+      }
+    }
+
+#ifdef _OPENMP
+#pragma omp critical
+#endif
+    {
+      for (int k = 0; k < 3; k++) {
+        scene_bbox.bmin[k] = std::min(scene_bbox.bmin[k], local_bbox.bmin[k]);
+        scene_bbox.bmax[k] = std::max(scene_bbox.bmax[k], local_bbox.bmax[k]);
+      }
+    }
+  }
+
+  (*bmin) = scene_bbox.bmin;
+  (*bmax) = scene_bbox.bmax;
+}
+
+#if defined(NANORT_USE_TASK_SCHEDULER)
+// Same as above, but runs on `scheduler`.
+template <typename T, class P>
+inline void ComputePrimitiveBoundingBoxes(TaskScheduler *scheduler,
+                                          real3<T> *bmin, real3<T> *bmax,
+                                          BBox<T> *bboxes,
+                                          unsigned int num_primitives,
+                                          const P &p) {
+  const unsigned int chunk_size = 1024 * 16;
+  std::vector<BBox<T> > chunk_bboxes((num_primitives + chunk_size - 1) /
+                                     chunk_size);
+
+  ParallelFor(scheduler, num_primitives, chunk_size,
+              [&](unsigned int begin, unsigned int end) {
+                BBox<T> &local_bbox = chunk_bboxes[begin / chunk_size];
+                for (unsigned int i = begin; i < end; i++) {
+                  BBox<T> &bbox = bboxes[i];
+                  p.BoundingBox(&(bbox.bmin), &(bbox.bmax), i);
+
+                  for (int k = 0; k < 3; k++) {
+                    local_bbox.bmin[k] =
+                        std::min(local_bbox.bmin[k], bbox.bmin[k]);
+                    local_bbox.bmax[k] =
+                        std::max(local_bbox.bmax[k], bbox.bmax[k]);
+                  }
+                }
+              });
+
+  BBox<T> scene_bbox;
+  for (size_t c = 0; c < chunk_bboxes.size(); c++) {
+    const BBox<T> &chunk_bbox = chunk_bboxes[c];
+    for (int k = 0; k < 3; k++) {
+      scene_bbox.bmin[k] = std::min(scene_bbox.bmin[k], chunk_bbox.bmin[k]);
+      scene_bbox.bmax[k] = std::max(scene_bbox.bmax[k], chunk_bbox.bmax[k]);
+    }
+  }
+
+  (*bmin) = scene_bbox.bmin;
+  (*bmax) = scene_bbox.bmax;
+}
+#endif
+
+// Number of primitives processed per block in parallel LBVH build passes.
+// Fixed so that the result does not depend on the number of threads.
+static const unsigned int kMortonBlockSize = 1024 * 64;
+
+// HLBVH treelets are formed by primitives sharing upper 15 bits(5 bits per
+// axis) of Morton codes.
+static const unsigned int kHLBVHTreeletBits = 15;
+
+// Morton code types. 30bit codes are stored in `unsigned int`, 63bit codes
+// in `unsigned long long`.
+template <typename K>
+struct MortonCodeTraits;
+
+template <>
+struct MortonCodeTraits<unsigned int> {
+  static const unsigned int kAxisBits = 10;
+  static const unsigned int kRadixBits = 10;  // 3 radix sort passes
+};
+
+template <>
+struct MortonCodeTraits<unsigned long long> {
+  static const unsigned int kAxisBits = 21;
+  static const unsigned int kRadixBits = 11;  // 6 radix sort passes
+};
+
+// Geometry and SAH predicator over an array of bounding boxes. Used to build
+// HLBVH top levels over treelet bounds.
+template <typename T>
+class BBoxArrayGeometry {
+ public:
+  explicit BBoxArrayGeometry(const BBox<T> *bboxes) : bboxes_(bboxes) {}
+
+  void BoundingBox(real3<T> *bmin, real3<T> *bmax,
+                   unsigned int prim_index) const {
+    (*bmin) = bboxes_[prim_index].bmin;
+    (*bmax) = bboxes_[prim_index].bmax;
+  }
+
+ private:
+  const BBox<T> *bboxes_;
+};
+
+template <typename T>
+class BBoxArraySAHPred {
+ public:
+  explicit BBoxArraySAHPred(const BBox<T> *bboxes)
+      : axis_(0), pos_(static_cast<T>(0.0)), bboxes_(bboxes) {}
+
+  void Set(int axis, T pos) const {
+    axis_ = axis;
+    pos_ = pos;
+  }
+
+  bool operator()(unsigned int i) const {
+    T center = bboxes_[i].bmin[axis_] + bboxes_[i].bmax[axis_];
+    return (center < pos_ * static_cast<T>(2.0));
+  }
+
+ private:
+  mutable int axis_;
+  mutable T pos_;
+  const BBox<T> *bboxes_;
+};
+
+// SAH predicator over an array of primitive centroids.
+template <typename T>
+class CentroidArraySAHPred {
+ public:
+  explicit CentroidArraySAHPred(const real3<T> *centroids)
+      : axis_(0), pos_(static_cast<T>(0.0)), centroids_(centroids) {}
+
+  void Set(int axis, T pos) const {
+    axis_ = axis;
+    pos_ = pos;
+  }
+
+  bool operator()(unsigned int i) const {
+    return (centroids_[i][axis_] < pos_);
+  }
+
+ private:
+  mutable int axis_;
+  mutable T pos_;
+  const real3<T> *centroids_;
+};
+
+// Inserts two 0 bits after each of the lower 10 bits of `v`.
+inline unsigned int ExpandMortonBits(unsigned int v) {
+  v = (v * 0x00010001u) & 0xFF0000FFu;
+  v = (v * 0x00000101u) & 0x0F00F00Fu;
+  v = (v * 0x00000011u) & 0xC30C30C3u;
+  v = (v * 0x00000005u) & 0x49249249u;
+  return v;
+}
+
+// Inserts two 0 bits after each of the lower 21 bits of `v`.
+inline unsigned long long ExpandMortonBits(unsigned long long v) {
+  v &= 0x1FFFFFull;
+  v = (v | (v << 32)) & 0x1F00000000FFFFull;
+  v = (v | (v << 16)) & 0x1F0000FF0000FFull;
+  v = (v | (v << 8)) & 0x100F00F00F00F00Full;
+  v = (v | (v << 4)) & 0x10C30C30C30C30C3ull;
+  v = (v | (v << 2)) & 0x1249249249249249ull;
+  return v;
+}
+
+// Sorts Morton code `keys` and `values` by keys with stable LSD radix sort
+// (3 passes of 10 bits for 30bit codes, 6 passes of 11 bits for 63bit
+// codes).
+template <typename K>
+inline void RadixSortMortonCodes(std::vector<K> *keys,
+                                 std::vector<unsigned int> *values) {
+  const unsigned int kCodeBits = 3 * MortonCodeTraits<K>::kAxisBits;
+  const unsigned int kRadixBits = MortonCodeTraits<K>::kRadixBits;
+  const size_t kRadixSize = 1 << kRadixBits;
+
+  const size_t n = keys->size();
+  assert(values->size() == n);
+  if (n == 0) {
+    return;
+  }
+
+  const int num_blocks =
+      static_cast<int>((n + kMortonBlockSize - 1) / kMortonBlockSize);
+
+  std::vector<K> tmp_keys(n);
+  std::vector<unsigned int> tmp_values(n);
+  std::vector<size_t> offsets(static_cast<size_t>(num_blocks) * kRadixSize);
+
+  K *src_keys = &keys->at(0);
+  unsigned int *src_values = &values->at(0);
+  K *dst_keys = &tmp_keys.at(0);
+  unsigned int *dst_values = &tmp_values.at(0);
+
+  for (unsigned int shift = 0; shift < kCodeBits; shift += kRadixBits) {
+    std::fill(offsets.begin(), offsets.end(), 0);
+
+    // Count digits of each block.
+#ifdef _OPENMP
+#pragma omp parallel for if (num_blocks > 1)
+#endif
+    for (int b = 0; b < num_blocks; b++) {
+      const size_t begin = static_cast<size_t>(b) * kMortonBlockSize;
+      const size_t end = std::min(begin + kMortonBlockSize, n);
+      size_t *count = &offsets[static_cast<size_t>(b) * kRadixSize];
+      for (size_t i = begin; i < end; i++) {
+        count[static_cast<size_t>(src_keys[i] >> shift) & (kRadixSize - 1)]++;
+      }
+    }
+
+    // Exclusive scan in (digit, block) order keeps the sort stable.
+    size_t sum = 0;
+    for (size_t d = 0; d < kRadixSize; d++) {
+      for (size_t b = 0; b < static_cast<size_t>(num_blocks); b++) {
+        const size_t c = offsets[b * kRadixSize + d];
+        offsets[b * kRadixSize + d] = sum;
+        sum += c;
+      }
+    }
+
+    // Scatter.
+#ifdef _OPENMP
+#pragma omp parallel for if (num_blocks > 1)
+#endif
+    for (int b = 0; b < num_blocks; b++) {
+      const size_t begin = static_cast<size_t>(b) * kMortonBlockSize;
+      const size_t end = std::min(begin + kMortonBlockSize, n);
+      size_t *offset = &offsets[static_cast<size_t>(b) * kRadixSize];
+      for (size_t i = begin; i < end; i++) {
+        const size_t dst =
+            offset[static_cast<size_t>(src_keys[i] >> shift) &
+                   (kRadixSize - 1)]++;
+        dst_keys[dst] = src_keys[i];
+        dst_values[dst] = src_values[i];
+      }
+    }
+
+    std::swap(src_keys, dst_keys);
+    std::swap(src_values, dst_values);
+  }
+
+  // Odd number of passes leaves sorted data in tmp.
+  if (src_keys != &keys->at(0)) {
+    keys->swap(tmp_keys);
+    values->swap(tmp_values);
+  }
+}
+
 //
 // --
 //
@@ -1355,7 +3823,7 @@ inline void GetBoundingBox(real3<T> *bmin, real3<T> *bmax,
 #if NANORT_ENABLE_PARALLEL_BUILD
 template <typename T>
 template <class P, class Pred>
-unsigned int BVHAccel<T>::BuildShallowTree(std::vector<BVHNode<T> > *out_nodes,
+unsigned int BVHAccel<T>::BuildShallowTree(BVHNodeArray *out_nodes,
                                            unsigned int left_idx,
                                            unsigned int right_idx,
                                            unsigned int depth,
@@ -1388,9 +3856,7 @@ unsigned int BVHAccel<T>::BuildShallowTree(std::vector<BVHNode<T> > *out_nodes,
 
     assert(left_idx < std::numeric_limits<unsigned int>::max());
 
-    leaf.flag = 1;  // leaf
-    leaf.data[0] = n;
-    leaf.data[1] = left_idx;
+    leaf.SetLeaf(n, left_idx);
 
     out_nodes->push_back(leaf);  // atomic update
 
@@ -1412,8 +3878,7 @@ unsigned int BVHAccel<T>::BuildShallowTree(std::vector<BVHNode<T> > *out_nodes,
 
     // Add dummy node.
     BVHNode<T> node;
-    node.axis = -1;
-    node.flag = -1;
+    node.SetBranch(0, 0, 0);
     out_nodes->push_back(node);
 
     return offset;
@@ -1425,10 +3890,11 @@ unsigned int BVHAccel<T>::BuildShallowTree(std::vector<BVHNode<T> > *out_nodes,
     int min_cut_axis = 0;
     T cut_pos[3] = {0.0, 0.0, 0.0};
 
-    BinBuffer bins(options_.bin_size);
-    ContributeBinBuffer(&bins, bmin, bmax, &indices_.at(0), left_idx, right_idx,
+    BinBuffer *bins = GetThreadBinBuffer();
+    bins->clear();
+    ContributeBinBuffer(bins, bmin, bmax, &indices_.at(0), left_idx, right_idx,
                         p);
-    FindCutFromBinBuffer(cut_pos, &min_cut_axis, &bins, bmin, bmax, n,
+    FindCutFromBinBuffer(cut_pos, &min_cut_axis, bins, bmin, bmax, n,
                          options_.cost_t_aabb);
 
     // Try all 3 axis until good cut position avaiable.
@@ -1468,8 +3934,7 @@ unsigned int BVHAccel<T>::BuildShallowTree(std::vector<BVHNode<T> > *out_nodes,
     }
 
     BVHNode<T> node;
-    node.axis = cut_axis;
-    node.flag = 0;  // 0 = branch
+    node.SetBranch(cut_axis, 0, 0);
 
     out_nodes->push_back(node);
 
@@ -1482,8 +3947,8 @@ unsigned int BVHAccel<T>::BuildShallowTree(std::vector<BVHNode<T> > *out_nodes,
     right_child_index = BuildShallowTree(out_nodes, mid_idx, right_idx,
                                          depth + 1, max_shallow_depth, p, pred);
 
-    (*out_nodes)[offset].data[0] = left_child_index;
-    (*out_nodes)[offset].data[1] = right_child_index;
+    (*out_nodes)[offset].SetChild(0, left_child_index);
+    (*out_nodes)[offset].SetChild(1, right_child_index);
 
     (*out_nodes)[offset].bmin[0] = bmin[0];
     (*out_nodes)[offset].bmin[1] = bmin[1];
@@ -1500,361 +3965,3320 @@ unsigned int BVHAccel<T>::BuildShallowTree(std::vector<BVHNode<T> > *out_nodes,
 }
 #endif
 
-template <typename T>
-template <class P, class Pred>
-unsigned int BVHAccel<T>::BuildTree(BVHBuildStatistics *out_stat,
-                                    std::vector<BVHNode<T> > *out_nodes,
-                                    unsigned int left_idx,
-                                    unsigned int right_idx, unsigned int depth,
-                                    const P &p, const Pred &pred) {
-  assert(left_idx <= right_idx);
+// Nodes with more primitives than this are built in their own task.
+static const unsigned int kTaskBuildThreshold = 1024 * 4;
 
-  unsigned int offset = static_cast<unsigned int>(out_nodes->size());
+// Traversal state used in CompactNodes().
+struct CompactItem {
+  unsigned int sparse_index;
+  unsigned int depth;
+  unsigned int parent;  // parent node index in compacted nodes.
+  int child_slot;       // -1 for root.
+};
 
-  if (out_stat->max_tree_depth < depth) {
-    out_stat->max_tree_depth = depth;
+#if NANORT_ENABLE_PARALLEL_BUILD && \
+    (defined(NANORT_USE_OPENMP_TASK) || defined(NANORT_USE_TASK_SCHEDULER))
+// Nodes with more primitives than this split bounding box, binning and
+// partitioning into chunks processed by tasks. Chunk size is fixed so that
+// built BVH does not depend on the number of threads.
+static const unsigned int kTaskSplitThreshold = 1024 * 64;
+static const unsigned int kTaskChunkSize = 1024 * 16;
+#endif
+
+#if NANORT_ENABLE_PARALLEL_BUILD && defined(NANORT_USE_OPENMP_TASK)
+
+// Adds `n` to `*value` atomically and returns the old value.
+inline unsigned int FetchAndAdd(unsigned int *value, unsigned int n) {
+  unsigned int old_value;
+#if _OPENMP >= 201107
+#pragma omp atomic capture
+  {
+    old_value = *value;
+    *value += n;
+  }
+#else
+#pragma omp critical(nanort_fetch_and_add)
+  {
+    old_value = *value;
+    *value += n;
   }
+#endif
+  return old_value;
+}
 
-  real3<T> bmin, bmax;
-  if (!bboxes_.empty()) {
-    GetBoundingBox(&bmin, &bmax, bboxes_, &indices_.at(0), left_idx, right_idx);
-  } else {
-    ComputeBoundingBox(&bmin, &bmax, &indices_.at(0), left_idx, right_idx, p);
+template <typename T>
+template <class P>
+void BVHAccel<T>::ComputeBoundingBoxTask(real3<T> *bmin, real3<T> *bmax,
+                                         unsigned int left_idx,
+                                         unsigned int right_idx,
+                                         const P &p) {
+  const unsigned int n = right_idx - left_idx;
+  const unsigned int num_chunks = (n + kTaskChunkSize - 1) / kTaskChunkSize;
+
+  std::vector<BBox<T> > chunk_bboxes(num_chunks);
+  const P *pp = &p;
+
+  for (unsigned int c = 0; c < num_chunks; c++) {
+#pragma omp task shared(chunk_bboxes)
+    {
+      const unsigned int chunk_left = left_idx + c * kTaskChunkSize;
+      const unsigned int chunk_right =
+          std::min(chunk_left + kTaskChunkSize, right_idx);
+      BBox<T> &bbox = chunk_bboxes[c];
+      if (!bboxes_.empty()) {
+        GetBoundingBox(&bbox.bmin, &bbox.bmax, bboxes_, &indices_.at(0),
+                       chunk_left, chunk_right);
+      } else {
+        ComputeBoundingBox(&bbox.bmin, &bbox.bmax, &indices_.at(0),
+                           chunk_left, chunk_right, *pp);
+      }
+    }
   }
+#pragma omp taskwait
 
-  unsigned int n = right_idx - left_idx;
-  if ((n <= options_.min_leaf_primitives) ||
-      (depth >= options_.max_tree_depth)) {
-    // Create leaf node.
-    BVHNode<T> leaf;
+  (*bmin) = chunk_bboxes[0].bmin;
+  (*bmax) = chunk_bboxes[0].bmax;
+  for (unsigned int c = 1; c < num_chunks; c++) {
+    for (int k = 0; k < 3; k++) {
+      (*bmin)[k] = std::min((*bmin)[k], chunk_bboxes[c].bmin[k]);
+      (*bmax)[k] = std::max((*bmax)[k], chunk_bboxes[c].bmax[k]);
+    }
+  }
+}
 
-    leaf.bmin[0] = bmin[0];
-    leaf.bmin[1] = bmin[1];
-    leaf.bmin[2] = bmin[2];
+template <typename T>
+template <class P>
+void BVHAccel<T>::ContributeBinBufferTask(BinBuffer *bins,
+                                          const real3<T> &bmin,
+                                          const real3<T> &bmax,
+                                          unsigned int left_idx,
+                                          unsigned int right_idx,
+                                          const P &p) {
+  const unsigned int n = right_idx - left_idx;
+  const unsigned int num_chunks = (n + kTaskChunkSize - 1) / kTaskChunkSize;
+
+  std::vector<BinBuffer> chunk_bins(num_chunks, BinBuffer(bins->bin_size));
+  const P *pp = &p;
+  const real3<T> *pbmin = &bmin;
+  const real3<T> *pbmax = &bmax;
+
+  for (unsigned int c = 0; c < num_chunks; c++) {
+#pragma omp task shared(chunk_bins)
+    {
+      const unsigned int chunk_left = left_idx + c * kTaskChunkSize;
+      const unsigned int chunk_right =
+          std::min(chunk_left + kTaskChunkSize, right_idx);
+      ContributeBinBuffer(&chunk_bins[c], *pbmin, *pbmax, &indices_.at(0),
+                          chunk_left, chunk_right, *pp);
+    }
+  }
+#pragma omp taskwait
 
-    leaf.bmax[0] = bmax[0];
-    leaf.bmax[1] = bmax[1];
-    leaf.bmax[2] = bmax[2];
+  bins->clear();
+  for (unsigned int c = 0; c < num_chunks; c++) {
+    for (size_t i = 0; i < bins->bin.size(); i++) {
+      bins->bin[i] += chunk_bins[c].bin[i];
+    }
+  }
+}
 
-    assert(left_idx < std::numeric_limits<unsigned int>::max());
+template <typename T>
+template <class Pred>
+unsigned int BVHAccel<T>::PartitionTask(unsigned int left_idx,
+                                        unsigned int right_idx,
+                                        const Pred &pred) {
+  const unsigned int n = right_idx - left_idx;
+  const unsigned int num_chunks = (n + kTaskChunkSize - 1) / kTaskChunkSize;
+
+  // 1. Partition each chunk in place.
+  std::vector<unsigned int> chunk_num_left(num_chunks);
+  const Pred *ppred = &pred;
+
+  for (unsigned int c = 0; c < num_chunks; c++) {
+#pragma omp task shared(chunk_num_left)
+    {
+      const unsigned int chunk_left = left_idx + c * kTaskChunkSize;
+      const unsigned int chunk_right =
+          std::min(chunk_left + kTaskChunkSize, right_idx);
+      unsigned int *begin = &indices_[chunk_left];
+      unsigned int *end = begin + (chunk_right - chunk_left);
+      Pred chunk_pred(*ppred);  // Pred may have mutable state.
+      unsigned int *mid = std::partition(begin, end, chunk_pred);
+      chunk_num_left[c] = static_cast<unsigned int>(mid - begin);
+    }
+  }
+#pragma omp taskwait
 
-    leaf.flag = 1;  // leaf
-    leaf.data[0] = n;
-    leaf.data[1] = left_idx;
+  // 2. Gather left and right groups of each chunk.
+  unsigned int num_left = 0;
+  for (unsigned int c = 0; c < num_chunks; c++) {
+    num_left += chunk_num_left[c];
+  }
 
-    out_nodes->push_back(leaf);  // atomic update
+  std::vector<unsigned int> partitioned(n);
+  unsigned int left_offset = 0;
+  unsigned int right_offset = num_left;
 
-    out_stat->num_leaf_nodes++;
+  for (unsigned int c = 0; c < num_chunks; c++) {
+    const unsigned int chunk_left = left_idx + c * kTaskChunkSize;
+    const unsigned int chunk_right =
+        std::min(chunk_left + kTaskChunkSize, right_idx);
+    const unsigned int chunk_n = chunk_right - chunk_left;
+    const unsigned int chunk_mid = chunk_left + chunk_num_left[c];
 
-    return offset;
-  }
+#pragma omp task shared(partitioned)
+    {
+      std::copy(indices_.begin() + chunk_left, indices_.begin() + chunk_mid,
+                partitioned.begin() + left_offset);
+      std::copy(indices_.begin() + chunk_mid, indices_.begin() + chunk_right,
+                partitioned.begin() + right_offset);
+    }
 
-  //
-  // Create branch node.
-  //
+    left_offset += chunk_num_left[c];
+    right_offset += chunk_n - chunk_num_left[c];
+  }
+#pragma omp taskwait
 
-  //
-  // Compute SAH and find best split axis and position
-  //
-  int min_cut_axis = 0;
-  T cut_pos[3] = {0.0, 0.0, 0.0};
+  std::copy(partitioned.begin(), partitioned.end(),
+            indices_.begin() + left_idx);
 
-  BinBuffer bins(options_.bin_size);
-  ContributeBinBuffer(&bins, bmin, bmax, &indices_.at(0), left_idx, right_idx,
-                      p);
-  FindCutFromBinBuffer(cut_pos, &min_cut_axis, &bins, bmin, bmax, n,
-                       options_.cost_t_aabb);
+  return left_idx + num_left;
+}
 
-  // Try all 3 axis until good cut position avaiable.
-  unsigned int mid_idx = left_idx;
-  int cut_axis = min_cut_axis;
-  for (int axis_try = 0; axis_try < 3; axis_try++) {
-    unsigned int *begin = &indices_[left_idx];
-    unsigned int *end = &indices_[right_idx - 1] + 1;  // mimics end() iterator.
-    unsigned int *mid = 0;
+template <typename T>
+template <class P, class Pred>
+void BVHAccel<T>::BuildTreeTask(BVHNode<T> *nodes, unsigned int *num_nodes,
+                                unsigned int node_index,
+                                unsigned int left_idx, unsigned int right_idx,
+                                unsigned int depth, const P &p,
+                                const Pred &pred) {
+  assert(left_idx < right_idx);
 
-    // try min_cut_axis first.
-    cut_axis = (min_cut_axis + axis_try) % 3;
+  const unsigned int n = right_idx - left_idx;
+  const bool split_task = (n > kTaskSplitThreshold);
 
-    pred.Set(cut_axis, cut_pos[cut_axis]);
+  real3<T> bmin, bmax;
+  if (split_task) {
+    ComputeBoundingBoxTask(&bmin, &bmax, left_idx, right_idx, p);
+  } else if (!bboxes_.empty()) {
+    GetBoundingBox(&bmin, &bmax, bboxes_, &indices_.at(0), left_idx, right_idx);
+  } else {
+    ComputeBoundingBox(&bmin, &bmax, &indices_.at(0), left_idx, right_idx, p);
+  }
 
-    //
-    // Split at (cut_axis, cut_pos)
-    // indices_ will be modified.
-    //
-    mid = std::partition(begin, end, pred);
+  BVHNode<T> &node = nodes[node_index];
 
-    mid_idx = left_idx + static_cast<unsigned int>((mid - begin));
-    if ((mid_idx == left_idx) || (mid_idx == right_idx)) {
-      // Can't split well.
-      // Switch to object median(which may create unoptimized tree, but
-      // stable)
-      mid_idx = left_idx + (n >> 1);
+  node.bmin[0] = bmin[0];
+  node.bmin[1] = bmin[1];
+  node.bmin[2] = bmin[2];
 
-      // Try another axis to find better cut.
+  node.bmax[0] = bmax[0];
+  node.bmax[1] = bmax[1];
+  node.bmax[2] = bmax[2];
 
-    } else {
-      // Found good cut. exit loop.
-      break;
-    }
+  if ((n <= options_.min_leaf_primitives) || (n <= 1) ||
+      (depth >= options_.max_tree_depth)) {
+    // Create leaf node.
+    node.SetLeaf(n, left_idx);
+    return;
   }
 
-  BVHNode<T> node;
-  node.axis = cut_axis;
-  node.flag = 0;  // 0 = branch
-
-  out_nodes->push_back(node);
+  unsigned int mid_idx = left_idx;
+  int cut_axis = 0;
+  bool make_leaf;
 
-  unsigned int left_child_index = 0;
-  unsigned int right_child_index = 0;
+  if (split_task) {
+    BinBuffer bins(options_.bin_size);
+    make_leaf = FindNodeSplit(&mid_idx, &cut_axis, &bins,
+                              GetThreadSweepBuffer(), bmin, bmax, left_idx,
+                              right_idx, p, pred, TaskNodeSplitter(this));
+  } else {
+    // No task scheduling point while the thread's buffers are in use.
+    make_leaf = FindNodeSplit(&mid_idx, &cut_axis, GetThreadBinBuffer(),
+                              GetThreadSweepBuffer(), bmin, bmax, left_idx,
+                              right_idx, p, pred, NodeSplitter(this));
+  }
 
-  left_child_index =
-      BuildTree(out_stat, out_nodes, left_idx, mid_idx, depth + 1, p, pred);
+  if (make_leaf) {
+    node.SetLeaf(n, left_idx);
+    return;
+  }
 
-  right_child_index =
-      BuildTree(out_stat, out_nodes, mid_idx, right_idx, depth + 1, p, pred);
+  const unsigned int left_child_index = FetchAndAdd(num_nodes, 2);
+  const unsigned int right_child_index = left_child_index + 1;
 
-  {
-    (*out_nodes)[offset].data[0] = left_child_index;
-    (*out_nodes)[offset].data[1] = right_child_index;
+  node.SetBranch(cut_axis, left_child_index, right_child_index);
 
-    (*out_nodes)[offset].bmin[0] = bmin[0];
-    (*out_nodes)[offset].bmin[1] = bmin[1];
-    (*out_nodes)[offset].bmin[2] = bmin[2];
+  const P *pp = &p;
+  const Pred *ppred = &pred;
 
-    (*out_nodes)[offset].bmax[0] = bmax[0];
-    (*out_nodes)[offset].bmax[1] = bmax[1];
-    (*out_nodes)[offset].bmax[2] = bmax[2];
+  if (n > kTaskBuildThreshold) {
+#pragma omp task
+    BuildTreeTask(nodes, num_nodes, left_child_index, left_idx, mid_idx,
+                  depth + 1, *pp, *ppred);
+  } else {
+    BuildTreeTask(nodes, num_nodes, left_child_index, left_idx, mid_idx,
+                  depth + 1, *pp, *ppred);
   }
 
-  out_stat->num_branch_nodes++;
-
-  return offset;
+  BuildTreeTask(nodes, num_nodes, right_child_index, mid_idx, right_idx,
+                depth + 1, *pp, *ppred);
 }
 
-template <typename T>
-template <class P, class Pred>
-bool BVHAccel<T>::Build(unsigned int num_primitives, const P &p,
-                        const Pred &pred, const BVHBuildOptions<T> &options) {
-  options_ = options;
-  stats_ = BVHBuildStatistics();
-
-  nodes_.clear();
-  bboxes_.clear();
-
-  assert(options_.bin_size > 1);
+#endif
 
-  if (num_primitives == 0) {
-    return false;
+#if NANORT_ENABLE_PARALLEL_BUILD && defined(NANORT_USE_TASK_SCHEDULER)
+template <typename T>
+template <class P>
+void BVHAccel<T>::ComputeBoundingBoxTask(TaskScheduler *scheduler,
+                                         real3<T> *bmin, real3<T> *bmax,
+                                         unsigned int left_idx,
+                                         unsigned int right_idx,
+                                         const P &p) {
+  const unsigned int n = right_idx - left_idx;
+  const unsigned int num_chunks = (n + kTaskChunkSize - 1) / kTaskChunkSize;
+
+  std::vector<BBox<T> > chunk_bboxes(num_chunks);
+
+  ParallelFor(scheduler, num_chunks, 1,
+              [&](unsigned int begin, unsigned int end) {
+                for (unsigned int c = begin; c < end; c++) {
+                  const unsigned int chunk_left = left_idx + c * kTaskChunkSize;
+                  const unsigned int chunk_right =
+                      std::min(chunk_left + kTaskChunkSize, right_idx);
+                  BBox<T> &bbox = chunk_bboxes[c];
+                  if (!bboxes_.empty()) {
+                    GetBoundingBox(&bbox.bmin, &bbox.bmax, bboxes_,
+                                   &indices_.at(0), chunk_left, chunk_right);
+                  } else {
+                    ComputeBoundingBox(&bbox.bmin, &bbox.bmax, &indices_.at(0),
+                                       chunk_left, chunk_right, p);
+                  }
+                }
+              });
+
+  (*bmin) = chunk_bboxes[0].bmin;
+  (*bmax) = chunk_bboxes[0].bmax;
+  for (unsigned int c = 1; c < num_chunks; c++) {
+    for (int k = 0; k < 3; k++) {
+      (*bmin)[k] = std::min((*bmin)[k], chunk_bboxes[c].bmin[k]);
+      (*bmax)[k] = std::max((*bmax)[k], chunk_bboxes[c].bmax[k]);
+    }
   }
+}
 
-  unsigned int n = num_primitives;
-
-  //
-  // 1. Create triangle indices(this will be permutated in BuildTree)
-  //
-  indices_.resize(n);
-
-#ifdef _OPENMP
-#pragma omp parallel for
-#endif
-  for (int i = 0; i < static_cast<int>(n); i++) {
-    indices_[static_cast<size_t>(i)] = static_cast<unsigned int>(i);
+template <typename T>
+template <class P>
+void BVHAccel<T>::ContributeBinBufferTask(TaskScheduler *scheduler,
+                                          BinBuffer *bins,
+                                          const real3<T> &bmin,
+                                          const real3<T> &bmax,
+                                          unsigned int left_idx,
+                                          unsigned int right_idx,
+                                          const P &p) {
+  const unsigned int n = right_idx - left_idx;
+  const unsigned int num_chunks = (n + kTaskChunkSize - 1) / kTaskChunkSize;
+
+  std::vector<BinBuffer> chunk_bins(num_chunks, BinBuffer(bins->bin_size));
+
+  ParallelFor(scheduler, num_chunks, 1,
+              [&](unsigned int begin, unsigned int end) {
+                for (unsigned int c = begin; c < end; c++) {
+                  const unsigned int chunk_left = left_idx + c * kTaskChunkSize;
+                  const unsigned int chunk_right =
+                      std::min(chunk_left + kTaskChunkSize, right_idx);
+                  ContributeBinBuffer(&chunk_bins[c], bmin, bmax,
+                                      &indices_.at(0), chunk_left, chunk_right,
+                                      p);
+                }
+              });
+
+  bins->clear();
+  for (unsigned int c = 0; c < num_chunks; c++) {
+    for (size_t i = 0; i < bins->bin.size(); i++) {
+      bins->bin[i] += chunk_bins[c].bin[i];
+    }
   }
+}
 
-  //
-  // 2. Compute bounding box(optional).
-  //
-  real3<T> bmin, bmax;
-  if (options.cache_bbox) {
-    bmin[0] = bmin[1] = bmin[2] = std::numeric_limits<T>::max();
-    bmax[0] = bmax[1] = bmax[2] = -std::numeric_limits<T>::max();
+template <typename T>
+template <class Pred>
+unsigned int BVHAccel<T>::PartitionTask(TaskScheduler *scheduler,
+                                        unsigned int left_idx,
+                                        unsigned int right_idx,
+                                        const Pred &pred) {
+  const unsigned int n = right_idx - left_idx;
+  const unsigned int num_chunks = (n + kTaskChunkSize - 1) / kTaskChunkSize;
+
+  // 1. Partition each chunk in place.
+  std::vector<unsigned int> chunk_num_left(num_chunks);
+
+  ParallelFor(scheduler, num_chunks, 1,
+              [&](unsigned int begin, unsigned int end) {
+                for (unsigned int c = begin; c < end; c++) {
+                  const unsigned int chunk_left = left_idx + c * kTaskChunkSize;
+                  const unsigned int chunk_right =
+                      std::min(chunk_left + kTaskChunkSize, right_idx);
+                  unsigned int *first = &indices_[chunk_left];
+                  unsigned int *last = first + (chunk_right - chunk_left);
+                  Pred chunk_pred(pred);  // Pred may have mutable state.
+                  unsigned int *mid = std::partition(first, last, chunk_pred);
+                  chunk_num_left[c] = static_cast<unsigned int>(mid - first);
+                }
+              });
+
+  // 2. Gather left and right groups of each chunk.
+  std::vector<unsigned int> left_offsets(num_chunks);
+  std::vector<unsigned int> right_offsets(num_chunks);
+  unsigned int num_left = 0;
+  for (unsigned int c = 0; c < num_chunks; c++) {
+    left_offsets[c] = num_left;
+    num_left += chunk_num_left[c];
+  }
+  unsigned int right_offset = num_left;
+  for (unsigned int c = 0; c < num_chunks; c++) {
+    right_offsets[c] = right_offset;
+    const unsigned int chunk_left = left_idx + c * kTaskChunkSize;
+    const unsigned int chunk_right =
+        std::min(chunk_left + kTaskChunkSize, right_idx);
+    right_offset += (chunk_right - chunk_left) - chunk_num_left[c];
+  }
 
-    bboxes_.resize(n);
-    for (size_t i = 0; i < n; i++) {  // for each primitived
-      unsigned int idx = indices_[i];
+  std::vector<unsigned int> partitioned(n);
+
+  ParallelFor(scheduler, num_chunks, 1,
+              [&](unsigned int begin, unsigned int end) {
+                for (unsigned int c = begin; c < end; c++) {
+                  const unsigned int chunk_left = left_idx + c * kTaskChunkSize;
+                  const unsigned int chunk_right =
+                      std::min(chunk_left + kTaskChunkSize, right_idx);
+                  const unsigned int chunk_mid = chunk_left + chunk_num_left[c];
+                  std::copy(indices_.begin() + chunk_left,
+                            indices_.begin() + chunk_mid,
+                            partitioned.begin() + left_offsets[c]);
+                  std::copy(indices_.begin() + chunk_mid,
+                            indices_.begin() + chunk_right,
+                            partitioned.begin() + right_offsets[c]);
+                }
+              });
+
+  std::copy(partitioned.begin(), partitioned.end(),
+            indices_.begin() + left_idx);
+
+  return left_idx + num_left;
+}
 
-      BBox<T> bbox;
-      p.BoundingBox(&(bbox.bmin), &(bbox.bmax), static_cast<unsigned int>(i));
-      bboxes_[idx] = bbox;
+template <typename T>
+template <class P, class Pred>
+void BVHAccel<T>::BuildTreeTask(TaskScheduler *scheduler, TaskGroup *group,
+                                BVHNode<T> *nodes,
+                                std::atomic<unsigned int> *num_nodes,
+                                unsigned int node_index,
+                                unsigned int left_idx, unsigned int right_idx,
+                                unsigned int depth, BinBuffer *bins,
+                                SweepBuffer<T> *sweep, const P &p,
+                                const Pred &pred) {
+  assert(left_idx < right_idx);
 
-      for (int k = 0; k < 3; k++) {  // xyz
-        if (bmin[k] > bbox.bmin[k]) {
-          bmin[k] = bbox.bmin[k];
-        }
-        if (bmax[k] < bbox.bmax[k]) {
-          bmax[k] = bbox.bmax[k];
-        }
-      }
-    }
+  const unsigned int n = right_idx - left_idx;
+  const bool split_task = (n > kTaskSplitThreshold);
 
+  real3<T> bmin, bmax;
+  if (split_task) {
+    ComputeBoundingBoxTask(scheduler, &bmin, &bmax, left_idx, right_idx, p);
+  } else if (!bboxes_.empty()) {
+    GetBoundingBox(&bmin, &bmax, bboxes_, &indices_.at(0), left_idx, right_idx);
   } else {
-#ifdef _OPENMP
-    ComputeBoundingBoxOMP(&bmin, &bmax, &indices_.at(0), 0, n, p);
-#else
-    ComputeBoundingBox(&bmin, &bmax, &indices_.at(0), 0, n, p);
-#endif
+    ComputeBoundingBox(&bmin, &bmax, &indices_.at(0), left_idx, right_idx, p);
   }
 
-//
-// 3. Build tree
-//
-#ifdef _OPENMP
-#if NANORT_ENABLE_PARALLEL_BUILD
-
-  // Do parallel build for enoughly large dataset.
-  if (n > options.min_primitives_for_parallel_build) {
-    BuildShallowTree(&nodes_, 0, n, /* root depth */ 0, options.shallow_depth,
-                     p, pred);  // [0, n)
+  BVHNode<T> &node = nodes[node_index];
 
-    assert(shallow_node_infos_.size() > 0);
+  node.bmin[0] = bmin[0];
+  node.bmin[1] = bmin[1];
+  node.bmin[2] = bmin[2];
 
-    // Build deeper tree in parallel
-    std::vector<std::vector<BVHNode<T> > > local_nodes(
-        shallow_node_infos_.size());
-    std::vector<BVHBuildStatistics> local_stats(shallow_node_infos_.size());
+  node.bmax[0] = bmax[0];
+  node.bmax[1] = bmax[1];
+  node.bmax[2] = bmax[2];
 
-#pragma omp parallel for
-    for (int i = 0; i < static_cast<int>(shallow_node_infos_.size()); i++) {
-      unsigned int left_idx = shallow_node_infos_[i].left_idx;
-      unsigned int right_idx = shallow_node_infos_[i].right_idx;
-      BuildTree(&(local_stats[i]), &(local_nodes[i]), left_idx, right_idx,
-                options.shallow_depth, p, pred);
-    }
+  if ((n <= options_.min_leaf_primitives) || (n <= 1) ||
+      (depth >= options_.max_tree_depth)) {
+    // Create leaf node.
+    node.SetLeaf(n, left_idx);
+    return;
+  }
 
-    // Join local nodes
-    for (int i = 0; i < static_cast<int>(local_nodes.size()); i++) {
-      assert(!local_nodes[i].empty());
-      size_t offset = nodes_.size();
+  unsigned int mid_idx = left_idx;
+  int cut_axis = 0;
+  bool make_leaf;
 
-      // Add offset to child index(for branch node).
-      for (size_t j = 0; j < local_nodes[i].size(); j++) {
-        if (local_nodes[i][j].flag == 0) {  // branch
-          local_nodes[i][j].data[0] += offset - 1;
-          local_nodes[i][j].data[1] += offset - 1;
-        }
-      }
+  if (split_task) {
+    make_leaf = FindNodeSplit(&mid_idx, &cut_axis, bins, sweep, bmin, bmax,
+                              left_idx, right_idx, p, pred,
+                              SchedulerNodeSplitter(this, scheduler));
+  } else {
+    make_leaf = FindNodeSplit(&mid_idx, &cut_axis, bins, sweep, bmin, bmax,
+                              left_idx, right_idx, p, pred,
+                              NodeSplitter(this));
+  }
 
-      // replace
-      nodes_[shallow_node_infos_[i].offset] = local_nodes[i][0];
+  if (make_leaf) {
+    node.SetLeaf(n, left_idx);
+    return;
+  }
 
-      // Skip root element of the local node.
-      nodes_.insert(nodes_.end(), local_nodes[i].begin() + 1,
-                    local_nodes[i].end());
-    }
+  const unsigned int left_child_index = num_nodes->fetch_add(2);
+  const unsigned int right_child_index = left_child_index + 1;
+
+  node.SetBranch(cut_axis, left_child_index, right_child_index);
+
+  if (n > kTaskBuildThreshold) {
+    const P *pp = &p;
+    const Pred *ppred = &pred;
+    SpawnTask(scheduler, group,
+              [this, scheduler, group, nodes, num_nodes, left_child_index,
+               left_idx, mid_idx, depth, pp, ppred]() {
+                BinBuffer task_bins(options_.bin_size);
+                SweepBuffer<T> task_sweep;
+                BuildTreeTask(scheduler, group, nodes, num_nodes,
+                              left_child_index, left_idx, mid_idx, depth + 1,
+                              &task_bins, &task_sweep, *pp, *ppred);
+              });
+  } else {
+    BuildTreeTask(scheduler, group, nodes, num_nodes, left_child_index,
+                  left_idx, mid_idx, depth + 1, bins, sweep, p, pred);
+  }
 
-    // Join statistics
-    for (int i = 0; i < static_cast<int>(local_nodes.size()); i++) {
-      stats_.max_tree_depth =
-          std::max(stats_.max_tree_depth, local_stats[i].max_tree_depth);
-      stats_.num_leaf_nodes += local_stats[i].num_leaf_nodes;
-      stats_.num_branch_nodes += local_stats[i].num_branch_nodes;
-    }
+  BuildTreeTask(scheduler, group, nodes, num_nodes, right_child_index, mid_idx,
+                right_idx, depth + 1, bins, sweep, p, pred);
+}
+#endif
 
-  } else {
-    BuildTree(&stats_, &nodes_, 0, n,
-              /* root depth */ 0, p, pred);  // [0, n)
+template <typename T>
+template <class P>
+bool BVHAccel<T>::IsLeafCheaper(const real3<T> &bmin, const real3<T> &bmax,
+                                unsigned int left_idx, unsigned int mid_idx,
+                                unsigned int right_idx, const P &p) {
+  const unsigned int n = right_idx - left_idx;
+  if (n > options_.max_leaf_primitives) {
+    return false;
   }
 
-#else  // !NANORT_ENABLE_PARALLEL_BUILD
-  {
-    BuildTree(&stats_, &nodes_, 0, n,
-              /* root depth */ 0, p, pred);  // [0, n)
+  const T sa = CalculateSurfaceArea(bmin, bmax);
+  if (sa <= std::numeric_limits<T>::min()) {
+    return true;  // degenerated
   }
-#endif
-#else  // !_OPENMP
-  {
-    BuildTree(&stats_, &nodes_, 0, n,
-              /* root depth */ 0, p, pred);  // [0, n)
+
+  // Binned SAH in FindCutFromBinBuffer() counts primitives straddling the cut
+  // on both sides and uses slab bounds, which is too coarse for small nodes.
+  // Use actual bounds of children instead.
+  real3<T> left_bmin, left_bmax, right_bmin, right_bmax;
+  if (!bboxes_.empty()) {
+    GetBoundingBox(&left_bmin, &left_bmax, bboxes_, &indices_.at(0), left_idx,
+                   mid_idx);
+    GetBoundingBox(&right_bmin, &right_bmax, bboxes_, &indices_.at(0),
+                   mid_idx, right_idx);
+  } else {
+    ComputeBoundingBox(&left_bmin, &left_bmax, &indices_.at(0), left_idx,
+                       mid_idx, p);
+    ComputeBoundingBox(&right_bmin, &right_bmax, &indices_.at(0), mid_idx,
+                       right_idx, p);
   }
-#endif
 
-  return true;
+  const T cost_t_aabb = options_.cost_t_aabb;
+  const T cost_t_tri = static_cast<T>(1.0) - cost_t_aabb;
+  const T split_cost =
+      SAH(mid_idx - left_idx, CalculateSurfaceArea(left_bmin, left_bmax),
+          right_idx - mid_idx, CalculateSurfaceArea(right_bmin, right_bmax),
+          static_cast<T>(1.0) / sa, cost_t_aabb, cost_t_tri);
+
+  return IsLeafCheaper(n, split_cost);
 }
 
 template <typename T>
-void BVHAccel<T>::Debug() {
-  for (size_t i = 0; i < indices_.size(); i++) {
-    printf("index[%d] = %d\n", int(i), int(indices_[i]));
+bool BVHAccel<T>::IsLeafCheaper(unsigned int n, T split_cost) const {
+  if (n > options_.max_leaf_primitives) {
+    return false;
   }
 
-  for (size_t i = 0; i < nodes_.size(); i++) {
-    printf("node[%d] : bmin %f, %f, %f, bmax %f, %f, %f\n", int(i),
-           nodes_[i].bmin[0], nodes_[i].bmin[1], nodes_[i].bmin[1],
-           nodes_[i].bmax[0], nodes_[i].bmax[1], nodes_[i].bmax[1]);
-  }
+  const T cost_t_tri = static_cast<T>(1.0) - options_.cost_t_aabb;
+  return split_cost >= static_cast<T>(n) * cost_t_tri;
 }
 
 template <typename T>
-bool BVHAccel<T>::Dump(const char *filename) {
-  FILE *fp = fopen(filename, "wb");
-  if (!fp) {
-    // fprintf(stderr, "[BVHAccel] Cannot write a file: %s\n", filename);
-    return false;
+template <class P, class Pred, class S>
+bool BVHAccel<T>::FindNodeSplit(unsigned int *mid_idx, int *cut_axis,
+                                BinBuffer *bins, SweepBuffer<T> *sweep,
+                                const real3<T> &bmin, const real3<T> &bmax,
+                                unsigned int left_idx, unsigned int right_idx,
+                                const P &p, const Pred &pred,
+                                const S &splitter) {
+  const unsigned int n = right_idx - left_idx;
+
+  //
+  // Compute SAH and find best split axis and position
+  //
+  const bool over_budget = IsPastDeadline(build_deadline_secs_);
+  if ((n <= options_.sweep_sah_threshold) && !over_budget) {
+    T split_cost;
+    FindSweepSplit(mid_idx, cut_axis, &split_cost, sweep, bmin, bmax,
+                   left_idx, right_idx, p);
+    return IsLeafCheaper(n, split_cost);
   }
 
-  size_t numNodes = nodes_.size();
-  assert(nodes_.size() > 0);
+  int min_cut_axis = 0;
+  T cut_pos[3] = {0.0, 0.0, 0.0};
 
-  size_t numIndices = indices_.size();
+  if (over_budget) {
+    FindSpatialMedianCut(cut_pos, &min_cut_axis, bmin, bmax);
+  } else {
+    splitter.ContributeBins(bins, bmin, bmax, left_idx, right_idx, p);
+    FindCutFromBinBuffer(cut_pos, &min_cut_axis, bins, bmin, bmax, n,
+                         options_.cost_t_aabb);
+  }
 
-  size_t r = 0;
-  r = fwrite(&numNodes, sizeof(size_t), 1, fp);
-  assert(r == 1);
+  // Each task uses its own predicator since Pred::Set() modifies its state.
+  Pred local_pred(pred);
 
-  r = fwrite(&nodes_.at(0), sizeof(BVHNode<T>), numNodes, fp);
-  assert(r == numNodes);
+  // Try all 3 axis until good cut position avaiable.
+  *cut_axis = min_cut_axis;
+  for (int axis_try = 0; axis_try < 3; axis_try++) {
+    // try min_cut_axis first.
+    *cut_axis = (min_cut_axis + axis_try) % 3;
 
-  r = fwrite(&numIndices, sizeof(size_t), 1, fp);
-  assert(r == 1);
+    local_pred.Set(*cut_axis, cut_pos[*cut_axis]);
 
-  r = fwrite(&indices_.at(0), sizeof(unsigned int), numIndices, fp);
-  assert(r == numIndices);
+    //
+    // Split at (cut_axis, cut_pos)
+    // indices_ will be modified.
+    //
+    *mid_idx = splitter.Partition(left_idx, right_idx, local_pred);
 
-  fclose(fp);
+    if ((*mid_idx == left_idx) || (*mid_idx == right_idx)) {
+      // Can't split well.
+      // Switch to object median(which may create unoptimized tree, but
+      // stable)
+      *mid_idx = left_idx + (n >> 1);
 
-  return true;
+      // Try another axis to find better cut.
+
+    } else {
+      // Found good cut. exit loop.
+      break;
+    }
+  }
+
+  return IsLeafCheaper(bmin, bmax, left_idx, *mid_idx, right_idx, p);
 }
 
 template <typename T>
-bool BVHAccel<T>::Load(const char *filename) {
-  FILE *fp = fopen(filename, "rb");
-  if (!fp) {
-    // fprintf(stderr, "Cannot open file: %s\n", filename);
-    return false;
+void BVHAccel<T>::UpdateStatistics() {
+  stats_.max_tree_depth = 0;
+  stats_.num_leaf_nodes = 0;
+  stats_.num_branch_nodes = 0;
+  stats_.sah_cost = 0.0f;
+
+  const T cost_t_aabb = options_.cost_t_aabb;
+  const T cost_t_tri = static_cast<T>(1.0) - cost_t_aabb;
+  const T root_area =
+      CalculateSurfaceArea(real3<T>(nodes_[0].bmin), real3<T>(nodes_[0].bmax));
+  const T inv_root_area = (root_area > static_cast<T>(0.0))
+                              ? static_cast<T>(1.0) / root_area
+                              : static_cast<T>(0.0);
+  T sah_cost = static_cast<T>(0.0);
+
+  std::vector<std::pair<unsigned int, unsigned int> > stack;  // index, depth
+  stack.push_back(std::make_pair(0u, 0u));
+  while (!stack.empty()) {
+    const std::pair<unsigned int, unsigned int> item = stack.back();
+    stack.pop_back();
+    stats_.max_tree_depth = std::max(stats_.max_tree_depth, item.second);
+
+    const BVHNode<T> &node = nodes_[item.first];
+    const T area =
+        CalculateSurfaceArea(real3<T>(node.bmin), real3<T>(node.bmax)) *
+        inv_root_area;
+    if (node.IsLeaf()) {
+      stats_.num_leaf_nodes++;
+      sah_cost +=
+          area * static_cast<T>(node.GetNumPrimitives()) * cost_t_tri;
+    } else {
+      stats_.num_branch_nodes++;
+      sah_cost += area * static_cast<T>(2.0) * cost_t_aabb;
+      stack.push_back(std::make_pair(node.GetChild(0), item.second + 1));
+      stack.push_back(std::make_pair(node.GetChild(1), item.second + 1));
+    }
   }
 
-  size_t numNodes;
-  size_t numIndices;
+  stats_.sah_cost = static_cast<float>(sah_cost);
+}
 
-  size_t r = 0;
-  r = fread(&numNodes, sizeof(size_t), 1, fp);
-  assert(r == 1);
-  assert(numNodes > 0);
+template <typename T>
+void BVHAccel<T>::PrepareThreadBinBuffers() {
+#ifdef _OPENMP
+  const size_t num_threads = static_cast<size_t>(omp_get_max_threads());
+#else
+  const size_t num_threads = 1;
+#endif
 
-  nodes_.resize(numNodes);
-  r = fread(&nodes_.at(0), sizeof(BVHNode<T>), numNodes, fp);
-  assert(r == numNodes);
+  if ((thread_bins_.size() < num_threads) ||
+      (thread_bins_[0].bin_size != options_.bin_size)) {
+    thread_bins_.assign(num_threads, BinBuffer(options_.bin_size));
+  }
 
-  r = fread(&numIndices, sizeof(size_t), 1, fp);
-  assert(r == 1);
+  if (thread_sweeps_.size() < num_threads) {
+    thread_sweeps_.resize(num_threads);
+  }
+}
 
-  indices_.resize(numIndices);
+template <typename T>
+BinBuffer *BVHAccel<T>::GetThreadBinBuffer() {
+#ifdef _OPENMP
+  return &thread_bins_[static_cast<size_t>(omp_get_thread_num())];
+#else
+  return &thread_bins_[0];
+#endif
+}
 
-  r = fread(&indices_.at(0), sizeof(unsigned int), numIndices, fp);
-  assert(r == numIndices);
+template <typename T>
+SweepBuffer<T> *BVHAccel<T>::GetThreadSweepBuffer() {
+#ifdef _OPENMP
+  return &thread_sweeps_[static_cast<size_t>(omp_get_thread_num())];
+#else
+  return &thread_sweeps_[0];
+#endif
+}
 
-  fclose(fp);
+template <typename T>
+void BVHAccel<T>::CompactNodes(const BVHNodeArray &sparse_nodes) {
+  nodes_.clear();
 
-  return true;
+  std::vector<CompactItem> stack;
+  CompactItem root = {0, 0, 0, -1};
+  stack.push_back(root);
+
+  while (!stack.empty()) {
+    const CompactItem item = stack.back();
+    stack.pop_back();
+
+    const unsigned int new_index = static_cast<unsigned int>(nodes_.size());
+    const BVHNode<T> &node = sparse_nodes[item.sparse_index];
+    nodes_.push_back(node);
+
+    if (item.child_slot >= 0) {
+      nodes_[item.parent].SetChild(item.child_slot, new_index);
+    }
+
+    if (stats_.max_tree_depth < item.depth) {
+      stats_.max_tree_depth = item.depth;
+    }
+
+    if (node.IsLeaf()) {
+      stats_.num_leaf_nodes++;
+    } else {
+      stats_.num_branch_nodes++;
+
+      // Push right child first so that left child is placed next to parent.
+      CompactItem right = {node.GetChild(1), item.depth + 1, new_index, 1};
+      CompactItem left = {node.GetChild(0), item.depth + 1, new_index, 0};
+      stack.push_back(right);
+      stack.push_back(left);
+    }
+  }
 }
 
 template <typename T>
-inline bool IntersectRayAABB(T *tminOut,  // [out]
-                             T *tmaxOut,  // [out]
-                             T min_t, T max_t, const T bmin[3], const T bmax[3],
-                             real3<T> ray_org, real3<T> ray_inv_dir,
-                             int ray_dir_sign[3]);
+template <class K>
+void BVHAccel<T>::EmitLBVHNode(BVHNode<T> *nodes, unsigned int node_index,
+                               const K *codes,
+                               const BBox<T> *prim_bboxes,
+                               unsigned int left_idx, unsigned int right_idx,
+                               unsigned int depth, int axis) {
+  assert(left_idx < right_idx);
+
+  const unsigned int n = right_idx - left_idx;
+  BVHNode<T> &node = nodes[node_index];
+
+  if ((n <= options_.min_leaf_primitives) || (n <= 1) ||
+      (depth >= options_.max_tree_depth)) {
+    // Create leaf node.
+    BBox<T> bbox;
+    for (unsigned int i = left_idx; i < right_idx; i++) {
+      const BBox<T> &prim_bbox = prim_bboxes[indices_[i]];
+      for (int k = 0; k < 3; k++) {
+        bbox.bmin[k] = std::min(bbox.bmin[k], prim_bbox.bmin[k]);
+        bbox.bmax[k] = std::max(bbox.bmax[k], prim_bbox.bmax[k]);
+      }
+    }
+
+    for (int k = 0; k < 3; k++) {
+      node.bmin[k] = bbox.bmin[k];
+      node.bmax[k] = bbox.bmax[k];
+    }
+
+    node.SetLeaf(n, left_idx);
+    return;
+  }
+
+  //
+  // Split at the highest bit which differs in the range. Codes are sorted,
+  // so the first half has 0 and the second half has 1 at that bit.
+  //
+  unsigned int mid_idx;
+  int split_axis = axis;
+  const K diff = codes[left_idx] ^ codes[right_idx - 1];
+  if (diff == 0) {
+    // All primitives are in the same Morton cell. Use object median.
+    mid_idx = left_idx + (n >> 1);
+  } else {
+    int bit = static_cast<int>(3 * MortonCodeTraits<K>::kAxisBits) - 1;
+    while ((diff & (static_cast<K>(1) << bit)) == 0) {
+      bit--;
+    }
+    const K mask = static_cast<K>(1) << bit;
+
+    // Binary search the first code which has 1 at `bit`.
+    unsigned int lo = left_idx;       // (codes[lo] & mask) == 0
+    unsigned int hi = right_idx - 1;  // (codes[hi] & mask) != 0
+    while (lo + 1 < hi) {
+      const unsigned int m = lo + ((hi - lo) >> 1);
+      if (codes[m] & mask) {
+        hi = m;
+      } else {
+        lo = m;
+      }
+    }
+    mid_idx = hi;
+
+    // x, y and z bits are interleaved as (x << 2) | (y << 1) | z.
+    split_axis = 2 - (bit % 3);
+  }
+
+  // Left subtree owns 2 * (mid_idx - left_idx) - 1 slots after this node.
+  const unsigned int left_child_index = node_index + 1;
+  const unsigned int right_child_index =
+      node_index + 2 * (mid_idx - left_idx);
+
+#if defined(NANORT_USE_OPENMP_TASK)
+  if (n > kTaskBuildThreshold) {
+#pragma omp task
+    EmitLBVHNode(nodes, left_child_index, codes, prim_bboxes, left_idx,
+                 mid_idx, depth + 1, split_axis);
+  } else {
+    EmitLBVHNode(nodes, left_child_index, codes, prim_bboxes, left_idx,
+                 mid_idx, depth + 1, split_axis);
+  }
+  EmitLBVHNode(nodes, right_child_index, codes, prim_bboxes, mid_idx,
+               right_idx, depth + 1, split_axis);
+#pragma omp taskwait
+#else
+  EmitLBVHNode(nodes, left_child_index, codes, prim_bboxes, left_idx, mid_idx,
+               depth + 1, split_axis);
+  EmitLBVHNode(nodes, right_child_index, codes, prim_bboxes, mid_idx,
+               right_idx, depth + 1, split_axis);
+#endif
+
+  const BVHNode<T> &left_node = nodes[left_child_index];
+  const BVHNode<T> &right_node = nodes[right_child_index];
+  for (int k = 0; k < 3; k++) {
+    node.bmin[k] = std::min(left_node.bmin[k], right_node.bmin[k]);
+    node.bmax[k] = std::max(left_node.bmax[k], right_node.bmax[k]);
+  }
+
+  node.SetBranch(split_axis, left_child_index, right_child_index);
+}
+
+template <typename T>
+template <class K, class P>
+const BBox<T> *BVHAccel<T>::SortByMortonCodes(
+    unsigned int num_primitives, const P &p,
+    std::vector<BBox<T> > *local_bboxes, std::vector<K> *codes) {
+  const unsigned int n = num_primitives;
+  const int num_blocks = static_cast<int>((n + kMortonBlockSize - 1) /
+                                          kMortonBlockSize);
+
+  //
+  // 1. Compute primitive bounding boxes and centroid bounds.
+  //
+  if (bboxes_.empty()) {
+    local_bboxes->resize(n);
+
+#ifdef _OPENMP
+#pragma omp parallel for
+#endif
+    for (int i = 0; i < static_cast<int>(n); i++) {
+      BBox<T> &bbox = (*local_bboxes)[static_cast<size_t>(i)];
+      p.BoundingBox(&(bbox.bmin), &(bbox.bmax), static_cast<unsigned int>(i));
+    }
+  }
+  const BBox<T> *prim_bboxes =
+      bboxes_.empty() ? &local_bboxes->at(0) : &bboxes_.at(0);
+
+  // Bounds of (bmin + bmax), i.e. 2x centroid.
+  std::vector<BBox<T> > block_bounds(static_cast<size_t>(num_blocks));
+
+#ifdef _OPENMP
+#pragma omp parallel for
+#endif
+  for (int b = 0; b < num_blocks; b++) {
+    const unsigned int begin = static_cast<unsigned int>(b) * kMortonBlockSize;
+    const unsigned int end = std::min(begin + kMortonBlockSize, n);
+    BBox<T> &bounds = block_bounds[static_cast<size_t>(b)];
+    for (unsigned int i = begin; i < end; i++) {
+      const real3<T> c = prim_bboxes[i].bmin + prim_bboxes[i].bmax;
+      for (int k = 0; k < 3; k++) {
+        bounds.bmin[k] = std::min(bounds.bmin[k], c[k]);
+        bounds.bmax[k] = std::max(bounds.bmax[k], c[k]);
+      }
+    }
+  }
+
+  BBox<T> centroid_bounds;
+  for (size_t b = 0; b < block_bounds.size(); b++) {
+    for (int k = 0; k < 3; k++) {
+      centroid_bounds.bmin[k] =
+          std::min(centroid_bounds.bmin[k], block_bounds[b].bmin[k]);
+      centroid_bounds.bmax[k] =
+          std::max(centroid_bounds.bmax[k], block_bounds[b].bmax[k]);
+    }
+  }
+
+  //
+  // 2. Compute Morton codes and sort primitives by them.
+  //
+  const int kGridSize = 1 << MortonCodeTraits<K>::kAxisBits;
+
+  real3<T> scale;
+  for (int k = 0; k < 3; k++) {
+    const T extent = centroid_bounds.bmax[k] - centroid_bounds.bmin[k];
+    scale[k] = (extent > static_cast<T>(0.0))
+                   ? static_cast<T>(kGridSize) / extent
+                   : static_cast<T>(0.0);
+  }
+
+  codes->resize(n);
+
+#ifdef _OPENMP
+#pragma omp parallel for
+#endif
+  for (int i = 0; i < static_cast<int>(n); i++) {
+    const BBox<T> &bbox = prim_bboxes[i];
+    K q[3];
+    for (int k = 0; k < 3; k++) {
+      const T c = (bbox.bmin[k] + bbox.bmax[k] - centroid_bounds.bmin[k]) *
+                  scale[k];
+      int v = static_cast<int>(c);
+      v = std::max(0, std::min(kGridSize - 1, v));
+      q[k] = static_cast<K>(v);
+    }
+    (*codes)[static_cast<size_t>(i)] = (ExpandMortonBits(q[0]) << 2) |
+                                       (ExpandMortonBits(q[1]) << 1) |
+                                       ExpandMortonBits(q[2]);
+  }
+
+  RadixSortMortonCodes(codes, &indices_);
+
+  return prim_bboxes;
+}
+
+template <typename T>
+template <class K, class P>
+bool BVHAccel<T>::BuildLBVH(unsigned int num_primitives, const P &p) {
+  const unsigned int n = num_primitives;
+  if (n > BVHNode<T>::kChildMask / 2) {
+    return false;
+  }
+
+  //
+  // 1. Sort primitives by Morton codes.
+  //
+  std::vector<BBox<T> > local_bboxes;
+  std::vector<K> codes;
+  const BBox<T> *prim_bboxes = SortByMortonCodes(n, p, &local_bboxes, &codes);
+
+  //
+  // 2. Emit hierarchy from sorted codes.
+  //
+  BVHNodeArray sparse_nodes(2 * static_cast<size_t>(n) - 1);
+  BVHNode<T> *sparse = &sparse_nodes.at(0);
+  const K *sorted_codes = &codes.at(0);
+
+#if defined(NANORT_USE_OPENMP_TASK)
+#pragma omp parallel
+  {
+#pragma omp single
+    {
+      EmitLBVHNode(sparse, 0, sorted_codes, prim_bboxes, 0, n,
+                   /* root depth */ 0, /* axis */ 0);
+    }
+  }
+#else
+  EmitLBVHNode(sparse, 0, sorted_codes, prim_bboxes, 0, n, /* root depth */ 0,
+               /* axis */ 0);
+#endif
+
+  CompactNodes(sparse_nodes);
+
+  return true;
+}
+
+template <typename T>
+unsigned int BVHAccel<T>::BuildHLBVHTopNode(
+    BVHNode<T> *nodes, unsigned int *treelet_ids, unsigned int left_idx,
+    unsigned int right_idx, const std::vector<BBox<T> > &treelet_bboxes,
+    const std::vector<unsigned int> &treelet_roots, unsigned int *next_slot) {
+  assert(left_idx < right_idx);
+
+  const unsigned int n = right_idx - left_idx;
+  if (n == 1) {
+    return treelet_roots[treelet_ids[left_idx]];
+  }
+
+  const unsigned int offset = (*next_slot)++;
+
+  const BBoxArrayGeometry<T> geometry(&treelet_bboxes.at(0));
+  const BBoxArraySAHPred<T> pred(&treelet_bboxes.at(0));
+
+  real3<T> bmin, bmax;
+  ComputeBoundingBox(&bmin, &bmax, treelet_ids, left_idx, right_idx,
+                     geometry);
+
+  //
+  // Compute SAH and find best split axis and position
+  //
+  int min_cut_axis = 0;
+  T cut_pos[3] = {0.0, 0.0, 0.0};
+
+  BinBuffer bins(options_.bin_size);
+  ContributeBinBuffer(&bins, bmin, bmax, treelet_ids, left_idx, right_idx,
+                      geometry);
+  FindCutFromBinBuffer(cut_pos, &min_cut_axis, &bins, bmin, bmax, n,
+                       options_.cost_t_aabb);
+
+  // Try all 3 axis until good cut position avaiable.
+  unsigned int mid_idx = left_idx;
+  int cut_axis = min_cut_axis;
+  for (int axis_try = 0; axis_try < 3; axis_try++) {
+    unsigned int *begin = treelet_ids + left_idx;
+    unsigned int *end = treelet_ids + right_idx;
+
+    // try min_cut_axis first.
+    cut_axis = (min_cut_axis + axis_try) % 3;
+
+    pred.Set(cut_axis, cut_pos[cut_axis]);
+    unsigned int *mid = std::partition(begin, end, pred);
+
+    mid_idx = left_idx + static_cast<unsigned int>((mid - begin));
+    if ((mid_idx == left_idx) || (mid_idx == right_idx)) {
+      // Can't split well. Switch to object median.
+      mid_idx = left_idx + (n >> 1);
+    } else {
+      // Found good cut. exit loop.
+      break;
+    }
+  }
+
+  const unsigned int left_child_index =
+      BuildHLBVHTopNode(nodes, treelet_ids, left_idx, mid_idx, treelet_bboxes,
+                        treelet_roots, next_slot);
+  const unsigned int right_child_index =
+      BuildHLBVHTopNode(nodes, treelet_ids, mid_idx, right_idx,
+                        treelet_bboxes, treelet_roots, next_slot);
+
+  BVHNode<T> &node = nodes[offset];
+  for (int k = 0; k < 3; k++) {
+    node.bmin[k] = bmin[k];
+    node.bmax[k] = bmax[k];
+  }
+  node.SetBranch(cut_axis, left_child_index, right_child_index);
+
+  return offset;
+}
+
+template <typename T>
+template <class K, class P>
+bool BVHAccel<T>::BuildHLBVH(unsigned int num_primitives, const P &p) {
+  const unsigned int n = num_primitives;
+  if (n > BVHNode<T>::kChildMask / 2) {
+    return false;
+  }
+
+  //
+  // 1. Sort primitives by Morton codes.
+  //
+  std::vector<BBox<T> > local_bboxes;
+  std::vector<K> codes;
+  const BBox<T> *prim_bboxes = SortByMortonCodes(n, p, &local_bboxes, &codes);
+
+  //
+  // 2. Group primitives sharing upper Morton code bits into treelets.
+  //
+  const unsigned int treelet_shift =
+      3 * MortonCodeTraits<K>::kAxisBits - kHLBVHTreeletBits;
+
+  std::vector<unsigned int> treelet_offsets;
+  treelet_offsets.push_back(0);
+  for (unsigned int i = 1; i < n; i++) {
+    if (((codes[i] ^ codes[i - 1]) >> treelet_shift) != 0) {
+      treelet_offsets.push_back(i);
+    }
+  }
+  treelet_offsets.push_back(n);
+
+  const unsigned int num_treelets =
+      static_cast<unsigned int>(treelet_offsets.size()) - 1;
+
+  //
+  // 3. Emit treelets. Top levels have exactly (num_treelets - 1) branch
+  // nodes, thus nodes [0, num_treelets - 1) are reserved for them and
+  // treelet t over m primitives owns next 2 * m - 1 slots.
+  //
+  BVHNodeArray sparse_nodes(2 * static_cast<size_t>(n) - 1);
+  BVHNode<T> *sparse = &sparse_nodes.at(0);
+  const K *sorted_codes = &codes.at(0);
+
+  std::vector<unsigned int> treelet_roots(num_treelets);
+  std::vector<BBox<T> > treelet_bboxes(num_treelets);
+
+#ifdef _OPENMP
+#pragma omp parallel for schedule(dynamic)
+#endif
+  for (int t = 0; t < static_cast<int>(num_treelets); t++) {
+    const unsigned int left_idx = treelet_offsets[static_cast<size_t>(t)];
+    const unsigned int right_idx = treelet_offsets[static_cast<size_t>(t) + 1];
+    const unsigned int root =
+        (num_treelets - 1) + 2 * left_idx - static_cast<unsigned int>(t);
+
+    EmitLBVHNode(sparse, root, sorted_codes, prim_bboxes, left_idx, right_idx,
+                 /* depth */ 0, /* axis */ 0);
+
+    treelet_roots[static_cast<size_t>(t)] = root;
+    for (int k = 0; k < 3; k++) {
+      treelet_bboxes[static_cast<size_t>(t)].bmin[k] = sparse[root].bmin[k];
+      treelet_bboxes[static_cast<size_t>(t)].bmax[k] = sparse[root].bmax[k];
+    }
+  }
+
+  //
+  // 4. Build top levels over treelets with binned SAH.
+  //
+  std::vector<unsigned int> treelet_ids(num_treelets);
+  for (unsigned int t = 0; t < num_treelets; t++) {
+    treelet_ids[t] = t;
+  }
+
+  unsigned int next_slot = 0;
+  const unsigned int root =
+      BuildHLBVHTopNode(sparse, &treelet_ids.at(0), 0, num_treelets,
+                        treelet_bboxes, treelet_roots, &next_slot);
+  assert(root == 0);
+  assert(next_slot == num_treelets - 1);
+  (void)root;
+
+  CompactNodes(sparse_nodes);
+
+  return true;
+}
+
+// Primitive reference used in SBVH build. `bbox` may be a clipped part of
+// the primitive bounds.
+template <typename T>
+struct SBVHReference {
+  BBox<T> bbox;
+  unsigned int prim_index;
+};
+
+template <typename T>
+struct SBVHBuildState {
+  T root_area;
+  size_t num_references;
+  size_t max_references;
+};
+
+// Max number of bins for spatial split.
+static const unsigned int kSBVHSpatialBinSize = 16;
+
+template <typename T>
+struct SBVHBin {
+  BBox<T> bbox;
+  unsigned int enter;  // # of references starting(or centered) in the bin.
+  unsigned int exit;   // # of references ending in the bin.
+};
+
+template <typename T>
+inline void ExpandBBox(BBox<T> *dst, const BBox<T> &src) {
+  for (int k = 0; k < 3; k++) {
+    dst->bmin[k] = std::min(dst->bmin[k], src.bmin[k]);
+    dst->bmax[k] = std::max(dst->bmax[k], src.bmax[k]);
+  }
+}
+
+template <typename T>
+inline T BBoxSurfaceArea(const BBox<T> &bbox) {
+  if ((bbox.bmin[0] > bbox.bmax[0]) || (bbox.bmin[1] > bbox.bmax[1]) ||
+      (bbox.bmin[2] > bbox.bmax[2])) {
+    return static_cast<T>(0.0);  // empty
+  }
+  return CalculateSurfaceArea(bbox.bmin, bbox.bmax);
+}
+
+template <typename T>
+template <class P>
+void BVHAccel<T>::FindSweepSplit(unsigned int *mid_idx, int *cut_axis,
+                                 T *split_cost, SweepBuffer<T> *sweep,
+                                 const real3<T> &bmin, const real3<T> &bmax,
+                                 unsigned int left_idx, unsigned int right_idx,
+                                 const P &p) {
+  const unsigned int n = right_idx - left_idx;
+  assert(n >= 2);
+
+  sweep->bboxes.resize(n);
+  sweep->right_areas.resize(n);
+  sweep->prim_ids.assign(indices_.begin() + left_idx,
+                         indices_.begin() + right_idx);
+  for (unsigned int i = 0; i < n; i++) {
+    BBox<T> &bbox = sweep->bboxes[i];
+    if (!bboxes_.empty()) {
+      bbox = bboxes_[sweep->prim_ids[i]];
+    } else {
+      p.BoundingBox(&bbox.bmin, &bbox.bmax, sweep->prim_ids[i]);
+    }
+  }
+
+  const T cost_t_aabb = options_.cost_t_aabb;
+  const T cost_t_tri = static_cast<T>(1.0) - cost_t_aabb;
+  const T sa = CalculateSurfaceArea(bmin, bmax);
+  const T inv_sa = (sa > std::numeric_limits<T>::epsilon())
+                       ? static_cast<T>(1.0) / sa
+                       : static_cast<T>(0.0);
+
+  // Degenerated node(zero surface area) is split at the object median.
+  unsigned int best_split = n / 2;
+  int best_axis = -1;
+  T best_cost = std::numeric_limits<T>::max();
+
+  for (int j = 0; (j < 3) && (inv_sa > static_cast<T>(0.0)); j++) {
+    std::vector<std::pair<T, unsigned int> > &keys = sweep->keys[j];
+    keys.resize(n);
+    for (unsigned int i = 0; i < n; i++) {
+      const BBox<T> &bbox = sweep->bboxes[i];
+      keys[i] = std::make_pair(bbox.bmin[j] + bbox.bmax[j], i);
+    }
+    std::sort(keys.begin(), keys.end());
+
+    // Split `i` puts keys[0, i) to the left and keys[i, n) to the right.
+    BBox<T> acc;
+    for (unsigned int i = n - 1; i > 0; i--) {
+      ExpandBBox(&acc, sweep->bboxes[keys[i].second]);
+      sweep->right_areas[i] = BBoxSurfaceArea(acc);
+    }
+
+    acc = BBox<T>();
+    for (unsigned int i = 1; i < n; i++) {
+      ExpandBBox(&acc, sweep->bboxes[keys[i - 1].second]);
+      const T cost = SAH(i, BBoxSurfaceArea(acc), n - i,
+                         sweep->right_areas[i], inv_sa, cost_t_aabb,
+                         cost_t_tri);
+      if (cost < best_cost) {
+        best_cost = cost;
+        best_split = i;
+        best_axis = j;
+      }
+    }
+  }
+
+  if (best_axis >= 0) {
+    const std::vector<std::pair<T, unsigned int> > &keys =
+        sweep->keys[best_axis];
+    for (unsigned int i = 0; i < n; i++) {
+      indices_[left_idx + i] = sweep->prim_ids[keys[i].second];
+    }
+  } else {
+    best_axis = 0;
+  }
+
+  (*mid_idx) = left_idx + best_split;
+  (*cut_axis) = best_axis;
+  (*split_cost) = best_cost;
+}
+
+template <typename T>
+template <class P>
+unsigned int BVHAccel<T>::BuildSBVHNode(std::vector<SBVHReference<T> > *refs,
+                                        unsigned int depth, const P &p,
+                                        SBVHBuildState<T> *state) {
+  const unsigned int offset = static_cast<unsigned int>(nodes_.size());
+  const unsigned int n = static_cast<unsigned int>(refs->size());
+  assert(n > 0);
+
+  if (stats_.max_tree_depth < depth) {
+    stats_.max_tree_depth = depth;
+  }
+
+  BBox<T> node_bbox, centroid_bbox;
+  for (size_t i = 0; i < refs->size(); i++) {
+    const BBox<T> &bbox = (*refs)[i].bbox;
+    ExpandBBox(&node_bbox, bbox);
+    for (int k = 0; k < 3; k++) {
+      const T c = (bbox.bmin[k] + bbox.bmax[k]) * static_cast<T>(0.5);
+      centroid_bbox.bmin[k] = std::min(centroid_bbox.bmin[k], c);
+      centroid_bbox.bmax[k] = std::max(centroid_bbox.bmax[k], c);
+    }
+  }
+
+  BVHNode<T> node;
+  for (int k = 0; k < 3; k++) {
+    node.bmin[k] = node_bbox.bmin[k];
+    node.bmax[k] = node_bbox.bmax[k];
+  }
+
+  if ((n <= options_.min_leaf_primitives) || (n <= 1) ||
+      (depth >= options_.max_tree_depth)) {
+    // Create leaf node.
+    node.SetLeaf(n, static_cast<unsigned int>(indices_.size()));
+    for (size_t i = 0; i < refs->size(); i++) {
+      indices_.push_back((*refs)[i].prim_index);
+    }
+    nodes_.push_back(node);
+    stats_.num_leaf_nodes++;
+    return offset;
+  }
+
+  const unsigned int bin_size = options_.bin_size;
+  std::vector<SBVHBin<T> > bins(bin_size);
+  std::vector<BBox<T> > right_bboxes(bin_size);
+  std::vector<unsigned int> right_counts(bin_size);
+
+  //
+  // 1. Find the best object split with binned SAH over centroids.
+  //
+  T object_cost = std::numeric_limits<T>::max();
+  int object_axis = -1;
+  unsigned int object_bin = 0;  // Left child has bins [0, object_bin].
+  BBox<T> object_left_bbox, object_right_bbox;
+
+  for (int axis = 0; axis < 3; axis++) {
+    const T extent = centroid_bbox.bmax[axis] - centroid_bbox.bmin[axis];
+    if (extent <= static_cast<T>(0.0)) {
+      continue;
+    }
+    const T scale = static_cast<T>(bin_size) / extent;
+
+    for (unsigned int b = 0; b < bin_size; b++) {
+      bins[b].bbox = BBox<T>();
+      bins[b].enter = 0;
+      bins[b].exit = 0;
+    }
+
+    for (size_t i = 0; i < refs->size(); i++) {
+      const BBox<T> &bbox = (*refs)[i].bbox;
+      const T c = (bbox.bmin[axis] + bbox.bmax[axis]) * static_cast<T>(0.5);
+      int b = static_cast<int>((c - centroid_bbox.bmin[axis]) * scale);
+      b = std::max(0, std::min(static_cast<int>(bin_size) - 1, b));
+      ExpandBBox(&bins[static_cast<size_t>(b)].bbox, bbox);
+      bins[static_cast<size_t>(b)].enter++;
+    }
+
+    BBox<T> acc;
+    unsigned int count = 0;
+    for (unsigned int b = bin_size - 1; b > 0; b--) {
+      ExpandBBox(&acc, bins[b].bbox);
+      count += bins[b].enter;
+      right_bboxes[b] = acc;
+      right_counts[b] = count;
+    }
+
+    acc = BBox<T>();
+    count = 0;
+    for (unsigned int b = 0; b < bin_size - 1; b++) {
+      ExpandBBox(&acc, bins[b].bbox);
+      count += bins[b].enter;
+      if ((count == 0) || (right_counts[b + 1] == 0)) {
+        continue;
+      }
+      const T cost =
+          BBoxSurfaceArea(acc) * static_cast<T>(count) +
+          BBoxSurfaceArea(right_bboxes[b + 1]) *
+              static_cast<T>(right_counts[b + 1]);
+      if (cost < object_cost) {
+        object_cost = cost;
+        object_axis = axis;
+        object_bin = b;
+        object_left_bbox = acc;
+        object_right_bbox = right_bboxes[b + 1];
+      }
+    }
+  }
+
+  //
+  // 2. Find the best spatial split when children of the object split
+  // overlap enough.
+  //
+  T overlap_area = std::numeric_limits<T>::max();
+  if (object_axis >= 0) {
+    BBox<T> overlap;
+    for (int k = 0; k < 3; k++) {
+      overlap.bmin[k] =
+          std::max(object_left_bbox.bmin[k], object_right_bbox.bmin[k]);
+      overlap.bmax[k] =
+          std::min(object_left_bbox.bmax[k], object_right_bbox.bmax[k]);
+    }
+    overlap_area = BBoxSurfaceArea(overlap);
+  }
+
+  T spatial_cost = std::numeric_limits<T>::max();
+  int spatial_axis = -1;
+  T spatial_pos = static_cast<T>(0.0);
+  BBox<T> spatial_left_bbox, spatial_right_bbox;
+  unsigned int spatial_left_count = 0, spatial_right_count = 0;
+
+  if ((overlap_area > options_.spatial_split_alpha * state->root_area) &&
+      (state->num_references < state->max_references) &&
+      !IsPastDeadline(build_deadline_secs_)) {
+    // Each reference is clipped for every spatial bin it overlaps, thus use
+    // fewer bins than object split.
+    const unsigned int spatial_bin_size =
+        std::min(bin_size, kSBVHSpatialBinSize);
+
+    for (int axis = 0; axis < 3; axis++) {
+      const T origin = node_bbox.bmin[axis];
+      const T extent = node_bbox.bmax[axis] - origin;
+      if (extent <= static_cast<T>(0.0)) {
+        continue;
+      }
+      const T width = extent / static_cast<T>(spatial_bin_size);
+      const T scale = static_cast<T>(spatial_bin_size) / extent;
+
+      for (unsigned int b = 0; b < spatial_bin_size; b++) {
+        bins[b].bbox = BBox<T>();
+        bins[b].enter = 0;
+        bins[b].exit = 0;
+      }
+
+      for (size_t i = 0; i < refs->size(); i++) {
+        const SBVHReference<T> &ref = (*refs)[i];
+        int b0 = static_cast<int>((ref.bbox.bmin[axis] - origin) * scale);
+        int b1 = static_cast<int>((ref.bbox.bmax[axis] - origin) * scale);
+        b0 = std::max(0, std::min(static_cast<int>(spatial_bin_size) - 1, b0));
+        b1 = std::max(b0, std::min(static_cast<int>(spatial_bin_size) - 1, b1));
+
+        if (b0 == b1) {
+          ExpandBBox(&bins[static_cast<size_t>(b0)].bbox, ref.bbox);
+        } else {
+          // Clip the reference by each bin it overlaps.
+          for (int b = b0; b <= b1; b++) {
+            real3<T> clip_bmin = ref.bbox.bmin;
+            real3<T> clip_bmax = ref.bbox.bmax;
+            if (b > b0) {
+              clip_bmin[axis] = origin + width * static_cast<T>(b);
+            }
+            if (b < b1) {
+              clip_bmax[axis] = origin + width * static_cast<T>(b + 1);
+            }
+
+            BBox<T> part;
+            if (ClipPrimitiveBounds(&part.bmin, &part.bmax, p, ref.prim_index,
+                                    clip_bmin, clip_bmax)) {
+              ExpandBBox(&bins[static_cast<size_t>(b)].bbox, part);
+            }
+          }
+        }
+        bins[static_cast<size_t>(b0)].enter++;
+        bins[static_cast<size_t>(b1)].exit++;
+      }
+
+      BBox<T> acc;
+      unsigned int count = 0;
+      for (unsigned int b = spatial_bin_size - 1; b > 0; b--) {
+        ExpandBBox(&acc, bins[b].bbox);
+        count += bins[b].exit;
+        right_bboxes[b] = acc;
+        right_counts[b] = count;
+      }
+
+      acc = BBox<T>();
+      count = 0;
+      for (unsigned int b = 0; b < spatial_bin_size - 1; b++) {
+        ExpandBBox(&acc, bins[b].bbox);
+        count += bins[b].enter;
+        if ((count == 0) || (right_counts[b + 1] == 0)) {
+          continue;
+        }
+        const T cost =
+            BBoxSurfaceArea(acc) * static_cast<T>(count) +
+            BBoxSurfaceArea(right_bboxes[b + 1]) *
+                static_cast<T>(right_counts[b + 1]);
+        if (cost < spatial_cost) {
+          spatial_cost = cost;
+          spatial_axis = axis;
+          spatial_pos = origin + width * static_cast<T>(b + 1);
+          spatial_left_bbox = acc;
+          spatial_right_bbox = right_bboxes[b + 1];
+          spatial_left_count = count;
+          spatial_right_count = right_counts[b + 1];
+        }
+      }
+    }
+  }
+
+  //
+  // 3. Split references.
+  //
+  std::vector<SBVHReference<T> > left_refs, right_refs;
+  int split_axis = 0;
+
+  if ((spatial_axis >= 0) && (spatial_cost < object_cost)) {
+    const int axis = spatial_axis;
+    split_axis = axis;
+
+    BBox<T> left_bbox = spatial_left_bbox;
+    BBox<T> right_bbox = spatial_right_bbox;
+    T left_count = static_cast<T>(spatial_left_count);
+    T right_count = static_cast<T>(spatial_right_count);
+
+    for (size_t i = 0; i < refs->size(); i++) {
+      const SBVHReference<T> &ref = (*refs)[i];
+      if (ref.bbox.bmax[axis] <= spatial_pos) {
+        left_refs.push_back(ref);
+        continue;
+      } else if (ref.bbox.bmin[axis] >= spatial_pos) {
+        right_refs.push_back(ref);
+        continue;
+      }
+
+      // The reference straddles the split plane.
+      SBVHReference<T> left_ref = ref;
+      SBVHReference<T> right_ref = ref;
+      real3<T> clip_bmax = ref.bbox.bmax;
+      real3<T> clip_bmin = ref.bbox.bmin;
+      clip_bmax[axis] = spatial_pos;
+      clip_bmin[axis] = spatial_pos;
+      const bool left_ok =
+          ClipPrimitiveBounds(&left_ref.bbox.bmin, &left_ref.bbox.bmax, p,
+                              ref.prim_index, ref.bbox.bmin, clip_bmax);
+      const bool right_ok =
+          ClipPrimitiveBounds(&right_ref.bbox.bmin, &right_ref.bbox.bmax, p,
+                              ref.prim_index, clip_bmin, ref.bbox.bmax);
+
+      if (!right_ok) {
+        left_refs.push_back(left_ok ? left_ref : ref);
+        continue;
+      } else if (!left_ok) {
+        right_refs.push_back(right_ref);
+        continue;
+      }
+
+      // Reference unsplitting: put the whole reference into one side when
+      // it is cheaper than duplicating it.
+      BBox<T> left_union = left_bbox;
+      BBox<T> right_union = right_bbox;
+      ExpandBBox(&left_union, ref.bbox);
+      ExpandBBox(&right_union, ref.bbox);
+
+      const T left_area = BBoxSurfaceArea(left_bbox);
+      const T right_area = BBoxSurfaceArea(right_bbox);
+      const T split_cost = left_area * left_count + right_area * right_count;
+      const T to_left_cost = BBoxSurfaceArea(left_union) * left_count +
+                             right_area * (right_count - static_cast<T>(1.0));
+      const T to_right_cost = left_area * (left_count - static_cast<T>(1.0)) +
+                              BBoxSurfaceArea(right_union) * right_count;
+
+      if ((state->num_references < state->max_references) &&
+          (split_cost < to_left_cost) && (split_cost < to_right_cost)) {
+        left_refs.push_back(left_ref);
+        right_refs.push_back(right_ref);
+        state->num_references++;
+      } else if (to_left_cost <= to_right_cost) {
+        left_refs.push_back(ref);
+        left_bbox = left_union;
+        right_count -= static_cast<T>(1.0);
+      } else {
+        right_refs.push_back(ref);
+        right_bbox = right_union;
+        left_count -= static_cast<T>(1.0);
+      }
+    }
+
+    if (left_refs.empty() || right_refs.empty()) {
+      // Failed to split(no reference was duplicated in this case). Fall back
+      // to the object split.
+      left_refs.clear();
+      right_refs.clear();
+    }
+  }
+
+  if (left_refs.empty() && right_refs.empty()) {
+    if (object_axis >= 0) {
+      const int axis = object_axis;
+      split_axis = axis;
+      const T scale =
+          static_cast<T>(bin_size) /
+          (centroid_bbox.bmax[axis] - centroid_bbox.bmin[axis]);
+
+      for (size_t i = 0; i < refs->size(); i++) {
+        const BBox<T> &bbox = (*refs)[i].bbox;
+        const T c = (bbox.bmin[axis] + bbox.bmax[axis]) * static_cast<T>(0.5);
+        int b = static_cast<int>((c - centroid_bbox.bmin[axis]) * scale);
+        b = std::max(0, std::min(static_cast<int>(bin_size) - 1, b));
+        if (static_cast<unsigned int>(b) <= object_bin) {
+          left_refs.push_back((*refs)[i]);
+        } else {
+          right_refs.push_back((*refs)[i]);
+        }
+      }
+    } else {
+      // All centroids are at the same position. Split in half.
+      const size_t mid = refs->size() / 2;
+      for (size_t i = 0; i < refs->size(); i++) {
+        if (i < mid) {
+          left_refs.push_back((*refs)[i]);
+        } else {
+          right_refs.push_back((*refs)[i]);
+        }
+      }
+    }
+  }
+
+  assert(!left_refs.empty() && !right_refs.empty());
+
+  // Release references of this node before going deeper.
+  std::vector<SBVHReference<T> >().swap(*refs);
+
+  nodes_.push_back(node);
+
+  const unsigned int left_child_index =
+      BuildSBVHNode(&left_refs, depth + 1, p, state);
+  const unsigned int right_child_index =
+      BuildSBVHNode(&right_refs, depth + 1, p, state);
+
+  nodes_[offset].SetBranch(split_axis, left_child_index, right_child_index);
+
+  stats_.num_branch_nodes++;
+
+  return offset;
+}
+
+template <typename T>
+template <class P>
+void BVHAccel<T>::BuildSBVH(unsigned int num_primitives, const P &p) {
+  const unsigned int n = num_primitives;
+
+  std::vector<SBVHReference<T> > refs(n);
+
+#ifdef _OPENMP
+#pragma omp parallel for
+#endif
+  for (int i = 0; i < static_cast<int>(n); i++) {
+    SBVHReference<T> &ref = refs[static_cast<size_t>(i)];
+    if (!bboxes_.empty()) {
+      ref.bbox = bboxes_[static_cast<size_t>(i)];
+    } else {
+      p.BoundingBox(&(ref.bbox.bmin), &(ref.bbox.bmax),
+                    static_cast<unsigned int>(i));
+    }
+    ref.prim_index = static_cast<unsigned int>(i);
+  }
+
+  BBox<T> root_bbox;
+  for (size_t i = 0; i < refs.size(); i++) {
+    ExpandBBox(&root_bbox, refs[i].bbox);
+  }
+
+  SBVHBuildState<T> state;
+  state.root_area = BBoxSurfaceArea(root_bbox);
+  state.num_references = n;
+  state.max_references =
+      n + static_cast<size_t>(static_cast<T>(n) *
+                              std::max(options_.spatial_split_budget,
+                                       static_cast<T>(0.0)));
+
+  // indices_ is filled in leaf order during the build.
+  indices_.clear();
+  indices_.reserve(state.max_references);
+
+  BuildSBVHNode(&refs, /* root depth */ 0, p, &state);
+}
+
+template <typename T>
+template <class P, class Pred>
+unsigned int BVHAccel<T>::BuildTree(BVHBuildStatistics *out_stat,
+                                    BVHNodeArray *out_nodes,
+                                    unsigned int left_idx,
+                                    unsigned int right_idx, unsigned int depth,
+                                    const P &p, const Pred &pred) {
+  assert(left_idx <= right_idx);
+
+  unsigned int offset = static_cast<unsigned int>(out_nodes->size());
+
+  if (out_stat->max_tree_depth < depth) {
+    out_stat->max_tree_depth = depth;
+  }
+
+  real3<T> bmin, bmax;
+  if (!bboxes_.empty()) {
+    GetBoundingBox(&bmin, &bmax, bboxes_, &indices_.at(0), left_idx, right_idx);
+  } else {
+    ComputeBoundingBox(&bmin, &bmax, &indices_.at(0), left_idx, right_idx, p);
+  }
+
+  unsigned int n = right_idx - left_idx;
+  if ((n <= options_.min_leaf_primitives) ||
+      (depth >= options_.max_tree_depth)) {
+    // Create leaf node.
+    BVHNode<T> leaf;
+
+    leaf.bmin[0] = bmin[0];
+    leaf.bmin[1] = bmin[1];
+    leaf.bmin[2] = bmin[2];
+
+    leaf.bmax[0] = bmax[0];
+    leaf.bmax[1] = bmax[1];
+    leaf.bmax[2] = bmax[2];
+
+    assert(left_idx < std::numeric_limits<unsigned int>::max());
+
+    leaf.SetLeaf(n, left_idx);
+
+    out_nodes->push_back(leaf);  // atomic update
+
+    out_stat->num_leaf_nodes++;
+
+    return offset;
+  }
+
+  //
+  // Create branch node.
+  //
+  unsigned int mid_idx = left_idx;
+  int cut_axis = 0;
+  const bool make_leaf = FindNodeSplit(
+      &mid_idx, &cut_axis, GetThreadBinBuffer(), GetThreadSweepBuffer(), bmin,
+      bmax, left_idx, right_idx, p, pred, NodeSplitter(this));
+
+  if (make_leaf) {
+    BVHNode<T> leaf;
+
+    leaf.bmin[0] = bmin[0];
+    leaf.bmin[1] = bmin[1];
+    leaf.bmin[2] = bmin[2];
+
+    leaf.bmax[0] = bmax[0];
+    leaf.bmax[1] = bmax[1];
+    leaf.bmax[2] = bmax[2];
+
+    leaf.SetLeaf(n, left_idx);
+
+    out_nodes->push_back(leaf);
+
+    out_stat->num_leaf_nodes++;
+
+    return offset;
+  }
+
+  BVHNode<T> node;
+  node.SetBranch(cut_axis, 0, 0);
+
+  out_nodes->push_back(node);
+
+  unsigned int left_child_index = 0;
+  unsigned int right_child_index = 0;
+
+  left_child_index =
+      BuildTree(out_stat, out_nodes, left_idx, mid_idx, depth + 1, p, pred);
+
+  right_child_index =
+      BuildTree(out_stat, out_nodes, mid_idx, right_idx, depth + 1, p, pred);
+
+  {
+    (*out_nodes)[offset].SetChild(0, left_child_index);
+    (*out_nodes)[offset].SetChild(1, right_child_index);
+
+    (*out_nodes)[offset].bmin[0] = bmin[0];
+    (*out_nodes)[offset].bmin[1] = bmin[1];
+    (*out_nodes)[offset].bmin[2] = bmin[2];
+
+    (*out_nodes)[offset].bmax[0] = bmax[0];
+    (*out_nodes)[offset].bmax[1] = bmax[1];
+    (*out_nodes)[offset].bmax[2] = bmax[2];
+  }
+
+  out_stat->num_branch_nodes++;
+
+  return offset;
+}
+
+template <typename T>
+template <class P, class Pred>
+void BVHAccel<T>::BuildSAHTree(unsigned int num_primitives, const P &p,
+                               const Pred &pred) {
+  const unsigned int n = num_primitives;
+
+  PrepareThreadBinBuffers();
+
+  // Each subtree of m primitives has at most 2 * m - 1 nodes. Reserve the
+  // bound so that nodes are never reallocated during build.
+  nodes_.reserve(2 * static_cast<size_t>(n) - 1);
+
+#ifdef _OPENMP
+#if NANORT_ENABLE_PARALLEL_BUILD
+
+  // Do parallel build for enoughly large dataset.
+#if defined(NANORT_USE_OPENMP_TASK)
+  if ((n > options_.min_primitives_for_parallel_build) &&
+      (n <= BVHNode<T>::kChildMask / 2)) {
+    nodes_.resize(2 * static_cast<size_t>(n) - 1);
+    BVHNode<T> *nodes = &nodes_.at(0);
+    unsigned int num_nodes = 1;  // root
+
+#pragma omp parallel
+    {
+#pragma omp single
+      {
+        BuildTreeTask(nodes, &num_nodes, 0, 0, n, /* root depth */ 0, p,
+                      pred);
+      }
+    }
+
+    nodes_.resize(num_nodes);
+  } else {
+    BuildTree(&stats_, &nodes_, 0, n,
+              /* root depth */ 0, p, pred);  // [0, n)
+  }
+#else
+  if (n > options_.min_primitives_for_parallel_build) {
+    BuildShallowTree(&nodes_, 0, n, /* root depth */ 0, options_.shallow_depth,
+                     p, pred);  // [0, n)
+
+    assert(shallow_node_infos_.size() > 0);
+
+    // Build deeper tree in parallel
+    std::vector<BVHNodeArray> local_nodes(
+        shallow_node_infos_.size());
+    std::vector<BVHBuildStatistics> local_stats(shallow_node_infos_.size());
+
+#pragma omp parallel for
+    for (int i = 0; i < static_cast<int>(shallow_node_infos_.size()); i++) {
+      unsigned int left_idx = shallow_node_infos_[i].left_idx;
+      unsigned int right_idx = shallow_node_infos_[i].right_idx;
+      local_nodes[i].reserve(2 * static_cast<size_t>(right_idx - left_idx) -
+                             1);
+      Pred local_pred(pred);  // Pred::Set() is not thread safe.
+      BuildTree(&(local_stats[i]), &(local_nodes[i]), left_idx, right_idx,
+                options_.shallow_depth, p, local_pred);
+    }
+
+    // Join local nodes
+    for (int i = 0; i < static_cast<int>(local_nodes.size()); i++) {
+      assert(!local_nodes[i].empty());
+      size_t offset = nodes_.size();
+
+      // Add offset to child index(for branch node).
+      for (size_t j = 0; j < local_nodes[i].size(); j++) {
+        BVHNode<T> &node = local_nodes[i][j];
+        if (!node.IsLeaf()) {  // branch
+          unsigned int node_offset = static_cast<unsigned int>(offset) - 1;
+          node.SetChild(0, node.GetChild(0) + node_offset);
+          node.SetChild(1, node.GetChild(1) + node_offset);
+        }
+      }
+
+      // replace
+      nodes_[shallow_node_infos_[i].offset] = local_nodes[i][0];
+
+      // Skip root element of the local node.
+      nodes_.insert(nodes_.end(), local_nodes[i].begin() + 1,
+                    local_nodes[i].end());
+    }
+
+    // Join statistics
+    for (int i = 0; i < static_cast<int>(local_nodes.size()); i++) {
+      stats_.max_tree_depth =
+          std::max(stats_.max_tree_depth, local_stats[i].max_tree_depth);
+      stats_.num_leaf_nodes += local_stats[i].num_leaf_nodes;
+      stats_.num_branch_nodes += local_stats[i].num_branch_nodes;
+    }
+
+  } else {
+    BuildTree(&stats_, &nodes_, 0, n,
+              /* root depth */ 0, p, pred);  // [0, n)
+  }
+#endif  // NANORT_USE_OPENMP_TASK
+
+#else  // !NANORT_ENABLE_PARALLEL_BUILD
+  {
+    BuildTree(&stats_, &nodes_, 0, n,
+              /* root depth */ 0, p, pred);  // [0, n)
+  }
+#endif
+#else  // !_OPENMP
+#if NANORT_ENABLE_PARALLEL_BUILD && defined(NANORT_USE_TASK_SCHEDULER)
+  if ((n > options_.min_primitives_for_parallel_build) &&
+      (n <= BVHNode<T>::kChildMask / 2)) {
+    nodes_.resize(2 * static_cast<size_t>(n) - 1);
+    std::atomic<unsigned int> num_nodes(1);  // root
+
+    TaskScheduler *scheduler = GetTaskScheduler();
+    TaskGroup group;
+    BinBuffer bins(options_.bin_size);
+    SweepBuffer<T> sweep;
+    BuildTreeTask(scheduler, &group, &nodes_.at(0), &num_nodes, 0, 0, n,
+                  /* root depth */ 0, &bins, &sweep, p, pred);
+    WaitTaskGroup(scheduler, &group);
+
+    nodes_.resize(num_nodes);
+  } else {
+    BuildTree(&stats_, &nodes_, 0, n,
+              /* root depth */ 0, p, pred);  // [0, n)
+  }
+#else
+  {
+    BuildTree(&stats_, &nodes_, 0, n,
+              /* root depth */ 0, p, pred);  // [0, n)
+  }
+#endif
+#endif
+}
+
+template <typename T>
+template <class P, class Pred>
+bool BVHAccel<T>::Build(unsigned int num_primitives, const P &p,
+                        const Pred &pred, const BVHBuildOptions<T> &options) {
+  const double start_secs = GetWallClockSecs();
+
+  options_ = options;
+  stats_ = BVHBuildStatistics();
+  build_deadline_secs_ =
+      (options.build_time_budget > 0.0f)
+          ? start_secs + static_cast<double>(options.build_time_budget)
+          : 0.0;
+
+  nodes_.clear();
+  nodes4_.clear();
+  nodes8_.clear();
+  qnodes_.clear();
+  leaf_triangles_.clear();
+  bboxes_.clear();
+  parents_.clear();
+  heights_.clear();
+  prim_leaves_.clear();
+  free_nodes_.clear();
+  free_indices_.clear();
+
+  assert(options_.bin_size > 1);
+
+  if (num_primitives == 0) {
+    return false;
+  }
+
+  unsigned int n = num_primitives;
+
+  //
+  // 1. Create triangle indices(this will be permutated in BuildTree)
+  //
+  indices_.resize(n);
+
+#if NANORT_ENABLE_PARALLEL_BUILD && defined(NANORT_USE_TASK_SCHEDULER)
+  ParallelFor(GetTaskScheduler(), n, kTaskChunkSize,
+              [this](unsigned int begin, unsigned int end) {
+                for (unsigned int i = begin; i < end; i++) {
+                  indices_[i] = i;
+                }
+              });
+#else
+#ifdef _OPENMP
+#pragma omp parallel for
+#endif
+  for (int i = 0; i < static_cast<int>(n); i++) {
+    indices_[static_cast<size_t>(i)] = static_cast<unsigned int>(i);
+  }
+#endif
+
+  //
+  // 2. Compute bounding box(optional).
+  //
+  real3<T> bmin, bmax;
+  if (options.cache_bbox || options.cache_centroids) {
+    bboxes_.resize(n);
+#if NANORT_ENABLE_PARALLEL_BUILD && defined(NANORT_USE_TASK_SCHEDULER)
+    ComputePrimitiveBoundingBoxes(GetTaskScheduler(), &bmin, &bmax,
+                                  &bboxes_.at(0), n, p);
+#else
+    ComputePrimitiveBoundingBoxes(&bmin, &bmax, &bboxes_.at(0), n, p);
+#endif
+  } else if (options.build_method == kBVHBuildSAH) {
+#ifdef _OPENMP
+    ComputeBoundingBoxOMP(&bmin, &bmax, &indices_.at(0), 0, n, p);
+#else
+    ComputeBoundingBox(&bmin, &bmax, &indices_.at(0), 0, n, p);
+#endif
+  }
+
+  std::vector<real3<T> > centroids;
+  const bool use_centroids = options.cache_centroids &&
+                             (options.build_method == kBVHBuildSAH) &&
+                             !options.spatial_split;
+  if (use_centroids) {
+    centroids.resize(n);
+
+#if NANORT_ENABLE_PARALLEL_BUILD && defined(NANORT_USE_TASK_SCHEDULER)
+    ParallelFor(GetTaskScheduler(), n, kTaskChunkSize,
+                [&](unsigned int begin, unsigned int end) {
+                  ComputeCentroids(&centroids.at(0), &bboxes_.at(0), begin,
+                                   end);
+                });
+#else
+    const unsigned int kChunkSize = 1024 * 16;
+    const int num_chunks = static_cast<int>((n + kChunkSize - 1) / kChunkSize);
+
+#ifdef _OPENMP
+#pragma omp parallel for
+#endif
+    for (int c = 0; c < num_chunks; c++) {
+      const unsigned int begin = static_cast<unsigned int>(c) * kChunkSize;
+      ComputeCentroids(&centroids.at(0), &bboxes_.at(0), begin,
+                       std::min(begin + kChunkSize, n));
+    }
+#endif
+  }
+
+  //
+  // 3. Build tree
+  //
+  const bool use_63bit_morton_codes = (options.morton_code_bits > 30);
+
+  if (options.build_method == kBVHBuildLBVH) {
+    if (use_63bit_morton_codes
+            ? !BuildLBVH<unsigned long long>(n, p)
+            : !BuildLBVH<unsigned int>(n, p)) {
+      return false;
+    }
+  } else if (options.build_method == kBVHBuildHLBVH) {
+    if (use_63bit_morton_codes
+            ? !BuildHLBVH<unsigned long long>(n, p)
+            : !BuildHLBVH<unsigned int>(n, p)) {
+      return false;
+    }
+  } else if (options.spatial_split) {
+    BuildSBVH(n, p);
+  } else if (use_centroids) {
+    BuildSAHTree(n, BBoxArrayGeometry<T>(&bboxes_.at(0)),
+                 CentroidArraySAHPred<T>(&centroids.at(0)));
+  } else {
+    BuildSAHTree(n, p, pred);
+  }
+
+  // Release node slots reserved for the 2 * n - 1 bound(or left from the
+  // previous build) and unused SBVH reference slots.
+  if (nodes_.capacity() > nodes_.size()) {
+    BVHNodeArray(nodes_).swap(nodes_);
+  }
+  if (indices_.capacity() > indices_.size()) {
+    std::vector<unsigned int>(indices_).swap(indices_);
+  }
+
+  //
+  // 4. Optimize tree with rotations(optional).
+  //
+  if (options.tree_rotation_passes > 0) {
+    // Also updates statistics.
+    RotateTree(options.tree_rotation_passes, build_deadline_secs_);
+  } else {
+    UpdateStatistics();
+  }
+
+  //
+  // 5. Optimize node layout(optional).
+  //
+  if (options.depth_first_layout) {
+    ReorderNodes();
+  }
+
+  //
+  // 6. Collapse into wide BVH(optional).
+  //
+  if (options.wide_bvh_width > 0) {
+    if (!BuildWideBVH(options.wide_bvh_width)) {
+      return false;
+    }
+  }
+
+  //
+  // 7. Compress BVH(optional).
+  //
+  if (options.compressed_bvh) {
+    if (!BuildCompressedBVH()) {
+      return false;
+    }
+  }
+
+  stats_.build_secs = static_cast<float>(GetWallClockSecs() - start_secs);
+
+  return true;
+}
+
+// Rotations which reduce surface area less than this ratio of the parent
+// node's surface area are ignored.
+static const double kTreeRotationMinGain = 1.0e-6;
+
+// Subtrees above this depth are processed in their own task in Refit() and
+// OptimizeTree().
+static const unsigned int kSubtreeTaskDepth = 10;
+
+template <typename T>
+void BVHAccel<T>::UpdateBranchNode(unsigned int node_index) {
+  BVHNode<T> &node = nodes_[node_index];
+  unsigned int child0 = node.GetChild(0);
+  unsigned int child1 = node.GetChild(1);
+  const BVHNode<T> &c0 = nodes_[child0];
+  const BVHNode<T> &c1 = nodes_[child1];
+
+  int axis = 0;
+  T max_dist = static_cast<T>(-1.0);
+  T center_dist[3];
+  for (int k = 0; k < 3; k++) {
+    node.bmin[k] = std::min(c0.bmin[k], c1.bmin[k]);
+    node.bmax[k] = std::max(c0.bmax[k], c1.bmax[k]);
+
+    // 2x distance of child centers.
+    center_dist[k] = (c1.bmin[k] + c1.bmax[k]) - (c0.bmin[k] + c0.bmax[k]);
+    if (std::fabs(center_dist[k]) > max_dist) {
+      max_dist = std::fabs(center_dist[k]);
+      axis = k;
+    }
+  }
+
+  // Traverse() visits child 0 first for positive ray direction.
+  if (center_dist[axis] < static_cast<T>(0.0)) {
+    std::swap(child0, child1);
+  }
+
+  node.SetBranch(axis, child0, child1);
+}
+
+template <typename T>
+bool BVHAccel<T>::RotateNode(unsigned int node_index) {
+  const BVHNode<T> &node = nodes_[node_index];
+  if (node.IsLeaf()) {
+    return false;
+  }
+
+  const unsigned int child[2] = {node.GetChild(0), node.GetChild(1)};
+
+  // Rotation kinds:
+  //   0-3: swap child (1 - i) with grandchild j of child i (i = kind / 2,
+  //        j = kind % 2)
+  //   4-5: swap grandchild 0 of child 0 with grandchild j of child 1
+  //        (j = kind - 4)
+  int best_kind = -1;
+  T best_gain = static_cast<T>(0.0);
+
+  for (int i = 0; i < 2; i++) {
+    const BVHNode<T> &c = nodes_[child[i]];
+    if (c.IsLeaf()) {
+      continue;
+    }
+    const BVHNode<T> &sibling = nodes_[child[1 - i]];
+    const T area = CalculateSurfaceArea(real3<T>(c.bmin), real3<T>(c.bmax));
+
+    for (int j = 0; j < 2; j++) {
+      // Child i will have the sibling and grandchild (1 - j).
+      const BVHNode<T> &other = nodes_[c.GetChild(1 - j)];
+      real3<T> bmin, bmax;
+      for (int k = 0; k < 3; k++) {
+        bmin[k] = std::min(sibling.bmin[k], other.bmin[k]);
+        bmax[k] = std::max(sibling.bmax[k], other.bmax[k]);
+      }
+      const T gain = area - CalculateSurfaceArea(bmin, bmax);
+      if (gain > best_gain) {
+        best_gain = gain;
+        best_kind = 2 * i + j;
+      }
+    }
+  }
+
+  const BVHNode<T> &left = nodes_[child[0]];
+  const BVHNode<T> &right = nodes_[child[1]];
+  if (!left.IsLeaf() && !right.IsLeaf()) {
+    const T area =
+        CalculateSurfaceArea(real3<T>(left.bmin), real3<T>(left.bmax)) +
+        CalculateSurfaceArea(real3<T>(right.bmin), real3<T>(right.bmax));
+    const BVHNode<T> &left0 = nodes_[left.GetChild(0)];
+    const BVHNode<T> &left1 = nodes_[left.GetChild(1)];
+
+    for (int j = 0; j < 2; j++) {
+      const BVHNode<T> &right_j = nodes_[right.GetChild(j)];
+      const BVHNode<T> &right_other = nodes_[right.GetChild(1 - j)];
+      real3<T> lmin, lmax, rmin, rmax;
+      for (int k = 0; k < 3; k++) {
+        lmin[k] = std::min(right_j.bmin[k], left1.bmin[k]);
+        lmax[k] = std::max(right_j.bmax[k], left1.bmax[k]);
+        rmin[k] = std::min(left0.bmin[k], right_other.bmin[k]);
+        rmax[k] = std::max(left0.bmax[k], right_other.bmax[k]);
+      }
+      const T gain = area - CalculateSurfaceArea(lmin, lmax) -
+                     CalculateSurfaceArea(rmin, rmax);
+      if (gain > best_gain) {
+        best_gain = gain;
+        best_kind = 4 + j;
+      }
+    }
+  }
+
+  // Ignore tiny gains to avoid rotating back and forth by rounding error.
+  const T node_area =
+      CalculateSurfaceArea(real3<T>(node.bmin), real3<T>(node.bmax));
+  if ((best_kind < 0) ||
+      (best_gain <= node_area * static_cast<T>(kTreeRotationMinGain))) {
+    return false;
+  }
+
+  if (best_kind < 4) {
+    const int i = best_kind / 2;
+    const int j = best_kind % 2;
+    const unsigned int sibling_index = child[1 - i];
+    const unsigned int grandchild_index = nodes_[child[i]].GetChild(j);
+
+    nodes_[node_index].SetChild(1 - i, grandchild_index);
+    nodes_[child[i]].SetChild(j, sibling_index);
+    UpdateBranchNode(child[i]);
+  } else {
+    const int j = best_kind - 4;
+    const unsigned int left0_index = nodes_[child[0]].GetChild(0);
+    const unsigned int right_j_index = nodes_[child[1]].GetChild(j);
+
+    nodes_[child[0]].SetChild(0, right_j_index);
+    nodes_[child[1]].SetChild(j, left0_index);
+    UpdateBranchNode(child[0]);
+    UpdateBranchNode(child[1]);
+  }
+
+  UpdateBranchNode(node_index);
+
+  return true;
+}
+
+template <typename T>
+unsigned int BVHAccel<T>::RotateSubtree(unsigned int node_index,
+                                        unsigned int depth) {
+  if (nodes_[node_index].IsLeaf()) {
+    return 0;
+  }
+
+  const unsigned int left_child_index = nodes_[node_index].GetChild(0);
+  const unsigned int right_child_index = nodes_[node_index].GetChild(1);
+
+  unsigned int num_rotations = 0;
+
+#if defined(NANORT_USE_OPENMP_TASK)
+  if (depth < kSubtreeTaskDepth) {
+    unsigned int left_rotations = 0;
+#pragma omp task shared(left_rotations)
+    left_rotations = RotateSubtree(left_child_index, depth + 1);
+
+    num_rotations += RotateSubtree(right_child_index, depth + 1);
+#pragma omp taskwait
+    num_rotations += left_rotations;
+  } else {
+    num_rotations += RotateSubtree(left_child_index, depth + 1);
+    num_rotations += RotateSubtree(right_child_index, depth + 1);
+  }
+#else
+  num_rotations += RotateSubtree(left_child_index, depth + 1);
+  num_rotations += RotateSubtree(right_child_index, depth + 1);
+#endif
+
+  if (RotateNode(node_index)) {
+    num_rotations++;
+  }
+
+  return num_rotations;
+}
+
+template <typename T>
+void BVHAccel<T>::RotateTree(unsigned int max_passes, double deadline_secs) {
+  for (unsigned int pass = 0; pass < max_passes; pass++) {
+    if (IsPastDeadline(deadline_secs)) {
+      break;
+    }
+
+    unsigned int num_rotations = 0;
+
+#if defined(NANORT_USE_OPENMP_TASK)
+#pragma omp parallel
+    {
+#pragma omp single
+      { num_rotations = RotateSubtree(0, /* depth */ 0); }
+    }
+#else
+    num_rotations = RotateSubtree(0, /* depth */ 0);
+#endif
+
+    if (num_rotations == 0) {
+      break;
+    }
+  }
+
+  parents_.clear();
+  heights_.clear();
+
+  UpdateStatistics();
+}
+
+template <typename T>
+bool BVHAccel<T>::OptimizeTree(unsigned int max_passes) {
+  if (nodes_.empty()) {
+    return false;
+  }
+
+  RotateTree(max_passes);
+
+  if (options_.depth_first_layout) {
+    ReorderNodes();
+  }
+
+  if (!nodes4_.empty()) {
+    BuildWideNodes(&nodes4_);
+  }
+  if (!nodes8_.empty()) {
+    BuildWideNodes(&nodes8_);
+  }
+
+  return true;
+}
+
+template <typename T>
+void BVHAccel<T>::GetDepthFirstNodes(BVHNodeArray *out_nodes) const {
+  BVHNodeArray &new_nodes = *out_nodes;
+  new_nodes.clear();
+  new_nodes.reserve(nodes_.size());
+
+  // old node index -> new node index
+  std::vector<unsigned int> remap(nodes_.size());
+
+  std::vector<unsigned int> node_stack;
+  node_stack.push_back(0);
+
+  while (!node_stack.empty()) {
+    unsigned int index = node_stack.back();
+    node_stack.pop_back();
+
+    remap[index] = static_cast<unsigned int>(new_nodes.size());
+    new_nodes.push_back(nodes_[index]);
+
+    const BVHNode<T> &node = nodes_[index];
+    if (!node.IsLeaf()) {
+      const BVHNode<T> &left = nodes_[node.GetChild(0)];
+      const BVHNode<T> &right = nodes_[node.GetChild(1)];
+      T left_area =
+          CalculateSurfaceArea(real3<T>(left.bmin), real3<T>(left.bmax));
+      T right_area =
+          CalculateSurfaceArea(real3<T>(right.bmin), real3<T>(right.bmax));
+
+      // Child pushed last is visited next, thus placed adjacent to the parent.
+      if (left_area >= right_area) {
+        node_stack.push_back(node.GetChild(1));
+        node_stack.push_back(node.GetChild(0));
+      } else {
+        node_stack.push_back(node.GetChild(0));
+        node_stack.push_back(node.GetChild(1));
+      }
+    }
+  }
+
+  // Fix child indices.
+  for (size_t i = 0; i < new_nodes.size(); i++) {
+    BVHNode<T> &node = new_nodes[i];
+    if (!node.IsLeaf()) {
+      node.SetChild(0, remap[node.GetChild(0)]);
+      node.SetChild(1, remap[node.GetChild(1)]);
+    }
+  }
+}
+
+template <typename T>
+void BVHAccel<T>::ReorderNodes() {
+  if (nodes_.empty()) {
+    return;
+  }
+
+  BVHNodeArray new_nodes;
+  GetDepthFirstNodes(&new_nodes);
+
+  nodes_.swap(new_nodes);
+
+  // Unreachable(free) nodes are dropped.
+  parents_.clear();
+  heights_.clear();
+  prim_leaves_.clear();
+  free_nodes_.clear();
+}
+
+template <typename T>
+bool BVHAccel<T>::BuildLeafTriangles(const T *vertices,
+                                     const unsigned int *faces,
+                                     size_t vertex_stride_bytes) {
+  if (indices_.empty()) {
+    return false;
+  }
+
+  leaf_triangles_.resize(9 * indices_.size());
+
+  const int n = static_cast<int>(indices_.size());
+
+#ifdef _OPENMP
+#pragma omp parallel for if (n > 1024 * 64)
+#endif
+  for (int i = 0; i < n; i++) {
+    const unsigned int prim_index = indices_[static_cast<size_t>(i)];
+    T *dst = &leaf_triangles_[9 * static_cast<size_t>(i)];
+    if (prim_index == kFreePrimitiveIndex) {
+      // Released by Remove(). `faces` may no longer have the primitive.
+      std::fill(dst, dst + 9, static_cast<T>(0.0));
+      continue;
+    }
+    for (int k = 0; k < 3; k++) {
+      const unsigned int f = faces[3 * prim_index + static_cast<unsigned>(k)];
+      const T *src = get_vertex_addr(vertices, f, vertex_stride_bytes);
+      dst[3 * k + 0] = src[0];
+      dst[3 * k + 1] = src[1];
+      dst[3 * k + 2] = src[2];
+    }
+  }
+
+  return true;
+}
+
+template <typename T>
+bool BVHAccel<T>::BuildCompressedBVH() {
+  if (nodes_.empty()) {
+    return false;
+  }
+
+  BVH4NodeArray wide_nodes;
+  BuildWideNodes(&wide_nodes);
+
+  QuantizedBVHNodeArray qnodes(wide_nodes.size());
+
+  for (size_t n = 0; n < wide_nodes.size(); n++) {
+    const WideBVHNode<T, 4> &wide_node = wide_nodes[n];
+    QuantizedBVHNode<T> &qnode = qnodes[n];
+
+    T bmin[3], bmax[3];
+    for (int k = 0; k < 3; k++) {
+      bmin[k] = std::numeric_limits<T>::max();
+      bmax[k] = -std::numeric_limits<T>::max();
+      for (int i = 0; i < 4; i++) {
+        if (wide_node.child[i] == WideBVHNode<T, 4>::kInvalidIndex) continue;
+        bmin[k] = std::min(bmin[k], wide_node.bmin[k][i]);
+        bmax[k] = std::max(bmax[k], wide_node.bmax[k][i]);
+      }
+    }
+
+    for (int k = 0; k < 3; k++) {
+      qnode.origin[k] = bmin[k];
+
+      // Find the smallest 2^e where 255 * 2^e covers the extent.
+      int e = -126;
+      T extent = bmax[k] - bmin[k];
+      if (extent > static_cast<T>(0.0)) {
+        int exp2;
+        std::frexp(static_cast<double>(extent) / 255.0, &exp2);
+        e = std::max(-126, exp2);
+      }
+
+      // Quantize child bounds conservatively. Use coarser grid when rounding
+      // error of `origin + q * scale` can not cover the child bounds.
+      bool encoded = false;
+      for (; (e <= 127) && !encoded; e++) {
+        const T scale = ExponentToScale<T>(e);
+        encoded = true;
+
+        for (int i = 0; i < 4; i++) {
+          if (wide_node.child[i] == WideBVHNode<T, 4>::kInvalidIndex) {
+            qnode.qmin[k][i] = 255;
+            qnode.qmax[k][i] = 0;
+            continue;
+          }
+
+          const T cmin = wide_node.bmin[k][i];
+          const T cmax = wide_node.bmax[k][i];
+
+          const T fmin = std::floor((cmin - bmin[k]) / scale);
+          const T fmax = std::ceil((cmax - bmin[k]) / scale);
+          int qlo = static_cast<int>(std::min(
+              static_cast<T>(255.0), std::max(static_cast<T>(0.0), fmin)));
+          int qhi = static_cast<int>(std::min(
+              static_cast<T>(255.0), std::max(static_cast<T>(0.0), fmax)));
+
+          while ((qlo > 0) && (bmin[k] + static_cast<T>(qlo) * scale > cmin)) {
+            qlo--;
+          }
+          while ((qhi < 255) &&
+                 (bmin[k] + static_cast<T>(qhi) * scale < cmax)) {
+            qhi++;
+          }
+
+          if ((bmin[k] + static_cast<T>(qlo) * scale > cmin) ||
+              (bmin[k] + static_cast<T>(qhi) * scale < cmax)) {
+            encoded = false;
+            break;
+          }
+
+          qnode.qmin[k][i] = static_cast<unsigned char>(qlo);
+          qnode.qmax[k][i] = static_cast<unsigned char>(qhi);
+        }
+
+        if (encoded) {
+          qnode.exponent[k] = static_cast<signed char>(e);
+        }
+      }
+
+      if (!encoded) {
+        return false;
+      }
+    }
+
+    qnode.pad = 0;
+
+    for (int i = 0; i < 4; i++) {
+      if (wide_node.num_primitives[i] >
+          QuantizedBVHNode<T>::kMaxLeafPrimitives) {
+        return false;
+      }
+      qnode.child[i] = wide_node.child[i];
+      qnode.num_primitives[i] =
+          static_cast<unsigned short>(wide_node.num_primitives[i]);
+    }
+  }
+
+  qnodes_.swap(qnodes);
+
+  // Release uncompressed nodes.
+  BVHNodeArray().swap(nodes_);
+  BVH4NodeArray().swap(nodes4_);
+  BVH8NodeArray().swap(nodes8_);
+
+  return true;
+}
+
+template <typename T>
+bool BVHAccel<T>::BuildWideBVH(unsigned int width) {
+  nodes4_.clear();
+  nodes8_.clear();
+
+  if (width == 0) {
+    return true;
+  }
+
+  if (nodes_.empty()) {
+    return false;
+  }
+
+  if (width == 4) {
+    BuildWideNodes(&nodes4_);
+    return true;
+  }
+
+  if (width == 8) {
+#if defined(NANORT_USE_AVX2)
+    if (sizeof(T) == sizeof(float)) {
+      BuildWideNodes(&nodes8_);
+    }
+#endif
+    // Fall back to binary BVH when 8-wide SIMD is not available.
+    return true;
+  }
+
+  return false;
+}
+
+template <typename T>
+template <class P>
+void BVHAccel<T>::RefitNode(unsigned int node_index, unsigned int depth,
+                            const P &p) {
+  BVHNode<T> &node = nodes_[node_index];
+
+  if (node.IsLeaf()) {
+    BBox<T> bbox;
+    const unsigned int offset = node.GetIndexOffset();
+    for (unsigned int i = 0; i < node.GetNumPrimitives(); i++) {
+      real3<T> bmin, bmax;
+      p.BoundingBox(&bmin, &bmax, indices_[offset + i]);
+      for (int k = 0; k < 3; k++) {
+        bbox.bmin[k] = std::min(bbox.bmin[k], bmin[k]);
+        bbox.bmax[k] = std::max(bbox.bmax[k], bmax[k]);
+      }
+    }
+
+    for (int k = 0; k < 3; k++) {
+      node.bmin[k] = bbox.bmin[k];
+      node.bmax[k] = bbox.bmax[k];
+    }
+    return;
+  }
+
+  const unsigned int left_child_index = node.GetChild(0);
+  const unsigned int right_child_index = node.GetChild(1);
+
+#if defined(NANORT_USE_OPENMP_TASK)
+  const P *pp = &p;
+  if (depth < kSubtreeTaskDepth) {
+#pragma omp task
+    RefitNode(left_child_index, depth + 1, *pp);
+
+    RefitNode(right_child_index, depth + 1, *pp);
+#pragma omp taskwait
+  } else {
+    RefitNode(left_child_index, depth + 1, p);
+    RefitNode(right_child_index, depth + 1, p);
+  }
+#else
+  RefitNode(left_child_index, depth + 1, p);
+  RefitNode(right_child_index, depth + 1, p);
+#endif
+
+  const BVHNode<T> &left_node = nodes_[left_child_index];
+  const BVHNode<T> &right_node = nodes_[right_child_index];
+  for (int k = 0; k < 3; k++) {
+    node.bmin[k] = std::min(left_node.bmin[k], right_node.bmin[k]);
+    node.bmax[k] = std::max(left_node.bmax[k], right_node.bmax[k]);
+  }
+}
+
+template <typename T>
+template <class P>
+bool BVHAccel<T>::Refit(const P &p) {
+  if (nodes_.empty()) {
+    return false;
+  }
+
+  // Children are not always stored after their parent(e.g. Load()ed BVH),
+  // thus traverse the tree instead of iterating nodes in reverse order.
+#if defined(NANORT_USE_OPENMP_TASK)
+#pragma omp parallel
+  {
+#pragma omp single
+    { RefitNode(0, /* depth */ 0, p); }
+  }
+#else
+  RefitNode(0, /* depth */ 0, p);
+#endif
+
+  if (!nodes4_.empty()) {
+    BuildWideNodes(&nodes4_);
+  }
+  if (!nodes8_.empty()) {
+    BuildWideNodes(&nodes8_);
+  }
+
+  return true;
+}
+
+static const unsigned int kInvalidNodeIndex = 0xFFFFFFFFu;
+
+template <typename T>
+bool BVHAccel<T>::BuildParentLinks() {
+  parents_.assign(nodes_.size(), kInvalidNodeIndex);
+  heights_.assign(nodes_.size(), 0);
+  prim_leaves_.clear();
+
+  std::vector<unsigned int> node_stack;
+  node_stack.push_back(0);
+
+  // Parents are visited before their children.
+  std::vector<unsigned int> visited_nodes;
+
+  while (!node_stack.empty()) {
+    const unsigned int index = node_stack.back();
+    node_stack.pop_back();
+    visited_nodes.push_back(index);
+
+    const BVHNode<T> &node = nodes_[index];
+    if (node.IsLeaf()) {
+      const unsigned int offset = node.GetIndexOffset();
+      for (unsigned int i = 0; i < node.GetNumPrimitives(); i++) {
+        const unsigned int prim_id = indices_[offset + i];
+        if (prim_id >= prim_leaves_.size()) {
+          prim_leaves_.resize(prim_id + 1, kInvalidNodeIndex);
+        }
+        if (prim_leaves_[prim_id] != kInvalidNodeIndex) {
+          // Primitive split into multiple leaves(spatial split BVH).
+          parents_.clear();
+          heights_.clear();
+          prim_leaves_.clear();
+          return false;
+        }
+        prim_leaves_[prim_id] = index;
+      }
+    } else {
+      for (int i = 0; i < 2; i++) {
+        parents_[node.GetChild(i)] = index;
+        node_stack.push_back(node.GetChild(i));
+      }
+    }
+  }
+
+  for (size_t i = visited_nodes.size(); i > 0; i--) {
+    const unsigned int index = visited_nodes[i - 1];
+    const BVHNode<T> &node = nodes_[index];
+    if (!node.IsLeaf()) {
+      heights_[index] = 1 + std::max(heights_[node.GetChild(0)],
+                                     heights_[node.GetChild(1)]);
+    }
+  }
+
+  return true;
+}
+
+template <typename T>
+unsigned int BVHAccel<T>::AllocateNode() {
+  if (!free_nodes_.empty()) {
+    const unsigned int index = free_nodes_.back();
+    free_nodes_.pop_back();
+    return index;
+  }
+
+  nodes_.push_back(BVHNode<T>());
+  parents_.push_back(kInvalidNodeIndex);
+  heights_.push_back(0);
+  return static_cast<unsigned int>(nodes_.size() - 1);
+}
+
+template <typename T>
+void BVHAccel<T>::UpdateChildLinks(unsigned int node_index) {
+  const BVHNode<T> &node = nodes_[node_index];
+  for (int i = 0; i < 2; i++) {
+    const unsigned int child_index = node.GetChild(i);
+    const BVHNode<T> &child = nodes_[child_index];
+    parents_[child_index] = node_index;
+    if (!child.IsLeaf()) {
+      parents_[child.GetChild(0)] = child_index;
+      parents_[child.GetChild(1)] = child_index;
+      heights_[child_index] = 1 + std::max(heights_[child.GetChild(0)],
+                                           heights_[child.GetChild(1)]);
+    }
+  }
+
+  heights_[node_index] =
+      1 + std::max(heights_[node.GetChild(0)], heights_[node.GetChild(1)]);
+}
+
+template <typename T>
+void BVHAccel<T>::UpdateAncestors(unsigned int node_index, bool rotate) {
+  unsigned int index = node_index;
+  while (index != kInvalidNodeIndex) {
+    if (!nodes_[index].IsLeaf()) {
+      UpdateBranchNode(index);
+      UpdateChildLinks(index);
+
+      if (rotate) {
+        const unsigned int child0 = nodes_[index].GetChild(0);
+        const unsigned int child1 = nodes_[index].GetChild(1);
+        const unsigned int height = heights_[index];
+        const BVHNode<T> saved_nodes[3] = {nodes_[index], nodes_[child0],
+                                           nodes_[child1]};
+
+        if (RotateNode(index)) {
+          UpdateChildLinks(index);
+
+          // Undo a rotation which makes the subtree taller, so that the tree
+          // never gets deeper than the new leaf checked by Insert().
+          if (heights_[index] > height) {
+            nodes_[index] = saved_nodes[0];
+            nodes_[child0] = saved_nodes[1];
+            nodes_[child1] = saved_nodes[2];
+            UpdateChildLinks(index);
+          }
+        }
+      }
+    }
+    index = parents_[index];
+  }
+}
+
+template <typename T>
+unsigned int BVHAccel<T>::FindInsertSibling(const real3<T> &bmin,
+                                           const real3<T> &bmax) const {
+  //
+  // Find the sibling of the new leaf. Cost of a candidate is the surface area
+  // of the new branch node plus the area increase of its ancestors, and the
+  // area increase inherited from ancestors bounds the cost of its subtree.
+  //
+  const T prim_area = CalculateSurfaceArea(bmin, bmax);
+  unsigned int sibling = 0;
+  T best_cost = std::numeric_limits<T>::max();
+
+  typedef std::pair<T, unsigned int> Candidate;  // inherited cost, node
+  std::vector<Candidate> candidates;
+  candidates.push_back(Candidate(static_cast<T>(0.0), 0));
+
+  while (!candidates.empty()) {
+    std::pop_heap(candidates.begin(), candidates.end(),
+                  std::greater<Candidate>());
+    const Candidate candidate = candidates.back();
+    candidates.pop_back();
+
+    if (candidate.first + prim_area >= best_cost) {
+      break;  // No remaining candidate can be better.
+    }
+
+    const BVHNode<T> &node = nodes_[candidate.second];
+    real3<T> union_bmin, union_bmax;
+    for (int k = 0; k < 3; k++) {
+      union_bmin[k] = std::min(node.bmin[k], bmin[k]);
+      union_bmax[k] = std::max(node.bmax[k], bmax[k]);
+    }
+    const T union_area = CalculateSurfaceArea(union_bmin, union_bmax);
+
+    const T cost = candidate.first + union_area;
+    if (cost < best_cost) {
+      best_cost = cost;
+      sibling = candidate.second;
+    }
+
+    if (!node.IsLeaf()) {
+      const T inherited_cost =
+          cost - CalculateSurfaceArea(real3<T>(node.bmin), real3<T>(node.bmax));
+      if (inherited_cost + prim_area < best_cost) {
+        for (int i = 0; i < 2; i++) {
+          candidates.push_back(Candidate(inherited_cost, node.GetChild(i)));
+          std::push_heap(candidates.begin(), candidates.end(),
+                         std::greater<Candidate>());
+        }
+      }
+    }
+  }
+
+  return sibling;
+}
+
+template <typename T>
+template <class P>
+bool BVHAccel<T>::Insert(unsigned int prim_id, const P &p) {
+  if (nodes_.empty()) {
+    return false;
+  }
+
+  if (parents_.empty() && !BuildParentLinks()) {
+    return false;
+  }
+
+  if (prim_id >= prim_leaves_.size()) {
+    prim_leaves_.resize(prim_id + 1, kInvalidNodeIndex);
+  } else if (prim_leaves_[prim_id] != kInvalidNodeIndex) {
+    return false;
+  }
+
+  real3<T> bmin, bmax;
+  p.BoundingBox(&bmin, &bmax, prim_id);
+
+  // Empty tree(all primitives were removed).
+  const bool empty_tree =
+      nodes_[0].IsLeaf() && (nodes_[0].GetNumPrimitives() == 0);
+
+  unsigned int sibling = 0;
+  if (!empty_tree) {
+    sibling = FindInsertSibling(bmin, bmax);
+
+    // The new leaf and the subtree of the sibling are moved one level below
+    // the sibling.
+    unsigned int depth = 1 + heights_[sibling];
+    for (unsigned int index = sibling; index != 0; index = parents_[index]) {
+      depth++;
+    }
+    if (depth >= static_cast<unsigned int>(kTraversalStackSize)) {
+      return false;
+    }
+  }
+
+  unsigned int offset;
+  if (!free_indices_.empty()) {
+    offset = free_indices_.back();
+    free_indices_.pop_back();
+    indices_[offset] = prim_id;
+  } else {
+    offset = static_cast<unsigned int>(indices_.size());
+    indices_.push_back(prim_id);
+  }
+
+  nodes4_.clear();
+  nodes8_.clear();
+  leaf_triangles_.clear();
+
+  if (empty_tree) {
+    BVHNode<T> &root = nodes_[0];
+    root.SetLeaf(1, offset);
+    for (int k = 0; k < 3; k++) {
+      root.bmin[k] = bmin[k];
+      root.bmax[k] = bmax[k];
+    }
+    prim_leaves_[prim_id] = 0;
+    stats_.num_leaf_nodes = 1;
+    stats_.num_branch_nodes = 0;
+    return true;
+  }
+
+  //
+  // Replace the sibling with a new branch node which has the sibling and the
+  // new leaf as children.
+  //
+  const unsigned int leaf_index = AllocateNode();
+  unsigned int branch_index = AllocateNode();
+
+  BVHNode<T> &leaf = nodes_[leaf_index];
+  leaf.SetLeaf(1, offset);
+  for (int k = 0; k < 3; k++) {
+    leaf.bmin[k] = bmin[k];
+    leaf.bmax[k] = bmax[k];
+  }
+  prim_leaves_[prim_id] = leaf_index;
+  heights_[leaf_index] = 0;
+
+  if (sibling == 0) {
+    // Root must stay at index 0: move old root to the new slot.
+    nodes_[branch_index] = nodes_[0];
+    heights_[branch_index] = heights_[0];
+    const BVHNode<T> &moved = nodes_[branch_index];
+    if (moved.IsLeaf()) {
+      const unsigned int moved_offset = moved.GetIndexOffset();
+      for (unsigned int i = 0; i < moved.GetNumPrimitives(); i++) {
+        prim_leaves_[indices_[moved_offset + i]] = branch_index;
+      }
+    } else {
+      parents_[moved.GetChild(0)] = branch_index;
+      parents_[moved.GetChild(1)] = branch_index;
+    }
+    sibling = branch_index;
+    branch_index = 0;
+  } else {
+    const unsigned int parent = parents_[sibling];
+    BVHNode<T> &parent_node = nodes_[parent];
+    parent_node.SetChild((parent_node.GetChild(0) == sibling) ? 0 : 1,
+                         branch_index);
+    parents_[branch_index] = parent;
+  }
+
+  nodes_[branch_index].SetBranch(0, sibling, leaf_index);
+  parents_[sibling] = branch_index;
+  parents_[leaf_index] = branch_index;
+
+  UpdateAncestors(branch_index, /* rotate */ true);
+
+  stats_.num_leaf_nodes++;
+  stats_.num_branch_nodes++;
+  stats_.max_tree_depth = heights_[0];
+
+  return true;
+}
+
+template <typename T>
+template <class P>
+bool BVHAccel<T>::Remove(unsigned int prim_id, const P &p) {
+  if (nodes_.empty()) {
+    return false;
+  }
+
+  if (parents_.empty() && !BuildParentLinks()) {
+    return false;
+  }
+
+  if ((prim_id >= prim_leaves_.size()) ||
+      (prim_leaves_[prim_id] == kInvalidNodeIndex)) {
+    return false;
+  }
+
+  nodes4_.clear();
+  nodes8_.clear();
+  leaf_triangles_.clear();
+
+  const unsigned int leaf_index = prim_leaves_[prim_id];
+  prim_leaves_[prim_id] = kInvalidNodeIndex;
+
+  // Move the primitive to the end of the leaf and release that slot.
+  BVHNode<T> &leaf = nodes_[leaf_index];
+  const unsigned int offset = leaf.GetIndexOffset();
+  const unsigned int n = leaf.GetNumPrimitives() - 1;
+  for (unsigned int i = 0; i < n; i++) {
+    if (indices_[offset + i] == prim_id) {
+      std::swap(indices_[offset + i], indices_[offset + n]);
+      break;
+    }
+  }
+  indices_[offset + n] = kFreePrimitiveIndex;
+  free_indices_.push_back(offset + n);
+  leaf.SetLeaf(n, offset);
+
+  if (n > 0) {
+    BBox<T> bbox;
+    for (unsigned int i = 0; i < n; i++) {
+      real3<T> bmin, bmax;
+      p.BoundingBox(&bmin, &bmax, indices_[offset + i]);
+      for (int k = 0; k < 3; k++) {
+        bbox.bmin[k] = std::min(bbox.bmin[k], bmin[k]);
+        bbox.bmax[k] = std::max(bbox.bmax[k], bmax[k]);
+      }
+    }
+    for (int k = 0; k < 3; k++) {
+      leaf.bmin[k] = bbox.bmin[k];
+      leaf.bmax[k] = bbox.bmax[k];
+    }
+    UpdateAncestors(leaf_index, /* rotate */ false);
+    return true;
+  }
+
+  if (leaf_index == 0) {
+    // Keep an empty root leaf.
+    for (int k = 0; k < 3; k++) {
+      leaf.bmin[k] = std::numeric_limits<T>::max();
+      leaf.bmax[k] = -std::numeric_limits<T>::max();
+    }
+    stats_.num_leaf_nodes = 0;
+    return true;
+  }
+
+  //
+  // Remove the empty leaf and replace its parent with its sibling.
+  //
+  const unsigned int parent = parents_[leaf_index];
+  const BVHNode<T> &parent_node = nodes_[parent];
+  unsigned int sibling = (parent_node.GetChild(0) == leaf_index)
+                             ? parent_node.GetChild(1)
+                             : parent_node.GetChild(0);
+
+  free_nodes_.push_back(leaf_index);
+  parents_[leaf_index] = kInvalidNodeIndex;
+
+  if (parent == 0) {
+    // Root must stay at index 0: move the sibling to the root.
+    nodes_[0] = nodes_[sibling];
+    const BVHNode<T> &root = nodes_[0];
+    if (root.IsLeaf()) {
+      const unsigned int root_offset = root.GetIndexOffset();
+      for (unsigned int i = 0; i < root.GetNumPrimitives(); i++) {
+        prim_leaves_[indices_[root_offset + i]] = 0;
+      }
+    } else {
+      parents_[root.GetChild(0)] = 0;
+      parents_[root.GetChild(1)] = 0;
+    }
+    heights_[0] = heights_[sibling];
+    free_nodes_.push_back(sibling);
+    parents_[sibling] = kInvalidNodeIndex;
+  } else {
+    const unsigned int grandparent = parents_[parent];
+    BVHNode<T> &grandparent_node = nodes_[grandparent];
+    grandparent_node.SetChild(
+        (grandparent_node.GetChild(0) == parent) ? 0 : 1, sibling);
+    parents_[sibling] = grandparent;
+
+    free_nodes_.push_back(parent);
+    parents_[parent] = kInvalidNodeIndex;
+
+    UpdateAncestors(grandparent, /* rotate */ false);
+  }
+
+  stats_.num_leaf_nodes--;
+  stats_.num_branch_nodes--;
+  stats_.max_tree_depth = heights_[0];
+
+  return true;
+}
+
+template <typename T>
+template <int N>
+void BVHAccel<T>::BuildWideNodes(
+    std::vector<WideBVHNode<T, N>, AlignedAllocator<WideBVHNode<T, N>, 64> >
+        *out_nodes) const {
+  out_nodes->clear();
+
+  if (nodes_[0].IsLeaf()) {
+    // Root is a leaf. Create a wide node which has single leaf child.
+    WideBVHNode<T, N> root;
+    for (int i = 0; i < N; i++) {
+      root.SetEmpty(i);
+    }
+    for (int k = 0; k < 3; k++) {
+      root.bmin[k][0] = nodes_[0].bmin[k];
+      root.bmax[k][0] = nodes_[0].bmax[k];
+    }
+    root.child[0] = nodes_[0].GetIndexOffset();
+    root.num_primitives[0] = nodes_[0].GetNumPrimitives();
+    out_nodes->push_back(root);
+  } else {
+    CollapseBVHNode(out_nodes, 0);
+  }
+}
+
+template <typename T>
+template <int N>
+unsigned int BVHAccel<T>::CollapseBVHNode(
+    std::vector<WideBVHNode<T, N>, AlignedAllocator<WideBVHNode<T, N>, 64> >
+        *out_nodes,
+    unsigned int node_index) const {
+  assert(!nodes_[node_index].IsLeaf());
+
+  unsigned int children[N];
+  int num_children = 2;
+  children[0] = nodes_[node_index].GetChild(0);
+  children[1] = nodes_[node_index].GetChild(1);
+
+  // Open the branch child which has the largest surface area until N
+  // children are gathered.
+  while (num_children < N) {
+    int best = -1;
+    T best_area = -std::numeric_limits<T>::max();
+    for (int i = 0; i < num_children; i++) {
+      const BVHNode<T> &child = nodes_[children[i]];
+      if (child.IsLeaf()) {
+        continue;
+      }
+      T area = CalculateSurfaceArea(real3<T>(child.bmin), real3<T>(child.bmax));
+      if (area > best_area) {
+        best_area = area;
+        best = i;
+      }
+    }
+
+    if (best < 0) {
+      break;
+    }
+
+    unsigned int opened = children[best];
+    children[best] = nodes_[opened].GetChild(0);
+    children[num_children++] = nodes_[opened].GetChild(1);
+  }
+
+  unsigned int offset = static_cast<unsigned int>(out_nodes->size());
+
+  // Reserve a slot. Children are appended after this node(depth first
+  // order).
+  out_nodes->push_back(WideBVHNode<T, N>());
+
+  WideBVHNode<T, N> wide_node;
+  for (int i = 0; i < N; i++) {
+    if (i >= num_children) {
+      wide_node.SetEmpty(i);
+      continue;
+    }
+
+    const BVHNode<T> &child = nodes_[children[i]];
+    for (int k = 0; k < 3; k++) {
+      wide_node.bmin[k][i] = child.bmin[k];
+      wide_node.bmax[k][i] = child.bmax[k];
+    }
+
+    if (child.IsLeaf()) {
+      wide_node.child[i] = child.GetIndexOffset();
+      wide_node.num_primitives[i] = child.GetNumPrimitives();
+    } else {
+      wide_node.child[i] = CollapseBVHNode(out_nodes, children[i]);
+      wide_node.num_primitives[i] = 0;
+    }
+  }
+
+  (*out_nodes)[offset] = wide_node;
+
+  return offset;
+}
+
+template <typename T>
+void BVHAccel<T>::Debug() {
+  for (size_t i = 0; i < indices_.size(); i++) {
+    printf("index[%d] = %d\n", int(i), int(indices_[i]));
+  }
+
+  for (size_t i = 0; i < nodes_.size(); i++) {
+    printf("node[%d] : bmin %f, %f, %f, bmax %f, %f, %f\n", int(i),
+           nodes_[i].bmin[0], nodes_[i].bmin[1], nodes_[i].bmin[1],
+           nodes_[i].bmax[0], nodes_[i].bmax[1], nodes_[i].bmax[1]);
+  }
+}
+
+// Header of the file written by Dump(). `kBVHFileVersion` is bumped whenever
+// the node layout changes, so that Load() rejects files from other versions
+// instead of reading them as garbage.
+static const unsigned int kBVHFileMagic = 0x4E52424Eu;  // "NBRN"
+static const unsigned int kBVHFileVersion = 2;
+
+// Returns the number of bytes from the current position to the end of `fp`.
+// Returns 0 when the file is not seekable.
+static inline size_t GetRemainingFileSize(FILE *fp) {
+  const long pos = ftell(fp);
+  if ((pos < 0) || (fseek(fp, 0, SEEK_END) != 0)) {
+    return 0;
+  }
+  const long end = ftell(fp);
+  if ((fseek(fp, pos, SEEK_SET) != 0) || (end < pos)) {
+    return 0;
+  }
+  return static_cast<size_t>(end - pos);
+}
+
+template <typename T>
+bool BVHAccel<T>::Dump(const char *filename) {
+  if (nodes_.empty()) {
+    // Not built or compressed.
+    return false;
+  }
+
+  FILE *fp = fopen(filename, "wb");
+  if (!fp) {
+    // fprintf(stderr, "[BVHAccel] Cannot write a file: %s\n", filename);
+    return false;
+  }
+
+  // Load() requires children to be placed after their parent. Tree rotation
+  // and Insert()/Remove()(free node reuse) break that order, so write a
+  // depth first copy in that case.
+  const BVHNodeArray *nodes = &nodes_;
+  BVHNodeArray ordered_nodes;
+  bool ordered = free_nodes_.empty();
+  for (size_t i = 0; ordered && (i < nodes_.size()); i++) {
+    const BVHNode<T> &node = nodes_[i];
+    ordered = node.IsLeaf() ||
+              ((node.GetChild(0) > i) && (node.GetChild(1) > i));
+  }
+  if (!ordered) {
+    GetDepthFirstNodes(&ordered_nodes);
+    nodes = &ordered_nodes;
+  }
+
+  size_t numNodes = nodes->size();
+
+  size_t numIndices = indices_.size();
+
+  // magic, version, sizeof(BVHNode<T>)
+  const unsigned int header[3] = {kBVHFileMagic, kBVHFileVersion,
+                                  static_cast<unsigned int>(sizeof(BVHNode<T>))};
+
+  size_t r = 0;
+  r = fwrite(header, sizeof(unsigned int), 3, fp);
+  assert(r == 3);
+
+  r = fwrite(&numNodes, sizeof(size_t), 1, fp);
+  assert(r == 1);
+
+  r = fwrite(&nodes->at(0), sizeof(BVHNode<T>), numNodes, fp);
+  assert(r == numNodes);
+
+  r = fwrite(&numIndices, sizeof(size_t), 1, fp);
+  assert(r == 1);
+
+  r = fwrite(&indices_.at(0), sizeof(unsigned int), numIndices, fp);
+  assert(r == numIndices);
+
+  fclose(fp);
+
+  return true;
+}
+
+template <typename T>
+bool BVHAccel<T>::Load(const char *filename) {
+  FILE *fp = fopen(filename, "rb");
+  if (!fp) {
+    // fprintf(stderr, "Cannot open file: %s\n", filename);
+    return false;
+  }
+
+  // Reject files without the header, written with another node layout or
+  // with another precision(`T`).
+  unsigned int header[3];
+  if ((fread(header, sizeof(unsigned int), 3, fp) != 3) ||
+      (header[0] != kBVHFileMagic) || (header[1] != kBVHFileVersion) ||
+      (header[2] != sizeof(BVHNode<T>))) {
+    fclose(fp);
+    return false;
+  }
+
+  size_t numNodes;
+  size_t numIndices;
+
+  // Node and index counts are bounded by the rest of the file before
+  // allocating, so that a corrupt or truncated file is rejected instead of
+  // throwing std::bad_alloc.
+  if ((fread(&numNodes, sizeof(size_t), 1, fp) != 1) || (numNodes == 0) ||
+      (numNodes > BVHNode<T>::kChildMask) ||
+      (numNodes > GetRemainingFileSize(fp) / sizeof(BVHNode<T>))) {
+    fclose(fp);
+    return false;
+  }
+
+  BVHNodeArray nodes(numNodes);
+  if (fread(&nodes.at(0), sizeof(BVHNode<T>), numNodes, fp) != numNodes) {
+    fclose(fp);
+    return false;
+  }
+
+  if ((fread(&numIndices, sizeof(size_t), 1, fp) != 1) ||
+      (numIndices > GetRemainingFileSize(fp) / sizeof(unsigned int))) {
+    fclose(fp);
+    return false;
+  }
+
+  std::vector<unsigned int> indices(numIndices);
+  if ((numIndices > 0) &&
+      (fread(&indices.at(0), sizeof(unsigned int), numIndices, fp) !=
+       numIndices)) {
+    fclose(fp);
+    return false;
+  }
+
+  fclose(fp);
+
+  // Traversal trusts child and primitive offsets, so validate them here.
+  // Children must be placed after their parent(Dump() writes nodes in that
+  // order), which also rejects cycles. Parents are therefore visited before
+  // their children, and the depth of each node is known when it is visited.
+  // Trees deeper than traversal stacks support are rejected.
+  std::vector<unsigned int> depths(numNodes, 0);
+  for (size_t i = 0; i < numNodes; i++) {
+    const BVHNode<T> &node = nodes[i];
+    if (node.IsLeaf()) {
+      if (size_t(node.GetIndexOffset()) + size_t(node.GetNumPrimitives()) >
+          numIndices) {
+        return false;
+      }
+    } else if ((node.GetChild(0) <= i) || (node.GetChild(0) >= numNodes) ||
+               (node.GetChild(1) <= i) || (node.GetChild(1) >= numNodes)) {
+      return false;
+    } else if (depths[i] + 1 >=
+               static_cast<unsigned int>(kTraversalStackSize)) {
+      return false;
+    } else {
+      for (int k = 0; k < 2; k++) {
+        unsigned int &child_depth = depths[node.GetChild(k)];
+        child_depth = std::max(child_depth, depths[i] + 1);
+      }
+    }
+  }
+
+  nodes_.swap(nodes);
+  indices_.swap(indices);
+  nodes4_.clear();
+  nodes8_.clear();
+  qnodes_.clear();
+  leaf_triangles_.clear();
+  parents_.clear();
+  heights_.clear();
+  prim_leaves_.clear();
+  free_nodes_.clear();
+  free_indices_.clear();
+
+  // Primitive bounds and statistics of the previous tree.
+  bboxes_.clear();
+  stats_ = BVHBuildStatistics();
+  UpdateStatistics();
+
+  return true;
+}
+
+template <typename T>
+inline bool IntersectRayAABB(T *tminOut,  // [out]
+                             T *tmaxOut,  // [out]
+                             T min_t, T max_t, const T bmin[3], const T bmax[3],
+                             real3<T> ray_org, real3<T> ray_inv_dir,
+                             int ray_dir_sign[3]);
 template <>
 inline bool IntersectRayAABB<float>(float *tminOut,  // [out]
                              float *tmaxOut,  // [out]
@@ -1881,8 +7305,48 @@ inline bool IntersectRayAABB<float>(float *tminOut,  // [out]
   const float tmax_y = (max_y - ray_org[1]) * ray_inv_dir[1] * 1.00000024f;
 
   // Z
-  const float tmin_z = (min_z - ray_org[2]) * ray_inv_dir[2];
-  const float tmax_z = (max_z - ray_org[2]) * ray_inv_dir[2] * 1.00000024f;
+  const float tmin_z = (min_z - ray_org[2]) * ray_inv_dir[2];
+  const float tmax_z = (max_z - ray_org[2]) * ray_inv_dir[2] * 1.00000024f;
+
+  tmin = safemax(tmin_z, safemax(tmin_y, safemax(tmin_x, min_t)));
+  tmax = safemin(tmax_z, safemin(tmax_y, safemin(tmax_x, max_t)));
+
+  if (tmin <= tmax) {
+    (*tminOut) = tmin;
+    (*tmaxOut) = tmax;
+
+    return true;
+  }
+  return false;  // no hit
+}
+
+template <>
+inline bool IntersectRayAABB<double>(double *tminOut,  // [out]
+                             double *tmaxOut,  // [out]
+                             double min_t, double max_t, const double bmin[3], const double bmax[3],
+                             real3<double> ray_org, real3<double> ray_inv_dir,
+                             int ray_dir_sign[3]) {
+  double tmin, tmax;
+
+  const double min_x = ray_dir_sign[0] ? bmax[0] : bmin[0];
+  const double min_y = ray_dir_sign[1] ? bmax[1] : bmin[1];
+  const double min_z = ray_dir_sign[2] ? bmax[2] : bmin[2];
+  const double max_x = ray_dir_sign[0] ? bmin[0] : bmax[0];
+  const double max_y = ray_dir_sign[1] ? bmin[1] : bmax[1];
+  const double max_z = ray_dir_sign[2] ? bmin[2] : bmax[2];
+
+  // X
+  const double tmin_x = (min_x - ray_org[0]) * ray_inv_dir[0];
+  // MaxMult robust BVH traversal(up to 4 ulp).
+  const double tmax_x = (max_x - ray_org[0]) * ray_inv_dir[0] * 1.0000000000000004;
+
+  // Y
+  const double tmin_y = (min_y - ray_org[1]) * ray_inv_dir[1];
+  const double tmax_y = (max_y - ray_org[1]) * ray_inv_dir[1] * 1.0000000000000004;
+
+  // Z
+  const double tmin_z = (min_z - ray_org[2]) * ray_inv_dir[2];
+  const double tmax_z = (max_z - ray_org[2]) * ray_inv_dir[2] * 1.0000000000000004;
 
   tmin = safemax(tmin_z, safemax(tmin_y, safemax(tmin_x, min_t)));
   tmax = safemin(tmax_z, safemin(tmax_y, safemin(tmax_x, max_t)));
@@ -1896,168 +7360,1023 @@ inline bool IntersectRayAABB<float>(float *tminOut,  // [out]
   return false;  // no hit
 }
 
+/// Intersects rays of a packet with a box. Only rays whose bit is set in
+/// `lane_mask` are tested, with [packet.min_t, max_t] as the valid range.
+/// Returns bitmask of rays which hit the box and fills entry distance of
+/// those rays to `tmin_out`.
+template <typename T, int N>
+inline unsigned int IntersectRayPacketAABB(T tmin_out[N],  // [out]
+                                           const T bmin[3], const T bmax[3],
+                                           const RayPacket<T, N> &packet,
+                                           const T inv_dir[3][N],
+                                           const T max_t[N],
+                                           unsigned int lane_mask) {
+  unsigned int mask = 0;
+
+  while (lane_mask) {
+    const int k = CountTrailingZeros(lane_mask);
+    lane_mask &= lane_mask - 1;
+
+    const real3<T> ray_org(packet.org[0][k], packet.org[1][k],
+                           packet.org[2][k]);
+    const real3<T> ray_inv_dir(inv_dir[0][k], inv_dir[1][k], inv_dir[2][k]);
+    int dir_sign[3];
+    dir_sign[0] = packet.dir[0][k] < static_cast<T>(0.0) ? 1 : 0;
+    dir_sign[1] = packet.dir[1][k] < static_cast<T>(0.0) ? 1 : 0;
+    dir_sign[2] = packet.dir[2][k] < static_cast<T>(0.0) ? 1 : 0;
+
+    T tmin, tmax;
+    if (IntersectRayAABB(&tmin, &tmax, packet.min_t[k], max_t[k], bmin, bmax,
+                         ray_org, ray_inv_dir, dir_sign)) {
+      tmin_out[k] = tmin;
+      mask |= (1u << k);
+    }
+  }
+
+  return mask;
+}
+
+#if defined(NANORT_USE_SSE)
+template <int N>
+inline unsigned int IntersectRayPacketAABB(float tmin_out[N],  // [out]
+                                           const float bmin[3],
+                                           const float bmax[3],
+                                           const RayPacket<float, N> &packet,
+                                           const float inv_dir[3][N],
+                                           const float max_t[N],
+                                           unsigned int lane_mask) {
+  // MaxMult robust BVH traversal(up to 4 ulp).
+  const __m128 max_mult = _mm_set1_ps(1.00000024f);
+  const __m128 zero = _mm_setzero_ps();
+
+  unsigned int mask = 0;
+
+  int i = 0;
+  for (; i + 4 <= N; i += 4) {
+    if (!((lane_mask >> i) & 0xfu)) continue;
+
+    __m128 tmin = _mm_loadu_ps(packet.min_t + i);
+    __m128 tmax = _mm_loadu_ps(max_t + i);
+
+    // Same evaluation order as IntersectRayAABB(). Box planes are selected
+    // per lane with the sign of ray direction.
+    for (int k = 0; k < 3; k++) {
+      const __m128 org = _mm_loadu_ps(packet.org[k] + i);
+      const __m128 rcp = _mm_loadu_ps(inv_dir[k] + i);
+      const __m128 neg = _mm_cmplt_ps(_mm_loadu_ps(packet.dir[k] + i), zero);
+
+      const __m128 lo = _mm_set1_ps(bmin[k]);
+      const __m128 hi = _mm_set1_ps(bmax[k]);
+      const __m128 min_plane =
+          _mm_or_ps(_mm_and_ps(neg, hi), _mm_andnot_ps(neg, lo));
+      const __m128 max_plane =
+          _mm_or_ps(_mm_and_ps(neg, lo), _mm_andnot_ps(neg, hi));
+
+      const __m128 t0 = _mm_mul_ps(_mm_sub_ps(min_plane, org), rcp);
+      const __m128 t1 =
+          _mm_mul_ps(_mm_mul_ps(_mm_sub_ps(max_plane, org), rcp), max_mult);
+
+      tmin = _mm_max_ps(t0, tmin);
+      tmax = _mm_min_ps(t1, tmax);
+    }
+
+    _mm_storeu_ps(tmin_out + i, tmin);
+    mask |= static_cast<unsigned int>(
+                _mm_movemask_ps(_mm_cmple_ps(tmin, tmax)))
+            << i;
+  }
+
+  // Remaining lanes when `N` is not a multiple of 4.
+  for (; i < N; i++) {
+    if (!(lane_mask & (1u << i))) continue;
+
+    const real3<float> ray_org(packet.org[0][i], packet.org[1][i],
+                               packet.org[2][i]);
+    const real3<float> ray_inv_dir(inv_dir[0][i], inv_dir[1][i],
+                                   inv_dir[2][i]);
+    int dir_sign[3];
+    dir_sign[0] = packet.dir[0][i] < 0.0f ? 1 : 0;
+    dir_sign[1] = packet.dir[1][i] < 0.0f ? 1 : 0;
+    dir_sign[2] = packet.dir[2][i] < 0.0f ? 1 : 0;
+
+    float tmin, tmax;
+    if (IntersectRayAABB(&tmin, &tmax, packet.min_t[i], max_t[i], bmin, bmax,
+                         ray_org, ray_inv_dir, dir_sign)) {
+      tmin_out[i] = tmin;
+      mask |= (1u << i);
+    }
+  }
+
+  return mask & lane_mask;
+}
+#endif
+
+/// Intersects a ray with all children of a wide node.
+/// Returns bitmask of hit children and fills entry distance of hit children
+/// to `tmin_out`.
+template <typename T, int N>
+inline unsigned int IntersectRayAABBWide(T tmin_out[N],  // [out]
+                                         T min_t, T max_t,
+                                         const WideBVHNode<T, N> &node,
+                                         real3<T> ray_org,
+                                         real3<T> ray_inv_dir,
+                                         int ray_dir_sign[3]) {
+  unsigned int mask = 0;
+
+  for (int i = 0; i < N; i++) {
+    const T bmin[3] = {node.bmin[0][i], node.bmin[1][i], node.bmin[2][i]};
+    const T bmax[3] = {node.bmax[0][i], node.bmax[1][i], node.bmax[2][i]};
+
+    T tmin, tmax;
+    if (IntersectRayAABB(&tmin, &tmax, min_t, max_t, bmin, bmax, ray_org,
+                         ray_inv_dir, ray_dir_sign)) {
+      tmin_out[i] = tmin;
+      mask |= (1u << i);
+    }
+  }
+
+  return mask;
+}
+
+#if defined(NANORT_USE_SSE)
 template <>
-inline bool IntersectRayAABB<double>(double *tminOut,  // [out]
-                             double *tmaxOut,  // [out]
-                             double min_t, double max_t, const double bmin[3], const double bmax[3],
-                             real3<double> ray_org, real3<double> ray_inv_dir,
-                             int ray_dir_sign[3]) {
-  double tmin, tmax;
+inline unsigned int IntersectRayAABBWide<float, 4>(
+    float tmin_out[4],  // [out]
+    float min_t, float max_t, const WideBVHNode<float, 4> &node,
+    real3<float> ray_org, real3<float> ray_inv_dir, int ray_dir_sign[3]) {
+  // MaxMult robust BVH traversal(up to 4 ulp).
+  const __m128 max_mult = _mm_set1_ps(1.00000024f);
 
-  const double min_x = ray_dir_sign[0] ? bmax[0] : bmin[0];
-  const double min_y = ray_dir_sign[1] ? bmax[1] : bmin[1];
-  const double min_z = ray_dir_sign[2] ? bmax[2] : bmin[2];
-  const double max_x = ray_dir_sign[0] ? bmin[0] : bmax[0];
-  const double max_y = ray_dir_sign[1] ? bmin[1] : bmax[1];
-  const double max_z = ray_dir_sign[2] ? bmin[2] : bmax[2];
+  __m128 tmin = _mm_set1_ps(min_t);
+  __m128 tmax = _mm_set1_ps(max_t);
+
+  // Same evaluation order as the scalar version, so NaN is handled in the same
+  // way as safemin/safemax(second operand is returned for NaN).
+  for (int k = 0; k < 3; k++) {
+    const __m128 org = _mm_set1_ps(ray_org[k]);
+    const __m128 inv_dir = _mm_set1_ps(ray_inv_dir[k]);
+
+    const float *min_plane = ray_dir_sign[k] ? node.bmax[k] : node.bmin[k];
+    const float *max_plane = ray_dir_sign[k] ? node.bmin[k] : node.bmax[k];
+
+    const __m128 t0 =
+        _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(min_plane), org), inv_dir);
+    const __m128 t1 = _mm_mul_ps(
+        _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(max_plane), org), inv_dir),
+        max_mult);
+
+    tmin = _mm_max_ps(t0, tmin);
+    tmax = _mm_min_ps(t1, tmax);
+  }
+
+  _mm_storeu_ps(tmin_out, tmin);
+
+  return static_cast<unsigned int>(_mm_movemask_ps(_mm_cmple_ps(tmin, tmax)));
+}
+#endif
+
+#if defined(NANORT_USE_AVX2)
+template <>
+inline unsigned int IntersectRayAABBWide<float, 8>(
+    float tmin_out[8],  // [out]
+    float min_t, float max_t, const WideBVHNode<float, 8> &node,
+    real3<float> ray_org, real3<float> ray_inv_dir, int ray_dir_sign[3]) {
+  // MaxMult robust BVH traversal(up to 4 ulp).
+  const __m256 max_mult = _mm256_set1_ps(1.00000024f);
+
+  __m256 tmin = _mm256_set1_ps(min_t);
+  __m256 tmax = _mm256_set1_ps(max_t);
+
+  for (int k = 0; k < 3; k++) {
+    const __m256 org = _mm256_set1_ps(ray_org[k]);
+    const __m256 inv_dir = _mm256_set1_ps(ray_inv_dir[k]);
+
+    const float *min_plane = ray_dir_sign[k] ? node.bmax[k] : node.bmin[k];
+    const float *max_plane = ray_dir_sign[k] ? node.bmin[k] : node.bmax[k];
+
+    const __m256 t0 =
+        _mm256_mul_ps(_mm256_sub_ps(_mm256_loadu_ps(min_plane), org), inv_dir);
+    const __m256 t1 = _mm256_mul_ps(
+        _mm256_mul_ps(_mm256_sub_ps(_mm256_loadu_ps(max_plane), org), inv_dir),
+        max_mult);
+
+    tmin = _mm256_max_ps(t0, tmin);
+    tmax = _mm256_min_ps(t1, tmax);
+  }
+
+  _mm256_storeu_ps(tmin_out, tmin);
+
+  return static_cast<unsigned int>(
+      _mm256_movemask_ps(_mm256_cmp_ps(tmin, tmax, _CMP_LE_OQ)));
+}
+#endif
+
+template <typename T, int N>
+inline unsigned int IntersectRayWideNode(T tmin_out[N],  // [out]
+                                         T min_t, T max_t,
+                                         const WideBVHNode<T, N> &node,
+                                         real3<T> ray_org,
+                                         real3<T> ray_inv_dir,
+                                         int ray_dir_sign[3]) {
+  return IntersectRayAABBWide(tmin_out, min_t, max_t, node, ray_org,
+                              ray_inv_dir, ray_dir_sign);
+}
+
+template <typename T>
+inline unsigned int IntersectRayWideNode(T tmin_out[4],  // [out]
+                                         T min_t, T max_t,
+                                         const QuantizedBVHNode<T> &qnode,
+                                         real3<T> ray_org,
+                                         real3<T> ray_inv_dir,
+                                         int ray_dir_sign[3]) {
+  // Decode child bounds, then do the same ray/box test as uncompressed node.
+  WideBVHNode<T, 4> node;
+  qnode.Decode(node.bmin, node.bmax);
+  return IntersectRayAABBWide(tmin_out, min_t, max_t, node, ray_org,
+                              ray_inv_dir, ray_dir_sign) &
+         qnode.ChildMask();
+}
+
+template <typename T>
+template <class I>
+inline bool BVHAccel<T>::TestLeafNode(const BVHNode<T> &node, const Ray<T> &ray,
+                                      const I &intersector) const {
+  (void)ray;
+  return TestLeafPrimitives(node.GetIndexOffset(), node.GetNumPrimitives(),
+                            intersector);
+}
+
+template <typename T>
+template <class I>
+inline bool BVHAccel<T>::TestLeafPrimitives(unsigned int offset,
+                                            unsigned int num_primitives,
+                                            const I &intersector) const {
+  bool hit = false;
+
+  T t = intersector.GetT();  // current hit distance
+
+  for (unsigned int i = 0; i < num_primitives; i++) {
+    unsigned int prim_idx = indices_[i + offset];
+
+    T local_t = t;
+    if (IntersectLeafPrimitive(intersector, &local_t, prim_idx, i + offset)) {
+      // Update isect state
+      t = local_t;
+
+      intersector.Update(t, prim_idx);
+      hit = true;
+    }
+  }
+
+  return hit;
+}
+
+
+template <typename T>
+template <class I, class H>
+bool BVHAccel<T>::Traverse(const Ray<T> &ray, const I &intersector, H *isect,
+                           const BVHTraceOptions &options) const {
+  if (!qnodes_.empty()) {
+    return TraverseWide<4>(qnodes_, ray, intersector, isect, options);
+  }
+
+  if (!nodes8_.empty()) {
+    return TraverseWide<8>(nodes8_, ray, intersector, isect, options);
+  }
+
+  if (!nodes4_.empty()) {
+    return TraverseWide<4>(nodes4_, ray, intersector, isect, options);
+  }
+
+  const int kMaxStackDepth = kTraversalStackSize;
+
+  T hit_t = ray.max_t;
+
+  int node_stack_index = -1;
+  NodeStackEntry<T> node_stack[kTraversalStackSize];
+
+  // Init isect info as no hit
+  intersector.Update(hit_t, static_cast<unsigned int>(-1));
+
+  intersector.PrepareTraversal(ray, options);
+
+  int dir_sign[3];
+  dir_sign[0] = ray.dir[0] < static_cast<T>(0.0) ? 1 : 0;
+  dir_sign[1] = ray.dir[1] < static_cast<T>(0.0) ? 1 : 0;
+  dir_sign[2] = ray.dir[2] < static_cast<T>(0.0) ? 1 : 0;
+
+  // FIXME(LTE): Check edge case; e.g, 1/0 
+  real3<T> ray_inv_dir;
+  ray_inv_dir[0] = static_cast<T>(1.0) / (ray.dir[0]);
+  ray_inv_dir[1] = static_cast<T>(1.0) / (ray.dir[1]);
+  ray_inv_dir[2] = static_cast<T>(1.0) / (ray.dir[2]);
+
+  real3<T> ray_org;
+  ray_org[0] = ray.org[0];
+  ray_org[1] = ray.org[1];
+  ray_org[2] = ray.org[2];
+
+  T min_t = std::numeric_limits<T>::max();
+  T max_t = -std::numeric_limits<T>::max();
+
+  if (!nodes_.empty() &&
+      IntersectRayAABB(&min_t, &max_t, ray.min_t, hit_t, nodes_[0].bmin,
+                       nodes_[0].bmax, ray_org, ray_inv_dir, dir_sign)) {
+    node_stack_index = 0;
+    node_stack[0].index = 0;
+    node_stack[0].t = min_t;
+  }
+
+  // Boxes of both children are tested at the parent, and a child is pushed
+  // with its entry distance. A node whose entry distance is beyond the
+  // closest hit found after it was pushed is skipped without box test.
+  while (node_stack_index >= 0) {
+    const NodeStackEntry<T> entry = node_stack[node_stack_index];
+
+    node_stack_index--;
+
+    if (entry.t > hit_t) {
+      continue;
+    }
+
+    const BVHNode<T> &node = nodes_[entry.index];
+
+    if (node.IsLeaf()) {
+      if (TestLeafNode(node, ray, intersector)) {
+        hit_t = intersector.GetT();
+      }
+      continue;
+    }
+
+    const unsigned int child0 = node.GetChild(0);
+    const unsigned int child1 = node.GetChild(1);
+
+    T tmin0, tmin1;
+    const bool hit0 =
+        IntersectRayAABB(&tmin0, &max_t, ray.min_t, hit_t, nodes_[child0].bmin,
+                         nodes_[child0].bmax, ray_org, ray_inv_dir, dir_sign);
+    const bool hit1 =
+        IntersectRayAABB(&tmin1, &max_t, ray.min_t, hit_t, nodes_[child1].bmin,
+                         nodes_[child1].bmax, ray_org, ray_inv_dir, dir_sign);
+
+    if (hit0 && hit1) {
+      // Traverse near first. When the ray starts inside both boxes, fall
+      // back to the order given by the ray direction.
+      const bool swap_order =
+          (tmin1 < tmin0) ||
+          (!(tmin0 < tmin1) && (dir_sign[node.GetAxis()] == 1));
+      node_stack_index++;
+      node_stack[node_stack_index].index = swap_order ? child0 : child1;
+      node_stack[node_stack_index].t = swap_order ? tmin0 : tmin1;
+      node_stack_index++;
+      node_stack[node_stack_index].index = swap_order ? child1 : child0;
+      node_stack[node_stack_index].t = swap_order ? tmin1 : tmin0;
+    } else if (hit0) {
+      node_stack_index++;
+      node_stack[node_stack_index].index = child0;
+      node_stack[node_stack_index].t = tmin0;
+    } else if (hit1) {
+      node_stack_index++;
+      node_stack[node_stack_index].index = child1;
+      node_stack[node_stack_index].t = tmin1;
+    }
+  }
+
+  assert(node_stack_index < kMaxStackDepth);
+  (void)kMaxStackDepth;
+
+  bool hit = (intersector.GetT() < ray.max_t);
+  intersector.PostTraversal(ray, hit, isect);
+
+  return hit;
+}
+
+template <typename T>
+template <int N, class I, class H>
+unsigned int BVHAccel<T>::TraversePacket(const RayPacket<T, N> &packet,
+                                         unsigned int active_mask,
+                                         const I &intersector, H isects[N],
+                                         const BVHTraceOptions &options) const {
+  assert(N > 0 && N <= 32);
+
+  if (N < 32) {
+    active_mask &= (1u << (N & 31)) - 1u;
+  }
+
+  if (!qnodes_.empty() || !nodes8_.empty() || !nodes4_.empty()) {
+    // No packet traversal for wide BVH. Trace rays one by one.
+    unsigned int hit_mask = 0;
+    for (int k = 0; k < N; k++) {
+      if (!(active_mask & (1u << k))) continue;
+
+      Ray<T> ray;
+      packet.GetRay(k, &ray);
+      if (Traverse(ray, intersector, &isects[k], options)) {
+        hit_mask |= (1u << k);
+      }
+    }
+    return hit_mask;
+  }
+
+  if (nodes_.empty() || !active_mask) {
+    return 0;
+  }
+
+  const int kMaxStackDepth = kTraversalStackSize;
+
+  T hit_t[N];
+  T inv_dir[3][N];
+  for (int k = 0; k < N; k++) {
+    hit_t[k] = packet.max_t[k];
+    inv_dir[0][k] = static_cast<T>(1.0) / packet.dir[0][k];
+    inv_dir[1][k] = static_cast<T>(1.0) / packet.dir[1][k];
+    inv_dir[2][k] = static_cast<T>(1.0) / packet.dir[2][k];
+  }
+
+  RayPacketIntersector<T, N, I> packet_intersector(intersector);
+  packet_intersector.PrepareTraversal(packet, options);
+
+  int node_stack_index = -1;
+  PacketStackEntry<T> node_stack[kTraversalStackSize];
+
+  // One box fetch for the whole packet.
+  T tmins[N];
+  const unsigned int root_mask = IntersectRayPacketAABB(
+      tmins, nodes_[0].bmin, nodes_[0].bmax, packet, inv_dir, hit_t,
+      active_mask);
+  if (root_mask) {
+    node_stack_index = 0;
+    node_stack[0].index = 0;
+    node_stack[0].lane_mask = root_mask;
+    node_stack[0].t = PacketMinEntry(tmins, root_mask);
+  }
+
+  // As in Traverse(), child boxes are tested at the parent and a child is
+  // pushed with the smallest entry distance of its rays. A node is skipped
+  // when all of its rays found a closer hit after it was pushed.
+  while (node_stack_index >= 0) {
+    const PacketStackEntry<T> entry = node_stack[node_stack_index];
+
+    node_stack_index--;
+
+    T max_hit_t = -std::numeric_limits<T>::max();
+    for (unsigned int m = entry.lane_mask; m; m &= m - 1) {
+      max_hit_t = std::max(max_hit_t, hit_t[CountTrailingZeros(m)]);
+    }
+    if (entry.t > max_hit_t) {
+      continue;
+    }
+
+    const BVHNode<T> &node = nodes_[entry.index];
+
+    if (node.IsLeaf()) {
+      packet_intersector.IntersectLeaf(&indices_[0], node.GetIndexOffset(),
+                                       node.GetNumPrimitives(),
+                                       entry.lane_mask, hit_t);
+      continue;
+    }
+
+    const unsigned int child0 = node.GetChild(0);
+    const unsigned int child1 = node.GetChild(1);
+
+    const unsigned int mask0 = IntersectRayPacketAABB(
+        tmins, nodes_[child0].bmin, nodes_[child0].bmax, packet, inv_dir,
+        hit_t, entry.lane_mask);
+    const T tmin0 = PacketMinEntry(tmins, mask0);
+    const unsigned int mask1 = IntersectRayPacketAABB(
+        tmins, nodes_[child1].bmin, nodes_[child1].bmax, packet, inv_dir,
+        hit_t, entry.lane_mask);
+    const T tmin1 = PacketMinEntry(tmins, mask1);
+
+    // Traverse near first. When the packet starts inside both boxes, fall
+    // back to the order given by the direction of its first ray.
+    const int lane = CountTrailingZeros(entry.lane_mask);
+    const bool swap_order =
+        (tmin1 < tmin0) ||
+        (!(tmin0 < tmin1) &&
+         (packet.dir[node.GetAxis()][lane] < static_cast<T>(0.0)));
+
+    const unsigned int far_mask = swap_order ? mask0 : mask1;
+    const unsigned int near_mask = swap_order ? mask1 : mask0;
+    if (far_mask) {
+      node_stack_index++;
+      node_stack[node_stack_index].index = swap_order ? child0 : child1;
+      node_stack[node_stack_index].lane_mask = far_mask;
+      node_stack[node_stack_index].t = swap_order ? tmin0 : tmin1;
+    }
+    if (near_mask) {
+      node_stack_index++;
+      node_stack[node_stack_index].index = swap_order ? child1 : child0;
+      node_stack[node_stack_index].lane_mask = near_mask;
+      node_stack[node_stack_index].t = swap_order ? tmin1 : tmin0;
+    }
+    assert(node_stack_index < kMaxStackDepth);
+  }
+
+  (void)kMaxStackDepth;
+
+  unsigned int hit_mask = 0;
+  for (int k = 0; k < N; k++) {
+    if ((active_mask & (1u << k)) && (hit_t[k] < packet.max_t[k])) {
+      hit_mask |= (1u << k);
+    }
+  }
+
+  packet_intersector.PostTraversal(hit_t, hit_mask, isects);
+
+  return hit_mask;
+}
+
+// Per-ray state of BVHAccel::TraverseStream().
+template <typename T>
+struct StreamRay {
+  real3<T> org;
+  real3<T> inv_dir;
+  T min_t;
+  T hit_t;
+  unsigned int prim_id;  // closest primitive found so far.
+  unsigned int slot;     // index of `prim_id` in BVH indices.
+};
+
+// Stack entry of BVHAccel::TraverseStream(): node index and the list of rays
+// which hit the node's box, stored in [begin, begin + count) of the ray index
+// array.
+struct StreamStackEntry {
+  unsigned int index;
+  size_t begin;
+  size_t count;
+  size_t end;  // first unused entry of the ray index array.
+};
+
+// Scratch of BVHAccel::TraverseStream(). Each thread reuses one buffer for
+// all of its chunks.
+template <typename T>
+struct StreamBuffer {
+  std::vector<StreamRay<T> > states;
+  std::vector<unsigned char> octants;
+
+  // Ray index lists of nodes on the stack(see StreamStackEntry).
+  std::vector<unsigned int> ray_ids;
+};
+
+// Number of rays traced together in BVHAccel::TraverseStream(). Each chunk
+// is traced by one thread.
+static const size_t kStreamChunkSize = 4096;
+
+template <typename T>
+template <class I, class H>
+size_t BVHAccel<T>::TraverseStream(const Ray<T> *rays, size_t num_rays,
+                                   const I &intersector, H *isects,
+                                   unsigned char *hits,
+                                   const BVHTraceOptions &options) const {
+  if (!rays || (num_rays == 0)) {
+    return 0;
+  }
+
+  const int num_chunks = static_cast<int>(
+      (num_rays + kStreamChunkSize - 1) / kStreamChunkSize);
+  std::vector<size_t> chunk_hits(static_cast<size_t>(num_chunks), 0);
+
+#ifdef _OPENMP
+#pragma omp parallel if (num_chunks > 1)
+#endif
+  {
+    // Intersectors keep the state of the current ray, so each thread uses
+    // its own copy. Scratch buffers are reused for all chunks of the thread.
+    const I local_intersector(intersector);
+    RayStreamIntersector<T, I> stream_intersector(local_intersector, options);
+    StreamBuffer<T> buffer;
+
+#ifdef _OPENMP
+#pragma omp for schedule(dynamic, 1)
+#endif
+    for (int c = 0; c < num_chunks; c++) {
+      const size_t begin = static_cast<size_t>(c) * kStreamChunkSize;
+      const size_t n = std::min(kStreamChunkSize, num_rays - begin);
+
+      chunk_hits[static_cast<size_t>(c)] = TraverseStreamChunk(
+          rays + begin, n, local_intersector, &stream_intersector, &buffer,
+          isects + begin, hits ? (hits + begin) : NULL, options);
+    }
+  }
+
+  size_t num_hits = 0;
+  for (size_t c = 0; c < chunk_hits.size(); c++) {
+    num_hits += chunk_hits[c];
+  }
+
+  return num_hits;
+}
+
+template <typename T>
+template <class I, class H>
+size_t BVHAccel<T>::TraverseStreamChunk(
+    const Ray<T> *rays, size_t num_rays, const I &intersector,
+    RayStreamIntersector<T, I> *stream_intersector, StreamBuffer<T> *buffer,
+    H *isects, unsigned char *hits, const BVHTraceOptions &options) const {
+  if (!qnodes_.empty() || !nodes8_.empty() || !nodes4_.empty() ||
+      nodes_.empty()) {
+    // No stream traversal for wide BVH. Trace rays one by one.
+    size_t num_hits = 0;
+    for (size_t i = 0; i < num_rays; i++) {
+      const bool hit = Traverse(rays[i], intersector, &isects[i], options);
+      if (hits) hits[i] = hit ? 1 : 0;
+      if (hit) num_hits++;
+    }
+    return num_hits;
+  }
+
+  std::vector<StreamRay<T> > &states = buffer->states;
+  states.resize(num_rays);
+
+  // Ray index lists of nodes on the stack. A node's list holds rays which
+  // hit the node's box. Lists of both children are appended after the
+  // parent's, and the space is reused once both children are done. Each
+  // branch node on the path from the root appends at most 2 * num_rays
+  // entries after the root list, so the size is bound by the tree depth.
+  std::vector<unsigned int> &ray_ids = buffer->ray_ids;
+  const size_t max_ray_ids =
+      num_rays * (1 + 2 * static_cast<size_t>(stats_.max_tree_depth));
+  if (ray_ids.size() < max_ray_ids) {
+    ray_ids.resize(max_ray_ids);
+  }
+
+  // Rays which hit the root box are grouped by direction octant, and each
+  // octant is traced separately. Rays of a list then share the sign of
+  // direction, so that every ray visits the near child first.
+  size_t octant_count[8] = {0, 0, 0, 0, 0, 0, 0, 0};
+  std::vector<unsigned char> &octants = buffer->octants;
+  octants.resize(num_rays);
+  {
+    const BVHNode<T> &root = nodes_[0];
+    for (size_t i = 0; i < num_rays; i++) {
+      const Ray<T> &ray = rays[i];
+      StreamRay<T> &s = states[i];
+
+      int dir_sign[3];
+      for (int k = 0; k < 3; k++) {
+        s.org[k] = ray.org[k];
+        s.inv_dir[k] = static_cast<T>(1.0) / ray.dir[k];
+        dir_sign[k] = ray.dir[k] < static_cast<T>(0.0) ? 1 : 0;
+      }
+      s.min_t = ray.min_t;
+      s.hit_t = ray.max_t;
+      s.prim_id = static_cast<unsigned int>(-1);
+      s.slot = 0;
+
+      T tmin, tmax;
+      if (IntersectRayAABB(&tmin, &tmax, s.min_t, s.hit_t, root.bmin,
+                           root.bmax, s.org, s.inv_dir, dir_sign)) {
+        const int octant = dir_sign[0] | (dir_sign[1] << 1) |
+                           (dir_sign[2] << 2);
+        octants[i] = static_cast<unsigned char>(octant);
+        octant_count[octant]++;
+      } else {
+        octants[i] = 8;  // missed
+      }
+    }
+  }
+
+  size_t octant_begin[8];
+  size_t num_root_rays = 0;
+  for (int o = 0; o < 8; o++) {
+    octant_begin[o] = num_root_rays;
+    num_root_rays += octant_count[o];
+  }
+  {
+    size_t offsets[8];
+    for (int o = 0; o < 8; o++) {
+      offsets[o] = octant_begin[o];
+    }
+    for (size_t i = 0; i < num_rays; i++) {
+      if (octants[i] < 8) {
+        ray_ids[offsets[octants[i]]++] = static_cast<unsigned int>(i);
+      }
+    }
+  }
+
+  // Selects the ray of a list in `intersector` when a leaf is intersected.
+  stream_intersector->SetRays(rays, num_rays);
+
+  const int kMaxStackDepth = kTraversalStackSize;
+
+  StreamStackEntry node_stack[kTraversalStackSize];
+
+  for (int o = 0; o < 8; o++) {
+    if (octant_count[o] == 0) {
+      continue;
+    }
+
+    int dir_sign[3];
+    dir_sign[0] = o & 1;
+    dir_sign[1] = (o >> 1) & 1;
+    dir_sign[2] = (o >> 2) & 1;
+
+    int node_stack_index = 0;
+    node_stack[0].index = 0;
+    node_stack[0].begin = octant_begin[o];
+    node_stack[0].count = octant_count[o];
+    node_stack[0].end = num_root_rays;
+
+    while (node_stack_index >= 0) {
+      const StreamStackEntry entry = node_stack[node_stack_index];
+      const BVHNode<T> &node = nodes_[entry.index];
+      const size_t begin = entry.begin;
+      const size_t count = entry.count;
+      const size_t used = entry.end;
+
+      node_stack_index--;
+
+      if (node.IsLeaf()) {
+        // The leaf is fetched once, and its primitives are tested against
+        // each ray of the list.
+        const unsigned int offset = node.GetIndexOffset();
+        const unsigned int num_primitives = node.GetNumPrimitives();
+
+        for (size_t j = 0; j < count; j++) {
+          const unsigned int r = ray_ids[begin + j];
+          StreamRay<T> &s = states[r];
+
+          // The ray may have found a closer hit since the list was built.
+          T tmin, tmax;
+          if (!IntersectRayAABB(&tmin, &tmax, s.min_t, s.hit_t, node.bmin,
+                                node.bmax, s.org, s.inv_dir, dir_sign)) {
+            continue;
+          }
 
-  // X
-  const double tmin_x = (min_x - ray_org[0]) * ray_inv_dir[0];
-  // MaxMult robust BVH traversal(up to 4 ulp).
-  const double tmax_x = (max_x - ray_org[0]) * ray_inv_dir[0] * 1.0000000000000004;
+          stream_intersector->SetRay(r);
+          intersector.Update(s.hit_t, s.prim_id);
+
+          T t = s.hit_t;
+          for (unsigned int i = 0; i < num_primitives; i++) {
+            const unsigned int prim_idx = indices_[offset + i];
+
+            T local_t = t;
+            if (IntersectLeafPrimitive(intersector, &local_t, prim_idx,
+                                       offset + i)) {
+              t = local_t;
+              intersector.Update(t, prim_idx);
+              s.prim_id = prim_idx;
+              s.slot = offset + i;
+            }
+          }
+          s.hit_t = t;
+        }
+        continue;
+      }
 
-  // Y
-  const double tmin_y = (min_y - ray_org[1]) * ray_inv_dir[1];
-  const double tmax_y = (max_y - ray_org[1]) * ray_inv_dir[1] * 1.0000000000000004;
+      // Filter the list against both child boxes.
+      assert(used + 2 * count <= ray_ids.size());
+
+      const BVHNode<T> &child0 = nodes_[node.GetChild(0)];
+      const BVHNode<T> &child1 = nodes_[node.GetChild(1)];
+
+      const size_t begin0 = used;
+      const size_t begin1 = used + count;
+      size_t count0 = 0;
+      size_t count1 = 0;
+
+      for (size_t j = 0; j < count; j++) {
+        const unsigned int r = ray_ids[begin + j];
+        const StreamRay<T> &s = states[r];
+
+        T tmin, tmax;
+        const bool hit0 =
+            IntersectRayAABB(&tmin, &tmax, s.min_t, s.hit_t, child0.bmin,
+                             child0.bmax, s.org, s.inv_dir, dir_sign);
+        const bool hit1 =
+            IntersectRayAABB(&tmin, &tmax, s.min_t, s.hit_t, child1.bmin,
+                             child1.bmax, s.org, s.inv_dir, dir_sign);
+
+        // Write unconditionally to avoid hard to predict branches.
+        ray_ids[begin0 + count0] = r;
+        ray_ids[begin1 + count1] = r;
+        count0 += hit0 ? 1 : 0;
+        count1 += hit1 ? 1 : 0;
+      }
 
-  // Z
-  const double tmin_z = (min_z - ray_org[2]) * ray_inv_dir[2];
-  const double tmax_z = (max_z - ray_org[2]) * ray_inv_dir[2] * 1.0000000000000004;
+      const size_t child_begin[2] = {begin0, begin1};
+      const size_t child_count[2] = {count0, count1};
+      const int order_near = dir_sign[node.GetAxis()];
+      const int order_far = 1 - order_near;
+      const size_t end = begin1 + count1;
+
+      // Traverse near first.
+      if (child_count[order_far] > 0) {
+        node_stack_index++;
+        node_stack[node_stack_index].index = node.GetChild(order_far);
+        node_stack[node_stack_index].begin = child_begin[order_far];
+        node_stack[node_stack_index].count = child_count[order_far];
+        node_stack[node_stack_index].end = end;
+      }
+      if (child_count[order_near] > 0) {
+        node_stack_index++;
+        node_stack[node_stack_index].index = node.GetChild(order_near);
+        node_stack[node_stack_index].begin = child_begin[order_near];
+        node_stack[node_stack_index].count = child_count[order_near];
+        node_stack[node_stack_index].end = end;
+      }
 
-  tmin = safemax(tmin_z, safemax(tmin_y, safemax(tmin_x, min_t)));
-  tmax = safemin(tmax_z, safemin(tmax_y, safemin(tmax_x, max_t)));
+      assert(node_stack_index < kMaxStackDepth);
+    }
+  }
 
-  if (tmin <= tmax) {
-    (*tminOut) = tmin;
-    (*tmaxOut) = tmax;
+  (void)kMaxStackDepth;
 
-    return true;
+  size_t num_hits = 0;
+  for (size_t i = 0; i < num_rays; i++) {
+    const StreamRay<T> &s = states[i];
+    const bool hit = s.hit_t < rays[i].max_t;
+
+    intersector.PrepareTraversal(rays[i], options);
+    if (hit) {
+      // Intersect the closest primitive again so that the intersector
+      // restores its hit state.
+      T t = s.hit_t;
+      IntersectLeafPrimitive(intersector, &t, s.prim_id, s.slot);
+      intersector.Update(s.hit_t, s.prim_id);
+      num_hits++;
+    }
+    intersector.PostTraversal(rays[i], hit, &isects[i]);
+
+    if (hits) hits[i] = hit ? 1 : 0;
   }
-  return false;  // no hit
+
+  return num_hits;
 }
 
 template <typename T>
 template <class I>
-inline bool BVHAccel<T>::TestLeafNode(const BVHNode<T> &node, const Ray<T> &ray,
-                                      const I &intersector) const {
-  bool hit = false;
+bool BVHAccel<T>::Occluded(const Ray<T> &ray, const I &intersector,
+                           const BVHTraceOptions &options) const {
+  if (!qnodes_.empty()) {
+    return OccludedWide<4>(qnodes_, ray, intersector, options);
+  }
+
+  if (!nodes8_.empty()) {
+    return OccludedWide<8>(nodes8_, ray, intersector, options);
+  }
 
-  unsigned int num_primitives = node.data[0];
-  unsigned int offset = node.data[1];
+  if (!nodes4_.empty()) {
+    return OccludedWide<4>(nodes4_, ray, intersector, options);
+  }
 
-  T t = intersector.GetT();  // current hit distance
+  if (nodes_.empty()) {
+    return false;
+  }
+
+  const int kMaxStackDepth = kTraversalStackSize;
+
+  int node_stack_index = 0;
+  unsigned int node_stack[kTraversalStackSize];
+  node_stack[0] = 0;
+
+  intersector.Update(ray.max_t, static_cast<unsigned int>(-1));
+
+  intersector.PrepareTraversal(ray, options);
+
+  int dir_sign[3];
+  dir_sign[0] = ray.dir[0] < static_cast<T>(0.0) ? 1 : 0;
+  dir_sign[1] = ray.dir[1] < static_cast<T>(0.0) ? 1 : 0;
+  dir_sign[2] = ray.dir[2] < static_cast<T>(0.0) ? 1 : 0;
+
+  real3<T> ray_inv_dir;
+  ray_inv_dir[0] = static_cast<T>(1.0) / (ray.dir[0]);
+  ray_inv_dir[1] = static_cast<T>(1.0) / (ray.dir[1]);
+  ray_inv_dir[2] = static_cast<T>(1.0) / (ray.dir[2]);
 
   real3<T> ray_org;
   ray_org[0] = ray.org[0];
   ray_org[1] = ray.org[1];
   ray_org[2] = ray.org[2];
 
-  real3<T> ray_dir;
-  ray_dir[0] = ray.dir[0];
-  ray_dir[1] = ray.dir[1];
-  ray_dir[2] = ray.dir[2];
+  T min_t, max_t;
 
-  for (unsigned int i = 0; i < num_primitives; i++) {
-    unsigned int prim_idx = indices_[i + offset];
+  while (node_stack_index >= 0) {
+    unsigned int index = node_stack[node_stack_index];
+    const BVHNode<T> &node = nodes_[index];
 
-    T local_t = t;
-    if (intersector.Intersect(&local_t, prim_idx)) {
-      // Update isect state
-      t = local_t;
+    node_stack_index--;
 
-      intersector.Update(t, prim_idx);
-      hit = true;
+    if (!IntersectRayAABB(&min_t, &max_t, ray.min_t, ray.max_t, node.bmin,
+                          node.bmax, ray_org, ray_inv_dir, dir_sign)) {
+      continue;
+    }
+
+    if (!node.IsLeaf()) {  // branch node
+      int order_near = dir_sign[node.GetAxis()];
+      int order_far = 1 - order_near;
+
+      node_stack[++node_stack_index] = node.GetChild(order_far);
+      node_stack[++node_stack_index] = node.GetChild(order_near);
+      assert(node_stack_index < kMaxStackDepth);
+    } else {  // leaf node
+      if (OccludedLeafPrimitives(node.GetIndexOffset(),
+                                 node.GetNumPrimitives(), ray.max_t,
+                                 intersector)) {
+        return true;
+      }
     }
   }
 
-  return hit;
+  (void)kMaxStackDepth;
+
+  return false;
 }
 
-#if 0  // TODO(LTE): Implement
-template <typename T> template<class I, class H, class Comp>
-bool BVHAccel<T>::MultiHitTestLeafNode(
-  std::priority_queue<H, std::vector<H>, Comp>  *isect_pq,
-  int max_intersections,
-  const BVHNode<T> &node,
-  const Ray<T> &ray,
-  const I &intersector) const {
-  bool hit = false;
+template <typename T>
+template <int N, class A, class I>
+bool BVHAccel<T>::OccludedWide(const A &wide_nodes, const Ray<T> &ray,
+                               const I &intersector,
+                               const BVHTraceOptions &options) const {
+  const int kMaxStackDepth = kTraversalStackSize;
 
-  unsigned int num_primitives = node.data[0];
-  unsigned int offset = node.data[1];
+  int node_stack_index = 0;
+  unsigned int node_stack[kTraversalStackSize];
+  node_stack[0] = 0;
 
-  T t = std::numeric_limits<T>::max();
-  if (isect_pq->size() >= static_cast<size_t>(max_intersections)) {
-    t = isect_pq->top().t;  // current furthest hit distance
-  }
+  intersector.Update(ray.max_t, static_cast<unsigned int>(-1));
+
+  intersector.PrepareTraversal(ray, options);
+
+  int dir_sign[3];
+  dir_sign[0] = ray.dir[0] < static_cast<T>(0.0) ? 1 : 0;
+  dir_sign[1] = ray.dir[1] < static_cast<T>(0.0) ? 1 : 0;
+  dir_sign[2] = ray.dir[2] < static_cast<T>(0.0) ? 1 : 0;
+
+  real3<T> ray_inv_dir;
+  ray_inv_dir[0] = static_cast<T>(1.0) / (ray.dir[0]);
+  ray_inv_dir[1] = static_cast<T>(1.0) / (ray.dir[1]);
+  ray_inv_dir[2] = static_cast<T>(1.0) / (ray.dir[2]);
 
   real3<T> ray_org;
   ray_org[0] = ray.org[0];
   ray_org[1] = ray.org[1];
   ray_org[2] = ray.org[2];
 
-  real3<T> ray_dir;
-  ray_dir[0] = ray.dir[0];
-  ray_dir[1] = ray.dir[1];
-  ray_dir[2] = ray.dir[2];
-
-  for (unsigned int i = 0; i < num_primitives; i++) {
-    unsigned int prim_idx = indices_[i + offset];
-
-    T local_t = t, u = 0.0f, v = 0.0f;
-    if (intersector.Intersect(&local_t, &u, &v, prim_idx)) {
-      // Update isect state
-      if ((local_t > ray.min_t)) {
-        if (isect_pq->size() < static_cast<size_t>(max_intersections)) {
-          H isect;
-          t = local_t;
-          isect.t = t;
-          isect.u = u;
-          isect.v = v;
-          isect.prim_id = prim_idx;
-          isect_pq->push(isect);
+  T tmins[N];
 
-          // Update t to furthest distance.
-          t = ray.max_t;
+  while (node_stack_index >= 0) {
+    unsigned int index = node_stack[node_stack_index];
+    node_stack_index--;
 
-          hit = true;
-        } else {
-          if (local_t < isect_pq->top().t) {
-            // delete furthest intersection and add new intersection.
-            isect_pq->pop();
+    const typename A::value_type &node = wide_nodes[index];
 
-            H hit;
-            hit.t = local_t;
-            hit.u = u;
-            hit.v = v;
-            hit.prim_id = prim_idx;
-            isect_pq->push(hit);
+    unsigned int mask = IntersectRayWideNode(tmins, ray.min_t, ray.max_t, node,
+                                             ray_org, ray_inv_dir, dir_sign);
 
-            // Update furthest hit distance
-            t = isect_pq->top().t;
+    // Any hit will do, so children are visited without sorting.
+    while (mask) {
+      int c = CountTrailingZeros(mask);
+      mask &= mask - 1;
 
-            hit = true;
-          }
+      if (node.IsLeaf(c)) {
+        if (OccludedLeafPrimitives(node.child[c], node.num_primitives[c],
+                                   ray.max_t, intersector)) {
+          return true;
         }
+      } else {
+        node_stack_index++;
+        assert(node_stack_index < kMaxStackDepth);
+        node_stack[node_stack_index] = node.child[c];
       }
     }
   }
 
-  return hit;
+  (void)kMaxStackDepth;
+
+  return false;
 }
-#endif
 
 template <typename T>
-template <class I, class H>
-bool BVHAccel<T>::Traverse(const Ray<T> &ray, const I &intersector, H *isect,
-                           const BVHTraceOptions &options) const {
-  const int kMaxStackDepth = 512;
+template <class I>
+inline bool BVHAccel<T>::OccludedLeafPrimitives(unsigned int offset,
+                                                unsigned int num_primitives,
+                                                T max_t,
+                                                const I &intersector) const {
+  for (unsigned int i = 0; i < num_primitives; i++) {
+    if (OccludedLeafPrimitive(intersector, max_t, indices_[i + offset],
+                              i + offset)) {
+      return true;
+    }
+  }
+
+  return false;
+}
+
+template <typename T>
+template <int N, class A, class I, class H>
+bool BVHAccel<T>::TraverseWide(const A &wide_nodes, const Ray<T> &ray,
+                               const I &intersector, H *isect,
+                               const BVHTraceOptions &options) const {
+  const int kMaxStackDepth = kTraversalStackSize;
 
   T hit_t = ray.max_t;
 
   int node_stack_index = 0;
-  unsigned int node_stack[512];
-  node_stack[0] = 0;
+  NodeStackEntry<T> node_stack[kTraversalStackSize];
+  node_stack[0].index = 0;
+  node_stack[0].t = ray.min_t;
 
   // Init isect info as no hit
   intersector.Update(hit_t, static_cast<unsigned int>(-1));
@@ -2069,7 +8388,6 @@ bool BVHAccel<T>::Traverse(const Ray<T> &ray, const I &intersector, H *isect,
   dir_sign[1] = ray.dir[1] < static_cast<T>(0.0) ? 1 : 0;
   dir_sign[2] = ray.dir[2] < static_cast<T>(0.0) ? 1 : 0;
 
-  // FIXME(LTE): Check edge case; e.g, 1/0 
   real3<T> ray_inv_dir;
   ray_inv_dir[0] = static_cast<T>(1.0) / (ray.dir[0]);
   ray_inv_dir[1] = static_cast<T>(1.0) / (ray.dir[1]);
@@ -2080,37 +8398,64 @@ bool BVHAccel<T>::Traverse(const Ray<T> &ray, const I &intersector, H *isect,
   ray_org[1] = ray.org[1];
   ray_org[2] = ray.org[2];
 
-  T min_t = std::numeric_limits<T>::max();
-  T max_t = -std::numeric_limits<T>::max();
+  T tmins[N];
+  int order[N];
 
   while (node_stack_index >= 0) {
-    unsigned int index = node_stack[node_stack_index];
-    const BVHNode<T> &node = nodes_[index];
-
+    const NodeStackEntry<T> entry = node_stack[node_stack_index];
     node_stack_index--;
 
-    bool hit = IntersectRayAABB(&min_t, &max_t, ray.min_t, hit_t, node.bmin,
-                                node.bmax, ray_org, ray_inv_dir, dir_sign);
+    // Closer hit was found after this node was pushed.
+    if (entry.t > hit_t) {
+      continue;
+    }
 
-    if (node.flag == 0) {  // branch node
-      if (hit) {
-        int order_near = dir_sign[node.axis];
-        int order_far = 1 - order_near;
+    const typename A::value_type &node = wide_nodes[entry.index];
 
-        // Traverse near first.
-        node_stack[++node_stack_index] = node.data[order_far];
-        node_stack[++node_stack_index] = node.data[order_near];
+    unsigned int mask = IntersectRayWideNode(tmins, ray.min_t, hit_t, node,
+                                             ray_org, ray_inv_dir, dir_sign);
+    if (mask == 0) {
+      continue;
+    }
+
+    // Compact hit children and sort them by entry distance(insertion sort).
+    int num_hits = 0;
+    while (mask) {
+      int i = CountTrailingZeros(mask);
+      mask &= mask - 1;
+
+      int j = num_hits++;
+      while ((j > 0) && (tmins[order[j - 1]] > tmins[i])) {
+        order[j] = order[j - 1];
+        j--;
       }
-    } else {  // leaf node
-      if (hit) {
-        if (TestLeafNode(node, ray, intersector)) {
+      order[j] = i;
+    }
+
+    // Test leaves near to far.
+    for (int i = 0; i < num_hits; i++) {
+      int c = order[i];
+      if (node.IsLeaf(c) && (tmins[c] <= hit_t)) {
+        if (TestLeafPrimitives(node.child[c], node.num_primitives[c],
+                               intersector)) {
           hit_t = intersector.GetT();
         }
       }
     }
+
+    // Push branches far to near so that the nearest one is popped first.
+    for (int i = num_hits - 1; i >= 0; i--) {
+      int c = order[i];
+      if (!node.IsLeaf(c) && (tmins[c] <= hit_t)) {
+        node_stack_index++;
+        assert(node_stack_index < kMaxStackDepth);
+        node_stack[node_stack_index].index = node.child[c];
+        node_stack[node_stack_index].t = tmins[c];
+      }
+    }
   }
 
-  assert(node_stack_index < kMaxStackDepth);
+  (void)kMaxStackDepth;
 
   bool hit = (intersector.GetT() < ray.max_t);
   intersector.PostTraversal(ray, hit, isect);
@@ -2127,8 +8472,8 @@ inline bool BVHAccel<T>::TestLeafNodeIntersections(
                         NodeHitComparator<T> > *isect_pq) const {
   bool hit = false;
 
-  unsigned int num_primitives = node.data[0];
-  unsigned int offset = node.data[1];
+  unsigned int num_primitives = node.GetNumPrimitives();
+  unsigned int offset = node.GetIndexOffset();
 
   real3<T> ray_org;
   ray_org[0] = ray.org[0];
@@ -2175,12 +8520,12 @@ template <class I>
 bool BVHAccel<T>::ListNodeIntersections(
     const Ray<T> &ray, int max_intersections, const I &intersector,
     StackVector<NodeHit<T>, 128> *hits) const {
-  const int kMaxStackDepth = 512;
+  const int kMaxStackDepth = kTraversalStackSize;
 
   T hit_t = ray.max_t;
 
   int node_stack_index = 0;
-  unsigned int node_stack[512];
+  unsigned int node_stack[kTraversalStackSize];
   node_stack[0] = 0;
 
   // Stores furthest intersection at top
@@ -2190,6 +8535,10 @@ bool BVHAccel<T>::ListNodeIntersections(
 
   (*hits)->clear();
 
+  if (nodes_.empty()) {
+    return false;
+  }
+
   int dir_sign[3];
   dir_sign[0] =
       ray.dir[0] < static_cast<T>(0.0) ? 1 : 0;
@@ -2219,14 +8568,14 @@ bool BVHAccel<T>::ListNodeIntersections(
     bool hit = IntersectRayAABB(&min_t, &max_t, ray.min_t, hit_t, node.bmin,
                                 node.bmax, ray_org, ray_inv_dir, dir_sign);
 
-    if (node.flag == 0) {  // branch node
+    if (!node.IsLeaf()) {  // branch node
       if (hit) {
-        int order_near = dir_sign[node.axis];
+        int order_near = dir_sign[node.GetAxis()];
         int order_far = 1 - order_near;
 
         // Traverse near first.
-        node_stack[++node_stack_index] = node.data[order_far];
-        node_stack[++node_stack_index] = node.data[order_near];
+        node_stack[++node_stack_index] = node.GetChild(order_far);
+        node_stack[++node_stack_index] = node.GetChild(order_near);
       }
 
     } else {  // leaf node
@@ -2256,98 +8605,233 @@ bool BVHAccel<T>::ListNodeIntersections(
   return false;
 }
 
-#if 0  // TODO(LTE): Implement
-template <typename T> template<class I, class H, class Comp>
-bool BVHAccel<T>::MultiHitTraverse(const Ray<T> &ray,
-                                         int max_intersections,
-                                         const I &intersector,
-                                         StackVector<H, 128> *hits,
-                                         const BVHTraceOptions& options) const {
-  const int kMaxStackDepth = 512;
+template <typename T>
+template <class I, class H>
+bool BVHAccel<T>::MultiHitTraverse(const Ray<T> &ray, int max_intersections,
+                                   const I &intersector,
+                                   StackVector<H, 128> *isects,
+                                   const BVHTraceOptions &options) const {
+  (*isects)->clear();
 
-  T hit_t = ray.max_t;
+  MultiHitBuffer<T> buffer(max_intersections);
 
-  int node_stack_index = 0;
-  unsigned int node_stack[512];
-  node_stack[0] = 0;
+  intersector.Update(ray.max_t, static_cast<unsigned int>(-1));
 
-  // Stores furthest intersection at top
-  std::priority_queue<H, std::vector<H>, Comp>  isect_pq;
+  intersector.PrepareTraversal(ray, options);
 
-  (*hits)->clear();
+  if (nodes_.empty()) {
+    if (qnodes_.empty()) {
+      return false;
+    }
+    MultiHitTraverseWide<4>(qnodes_, ray, intersector, &buffer);
+  } else {
+    const int kMaxStackDepth = kTraversalStackSize;
 
-  // Init isect info as no hit
-  intersector.Update(hit_t, static_cast<unsigned int>(-1));
+    int node_stack_index = -1;
+    NodeStackEntry<T> node_stack[kTraversalStackSize];
 
-  intersector.PrepareTraversal(ray, options);
+    int dir_sign[3];
+    dir_sign[0] = ray.dir[0] < static_cast<T>(0.0) ? 1 : 0;
+    dir_sign[1] = ray.dir[1] < static_cast<T>(0.0) ? 1 : 0;
+    dir_sign[2] = ray.dir[2] < static_cast<T>(0.0) ? 1 : 0;
+
+    real3<T> ray_inv_dir;
+    ray_inv_dir[0] = static_cast<T>(1.0) / ray.dir[0];
+    ray_inv_dir[1] = static_cast<T>(1.0) / ray.dir[1];
+    ray_inv_dir[2] = static_cast<T>(1.0) / ray.dir[2];
+
+    real3<T> ray_org;
+    ray_org[0] = ray.org[0];
+    ray_org[1] = ray.org[1];
+    ray_org[2] = ray.org[2];
+
+    T min_t, max_t;
+    if (IntersectRayAABB(&min_t, &max_t, ray.min_t, ray.max_t, nodes_[0].bmin,
+                         nodes_[0].bmax, ray_org, ray_inv_dir, dir_sign)) {
+      node_stack_index = 0;
+      node_stack[0].index = 0;
+      node_stack[0].t = min_t;
+    }
+
+    // As in Traverse(), child boxes are tested at the parent and a child is
+    // pushed with its own entry distance.
+    while (node_stack_index >= 0) {
+      const NodeStackEntry<T> entry = node_stack[node_stack_index];
+
+      node_stack_index--;
+
+      // Search range is shrunk to the farthest hit once the buffer is full.
+      const T hit_t = buffer.GetMaxT(ray.max_t);
+      if (entry.t > hit_t) {
+        continue;
+      }
+
+      const BVHNode<T> &node = nodes_[entry.index];
+
+      if (node.IsLeaf()) {
+        MultiHitTestLeafPrimitives(node.GetIndexOffset(),
+                                   node.GetNumPrimitives(), hit_t,
+                                   intersector, &buffer);
+        continue;
+      }
+
+      const unsigned int child0 = node.GetChild(0);
+      const unsigned int child1 = node.GetChild(1);
+
+      T tmin0, tmin1;
+      const bool hit0 =
+          IntersectRayAABB(&tmin0, &max_t, ray.min_t, hit_t,
+                           nodes_[child0].bmin, nodes_[child0].bmax, ray_org,
+                           ray_inv_dir, dir_sign);
+      const bool hit1 =
+          IntersectRayAABB(&tmin1, &max_t, ray.min_t, hit_t,
+                           nodes_[child1].bmin, nodes_[child1].bmax, ray_org,
+                           ray_inv_dir, dir_sign);
+
+      if (hit0 && hit1) {
+        // Traverse near first.
+        const bool swap_order =
+            (tmin1 < tmin0) ||
+            (!(tmin0 < tmin1) && (dir_sign[node.GetAxis()] == 1));
+        node_stack_index++;
+        node_stack[node_stack_index].index = swap_order ? child0 : child1;
+        node_stack[node_stack_index].t = swap_order ? tmin0 : tmin1;
+        node_stack_index++;
+        node_stack[node_stack_index].index = swap_order ? child1 : child0;
+        node_stack[node_stack_index].t = swap_order ? tmin1 : tmin0;
+      } else if (hit0) {
+        node_stack_index++;
+        node_stack[node_stack_index].index = child0;
+        node_stack[node_stack_index].t = tmin0;
+      } else if (hit1) {
+        node_stack_index++;
+        node_stack[node_stack_index].index = child1;
+        node_stack[node_stack_index].t = tmin1;
+      }
+      assert(node_stack_index < kMaxStackDepth);
+    }
+
+    (void)kMaxStackDepth;
+  }
+
+  // Intersect each hit primitive again so that the intersector fills `H`.
+  for (int i = 0; i < buffer.size(); i++) {
+    T t = buffer.GetT(i);
+    intersector.PrepareTraversal(ray, options);
+    IntersectLeafPrimitive(intersector, &t, buffer.GetPrimId(i),
+                           buffer.GetSlot(i));
+    intersector.Update(buffer.GetT(i), buffer.GetPrimId(i));
+
+    H isect;
+    intersector.PostTraversal(ray, true, &isect);
+    (*isects)->push_back(isect);
+  }
+
+  return buffer.size() > 0;
+}
+
+template <typename T>
+template <int N, class A, class I>
+void BVHAccel<T>::MultiHitTraverseWide(const A &wide_nodes, const Ray<T> &ray,
+                                       const I &intersector,
+                                       MultiHitBuffer<T> *buffer) const {
+  const int kMaxStackDepth = kTraversalStackSize;
+
+  int node_stack_index = 0;
+  NodeStackEntry<T> node_stack[kTraversalStackSize];
+  node_stack[0].index = 0;
+  node_stack[0].t = ray.min_t;
 
   int dir_sign[3];
-  dir_sign[0] = ray.dir[0] < static_cast<T>(0.0) ? static_cast<T>(1) : static_cast<T>(0);
-  dir_sign[1] = ray.dir[1] < static_cast<T>(0.0) ? static_cast<T>(1) : static_cast<T>(0);
-  dir_sign[2] = ray.dir[2] < static_cast<T>(0.0) ? static_cast<T>(1) : static_cast<T>(0);
+  dir_sign[0] = ray.dir[0] < static_cast<T>(0.0) ? 1 : 0;
+  dir_sign[1] = ray.dir[1] < static_cast<T>(0.0) ? 1 : 0;
+  dir_sign[2] = ray.dir[2] < static_cast<T>(0.0) ? 1 : 0;
 
-  // @fixme { Check edge case; i.e., 1/0 }
   real3<T> ray_inv_dir;
-  ray_inv_dir[0] = static_cast<T>(1.0) / ray.dir[0];
-  ray_inv_dir[1] = static_cast<T>(1.0) / ray.dir[1];
-  ray_inv_dir[2] = static_cast<T>(1.0) / ray.dir[2];
+  ray_inv_dir[0] = static_cast<T>(1.0) / (ray.dir[0]);
+  ray_inv_dir[1] = static_cast<T>(1.0) / (ray.dir[1]);
+  ray_inv_dir[2] = static_cast<T>(1.0) / (ray.dir[2]);
 
   real3<T> ray_org;
   ray_org[0] = ray.org[0];
   ray_org[1] = ray.org[1];
   ray_org[2] = ray.org[2];
 
-  T min_t, max_t;
-  while (node_stack_index >= 0) {
-    unsigned int index = node_stack[node_stack_index];
-    const BVHNode<T> &node = nodes_[static_cast<size_t>(index)];
+  T tmins[N];
 
+  while (node_stack_index >= 0) {
+    const NodeStackEntry<T> entry = node_stack[node_stack_index];
     node_stack_index--;
 
-    bool hit = IntersectRayAABB(&min_t, &max_t, ray.min_t, hit_t, node.bmin,
-                                node.bmax, ray_org, ray_inv_dir, dir_sign);
+    if (entry.t > buffer->GetMaxT(ray.max_t)) {
+      continue;
+    }
 
-    if (node.flag == 0) {  // branch node
-      if (hit) {
-        int order_near = dir_sign[node.axis];
-        int order_far = 1 - order_near;
+    const typename A::value_type &node = wide_nodes[entry.index];
 
-        // Traverse near first.
-        node_stack[++node_stack_index] = node.data[order_far];
-        node_stack[++node_stack_index] = node.data[order_near];
+    unsigned int mask =
+        IntersectRayWideNode(tmins, ray.min_t, buffer->GetMaxT(ray.max_t),
+                             node, ray_org, ray_inv_dir, dir_sign);
+
+    // Leaves first, then branches far to near, as in TraverseWide().
+    unsigned int branch_mask = 0;
+    while (mask) {
+      int c = CountTrailingZeros(mask);
+      mask &= mask - 1;
+
+      if (!node.IsLeaf(c)) {
+        branch_mask |= (1u << c);
+      } else if (tmins[c] <= buffer->GetMaxT(ray.max_t)) {
+        MultiHitTestLeafPrimitives(node.child[c], node.num_primitives[c],
+                                   buffer->GetMaxT(ray.max_t), intersector,
+                                   buffer);
       }
+    }
 
-    } else {  // leaf node
-      if (hit) {
-        if (MultiHitTestLeafNode(&isect_pq, max_intersections, node, ray, intersector)) {
-          // Only update `hit_t` when queue is full.
-          if (isect_pq.size() >= static_cast<size_t>(max_intersections)) {
-            hit_t = isect_pq.top().t;
-          }
-        }
+    // Sort branches by entry distance(insertion sort), nearest last.
+    int order[N];
+    int num_branches = 0;
+    while (branch_mask) {
+      int i = CountTrailingZeros(branch_mask);
+      branch_mask &= branch_mask - 1;
+
+      int j = num_branches++;
+      while ((j > 0) && (tmins[order[j - 1]] < tmins[i])) {
+        order[j] = order[j - 1];
+        j--;
       }
+      order[j] = i;
+    }
+
+    for (int i = 0; i < num_branches; i++) {
+      int c = order[i];
+      node_stack_index++;
+      assert(node_stack_index < kMaxStackDepth);
+      node_stack[node_stack_index].index = node.child[c];
+      node_stack[node_stack_index].t = tmins[c];
     }
   }
 
-  assert(node_stack_index < kMaxStackDepth);
   (void)kMaxStackDepth;
+}
 
-  if (!isect_pq.empty()) {
-    // Store intesection in reverse order(make it frontmost order)
-    size_t n = isect_pq.size();
-    (*hits)->resize(n);
-    for (size_t i = 0; i < n; i++) {
-      const H &isect = isect_pq.top();
-      (*hits)[n - i - 1] = isect;
-      isect_pq.pop();
-    }
+template <typename T>
+template <class I>
+inline void BVHAccel<T>::MultiHitTestLeafPrimitives(
+    unsigned int offset, unsigned int num_primitives, T max_t,
+    const I &intersector, MultiHitBuffer<T> *buffer) const {
+  for (unsigned int i = 0; i < num_primitives; i++) {
+    unsigned int prim_idx = indices_[i + offset];
 
-    return true;
+    T local_t = max_t;
+    if (IntersectLeafPrimitive(intersector, &local_t, prim_idx, i + offset)) {
+      if (buffer->Insert(local_t, prim_idx, i + offset)) {
+        max_t = buffer->GetMaxT(max_t);
+      }
+    }
   }
-
-  return false;
 }
-#endif
+
 
 #ifdef __clang__
 #pragma clang diagnostic pop
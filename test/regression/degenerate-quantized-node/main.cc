@@ -0,0 +1,68 @@
+// Compressed(quantized) BVH built from degenerate triangles.
+//
+// All vertices are at (1, 1, 1), so every node has zero extent and child
+// bounds are quantized with the smallest exponent. Empty child slots then
+// decode to the point box (1, 1, 1) as well, and a ray through that point
+// must not descend into them.
+#include "nanort.h"
+#include <cstdlib>
+#include <iostream>
+
+int main(int argc, char **argv) {
+  (void)argc;
+  (void)argv;
+
+  const unsigned int kNumTriangles = 12;
+
+  std::vector<float> vertices(9 * kNumTriangles, 1.0f);
+  std::vector<unsigned int> faces(3 * kNumTriangles);
+  for (size_t i = 0; i < faces.size(); i++) {
+    faces[i] = static_cast<unsigned int>(i);
+  }
+
+  nanort::BVHBuildOptions<float> build_options;
+  build_options.compressed_bvh = true;
+
+  nanort::TriangleMesh<float> triangle_mesh(&vertices.at(0), &faces.at(0),
+                                            sizeof(float) * 3);
+  nanort::TriangleSAHPred<float> triangle_pred(&vertices.at(0), &faces.at(0),
+                                               sizeof(float) * 3);
+  nanort::BVHAccel<float> accel;
+  bool ret =
+      accel.Build(kNumTriangles, triangle_mesh, triangle_pred, build_options);
+  if (!ret || accel.GetQuantizedNodes().empty()) {
+    std::cerr << "Failed to build compressed BVH" << std::endl;
+    return EXIT_FAILURE;
+  }
+
+  nanort::Ray<float> ray;
+  ray.org[0] = 0.0f;
+  ray.org[1] = 0.0f;
+  ray.org[2] = 0.0f;
+  ray.dir[0] = 0.57735027f;
+  ray.dir[1] = 0.57735027f;
+  ray.dir[2] = 0.57735027f;
+  ray.min_t = 0.0f;
+  ray.max_t = 1.0e+30f;
+
+  nanort::TriangleIntersector<float, nanort::TriangleIntersection<float> >
+      triangle_intersector(&vertices.at(0), &faces.at(0), sizeof(float) * 3);
+
+  // Degenerate triangles are never hit. Without masking empty slots, all
+  // three queries below push an invalid child index and crash.
+  nanort::TriangleIntersection<float> isect;
+  const bool hit = accel.Traverse(ray, triangle_intersector, &isect);
+  const bool occluded = accel.Occluded(ray, triangle_intersector);
+
+  nanort::StackVector<nanort::TriangleIntersection<float>, 128> isects;
+  const bool multi_hit =
+      accel.MultiHitTraverse(ray, 4, triangle_intersector, &isects);
+
+  if (hit || occluded || multi_hit) {
+    std::cerr << "Unexpected hit on degenerate triangles" << std::endl;
+    return EXIT_FAILURE;
+  }
+
+  std::cout << "OK" << std::endl;
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,97 @@
+// Zero-area triangle intersected with FMA contraction enabled.
+//
+// All vertices are at (1, 1, 1), so every edge function of the watertight
+// test is zero and the triangle must never be hit. When `Cx * By - Cy * Bx`
+// is contracted into FMA, the rounding error of one product is kept and the
+// edge functions become tiny nonzero values of arbitrary sign, which report
+// hits with a garbage distance. Checked for both float and double. Build
+// with -mfma(see Makefile.dev).
+#include "nanort.h"
+#include <cstdlib>
+#include <iostream>
+
+template <typename T>
+static T Rand(T lo, T hi) {
+  return lo + (hi - lo) * (static_cast<T>(rand()) / static_cast<T>(RAND_MAX));
+}
+
+template <typename T>
+static bool CheckZeroAreaTriangle(const char *name) {
+  const int kNumRays = 2000;
+  const int kPacketSize = 8;
+
+  std::vector<T> vertices(9, static_cast<T>(1.0));
+  std::vector<unsigned int> faces(3);
+  faces[0] = 0;
+  faces[1] = 1;
+  faces[2] = 2;
+
+  nanort::TriangleIntersector<T, nanort::TriangleIntersection<T> >
+      triangle_intersector(&vertices.at(0), &faces.at(0), sizeof(T) * 3);
+
+  nanort::BVHTraceOptions trace_options;
+  nanort::RayPacketIntersector<
+      T, kPacketSize,
+      nanort::TriangleIntersector<T, nanort::TriangleIntersection<T> > >
+      packet_intersector(triangle_intersector);
+  nanort::RayPacket<T, kPacketSize> packet;
+
+  srand(1);
+
+  int num_hits = 0;
+  int num_packet_hits = 0;
+  for (int i = 0; i < kNumRays; i++) {
+    nanort::Ray<T> ray;
+    for (int j = 0; j < 3; j++) {
+      ray.org[j] = Rand(static_cast<T>(-2.0), static_cast<T>(2.0));
+      ray.dir[j] = Rand(static_cast<T>(-1.0), static_cast<T>(1.0));
+    }
+    ray.min_t = static_cast<T>(0.0);
+    ray.max_t = static_cast<T>(1.0e+30);
+
+    triangle_intersector.PrepareTraversal(ray, trace_options);
+    T t = ray.max_t;
+    if (triangle_intersector.Intersect(&t, 0)) {
+      num_hits++;
+    }
+
+    packet.SetRay(i % kPacketSize, ray);
+    if ((i % kPacketSize) == (kPacketSize - 1)) {
+      T hit_t[kPacketSize];
+      for (int k = 0; k < kPacketSize; k++) {
+        hit_t[k] = packet.max_t[k];
+      }
+      packet_intersector.PrepareTraversal(packet, trace_options);
+      packet_intersector.IntersectLeaf(&faces.at(0), 0, 1,
+                                       (1u << kPacketSize) - 1, hit_t);
+      for (int k = 0; k < kPacketSize; k++) {
+        if (hit_t[k] < packet.max_t[k]) {
+          num_packet_hits++;
+        }
+      }
+    }
+  }
+
+  if (num_hits > 0 || num_packet_hits > 0) {
+    std::cerr << "Unexpected hit on zero-area triangle(" << name
+              << "): " << num_hits << " rays, " << num_packet_hits
+              << " packet rays" << std::endl;
+    return false;
+  }
+
+  return true;
+}
+
+int main(int argc, char **argv) {
+  (void)argc;
+  (void)argv;
+
+  bool ok = CheckZeroAreaTriangle<float>("float");
+  ok = CheckZeroAreaTriangle<double>("double") && ok;
+  if (!ok) {
+    return EXIT_FAILURE;
+  }
+
+  std::cout << "OK" << std::endl;
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,257 @@
+// Incremental Insert()/Remove() compared against brute force.
+//
+// Primitives are removed and inserted again, including removing all of them
+// (empty root leaf), inserting next to the root(root relocation) and
+// removing a child of the root(sibling moved to the root). After each step,
+// Traverse() and K-nearest MultiHitTraverse() must report the same hits as
+// intersecting every primitive still in the tree.
+//
+// A row of primitives is also inserted one by one from left to right. Each
+// new leaf goes next to the previous one, so without rotations the tree
+// becomes a chain deeper than the traversal stacks.
+#include "nanort.h"
+#include <algorithm>
+#include <cstdlib>
+#include <iostream>
+
+typedef nanort::TriangleIntersection<float> Isect;
+typedef nanort::TriangleIntersector<float, Isect> Intersector;
+
+static const unsigned int kNumTriangles = 64;
+static const unsigned int kNumRowTriangles = 2048;
+static const int kNumRays = 256;
+static const int kMaxHits = 4;
+
+static float Rand(float lo, float hi) {
+  return lo + (hi - lo) * (static_cast<float>(rand()) /
+                           static_cast<float>(RAND_MAX));
+}
+
+static bool Check(const char *step, const nanort::BVHAccel<float> &accel,
+                  const Intersector &intersector,
+                  const std::vector<bool> &in_tree) {
+  srand(2);
+
+  for (int i = 0; i < kNumRays; i++) {
+    nanort::Ray<float> ray;
+    float target[3];
+    for (int k = 0; k < 3; k++) {
+      ray.org[k] = Rand(-2.0f, 3.0f);
+      target[k] = Rand(0.0f, 1.0f);
+    }
+    for (int k = 0; k < 3; k++) {
+      ray.dir[k] = target[k] - ray.org[k];
+    }
+    ray.min_t = 0.0f;
+    ray.max_t = 1.0e+30f;
+
+    // Brute force.
+    nanort::BVHTraceOptions trace_options;
+    std::vector<std::pair<float, unsigned int> > expected;
+    for (unsigned int p = 0; p < in_tree.size(); p++) {
+      if (!in_tree[p]) continue;
+      intersector.PrepareTraversal(ray, trace_options);
+      float t = ray.max_t;
+      if (intersector.Intersect(&t, p)) {
+        expected.push_back(std::make_pair(t, p));
+      }
+    }
+    std::sort(expected.begin(), expected.end());
+
+    Isect isect;
+    const bool hit = accel.Traverse(ray, intersector, &isect);
+    if (hit != !expected.empty() ||
+        (hit && ((isect.t != expected[0].first) ||
+                 (isect.prim_id != expected[0].second)))) {
+      std::cerr << step << ": Traverse differs at ray " << i << std::endl;
+      return false;
+    }
+
+    nanort::StackVector<Isect, 128> isects;
+    accel.MultiHitTraverse(ray, kMaxHits, intersector, &isects);
+    const size_t num_expected =
+        std::min(expected.size(), static_cast<size_t>(kMaxHits));
+    if (isects->size() != num_expected) {
+      std::cerr << step << ": MultiHitTraverse returned " << isects->size()
+                << " hits instead of " << num_expected << " at ray " << i
+                << std::endl;
+      return false;
+    }
+    for (size_t j = 0; j < num_expected; j++) {
+      if ((isects[j].t != expected[j].first) ||
+          (isects[j].prim_id != expected[j].second)) {
+        std::cerr << step << ": MultiHitTraverse differs at ray " << i
+                  << std::endl;
+        return false;
+      }
+    }
+  }
+
+  return true;
+}
+
+int main(int argc, char **argv) {
+  (void)argc;
+  (void)argv;
+
+  srand(1);
+
+  std::vector<float> vertices(9 * kNumTriangles);
+  std::vector<unsigned int> faces(3 * kNumTriangles);
+  for (unsigned int i = 0; i < kNumTriangles; i++) {
+    float center[3];
+    for (int k = 0; k < 3; k++) {
+      center[k] = Rand(0.0f, 1.0f);
+    }
+    for (int j = 0; j < 3; j++) {
+      for (int k = 0; k < 3; k++) {
+        vertices[9 * i + 3 * j + k] = center[k] + Rand(-0.2f, 0.2f);
+      }
+      faces[3 * i + j] = 3 * i + j;
+    }
+  }
+
+  nanort::TriangleMesh<float> triangle_mesh(&vertices.at(0), &faces.at(0),
+                                            sizeof(float) * 3);
+  nanort::TriangleSAHPred<float> triangle_pred(&vertices.at(0), &faces.at(0),
+                                               sizeof(float) * 3);
+  Intersector triangle_intersector(&vertices.at(0), &faces.at(0),
+                                   sizeof(float) * 3);
+
+  nanort::BVHBuildOptions<float> build_options;
+  nanort::BVHAccel<float> accel;
+  if (!accel.Build(kNumTriangles, triangle_mesh, triangle_pred,
+                   build_options)) {
+    std::cerr << "Failed to build BVH" << std::endl;
+    return EXIT_FAILURE;
+  }
+
+  std::vector<bool> in_tree(kNumTriangles, true);
+  if (!Check("build", accel, triangle_intersector, in_tree)) {
+    return EXIT_FAILURE;
+  }
+
+  // Remove every other primitive, then insert them again.
+  for (unsigned int i = 0; i < kNumTriangles; i += 2) {
+    if (!accel.Remove(i, triangle_mesh)) {
+      std::cerr << "Failed to remove " << i << std::endl;
+      return EXIT_FAILURE;
+    }
+    in_tree[i] = false;
+  }
+  if (accel.Remove(0, triangle_mesh)) {
+    std::cerr << "Removed a primitive twice" << std::endl;
+    return EXIT_FAILURE;
+  }
+  if (!Check("remove half", accel, triangle_intersector, in_tree)) {
+    return EXIT_FAILURE;
+  }
+
+  for (unsigned int i = 0; i < kNumTriangles; i += 2) {
+    if (!accel.Insert(i, triangle_mesh)) {
+      std::cerr << "Failed to insert " << i << std::endl;
+      return EXIT_FAILURE;
+    }
+    in_tree[i] = true;
+  }
+  if (accel.Insert(1, triangle_mesh)) {
+    std::cerr << "Inserted a primitive twice" << std::endl;
+    return EXIT_FAILURE;
+  }
+  if (!Check("reinsert half", accel, triangle_intersector, in_tree)) {
+    return EXIT_FAILURE;
+  }
+
+  // Empty the tree.
+  for (unsigned int i = 0; i < kNumTriangles; i++) {
+    if (!accel.Remove(i, triangle_mesh)) {
+      std::cerr << "Failed to remove " << i << std::endl;
+      return EXIT_FAILURE;
+    }
+    in_tree[i] = false;
+  }
+  if (!Check("remove all", accel, triangle_intersector, in_tree)) {
+    return EXIT_FAILURE;
+  }
+
+  // The first primitive goes to the empty root leaf. The second one is
+  // placed next to the root, which moves the root to a new node.
+  for (unsigned int i = 0; i < 2; i++) {
+    if (!accel.Insert(i, triangle_mesh)) {
+      std::cerr << "Failed to insert " << i << std::endl;
+      return EXIT_FAILURE;
+    }
+    in_tree[i] = true;
+  }
+  if (!Check("insert into empty tree", accel, triangle_intersector,
+             in_tree)) {
+    return EXIT_FAILURE;
+  }
+
+  // Removing a child of the root moves its sibling to the root.
+  if (!accel.Remove(0, triangle_mesh)) {
+    std::cerr << "Failed to remove 0" << std::endl;
+    return EXIT_FAILURE;
+  }
+  in_tree[0] = false;
+  if (!Check("remove root child", accel, triangle_intersector, in_tree)) {
+    return EXIT_FAILURE;
+  }
+
+  for (unsigned int i = 0; i < kNumTriangles; i++) {
+    if (in_tree[i]) continue;
+    if (!accel.Insert(i, triangle_mesh)) {
+      std::cerr << "Failed to insert " << i << std::endl;
+      return EXIT_FAILURE;
+    }
+    in_tree[i] = true;
+  }
+  if (!Check("reinsert all", accel, triangle_intersector, in_tree)) {
+    return EXIT_FAILURE;
+  }
+
+  // Row of triangles on z = 0.5, inserted from left to right.
+  std::vector<float> row_vertices(9 * kNumRowTriangles);
+  std::vector<unsigned int> row_faces(3 * kNumRowTriangles);
+  for (unsigned int i = 0; i < kNumRowTriangles; i++) {
+    const float x = static_cast<float>(i) / static_cast<float>(kNumRowTriangles);
+    const float w = 0.5f / static_cast<float>(kNumRowTriangles);
+    const float p[3][3] = {{x, 0.0f, 0.5f}, {x + w, 0.0f, 0.5f},
+                           {x, 1.0f, 0.5f}};
+    for (int j = 0; j < 3; j++) {
+      for (int k = 0; k < 3; k++) {
+        row_vertices[9 * i + 3 * j + k] = p[j][k];
+      }
+      row_faces[3 * i + j] = 3 * i + j;
+    }
+  }
+
+  nanort::TriangleMesh<float> row_mesh(&row_vertices.at(0),
+                                       &row_faces.at(0), sizeof(float) * 3);
+  nanort::TriangleSAHPred<float> row_pred(&row_vertices.at(0),
+                                          &row_faces.at(0), sizeof(float) * 3);
+  Intersector row_intersector(&row_vertices.at(0), &row_faces.at(0),
+                              sizeof(float) * 3);
+
+  nanort::BVHAccel<float> row_accel;
+  if (!row_accel.Build(1, row_mesh, row_pred, build_options)) {
+    std::cerr << "Failed to build BVH" << std::endl;
+    return EXIT_FAILURE;
+  }
+  std::vector<bool> row_in_tree(kNumRowTriangles, false);
+  row_in_tree[0] = true;
+  for (unsigned int i = 1; i < kNumRowTriangles; i++) {
+    if (!row_accel.Insert(i, row_mesh)) {
+      std::cerr << "Failed to insert " << i << " in order, tree depth "
+                << row_accel.GetStatistics().max_tree_depth << std::endl;
+      return EXIT_FAILURE;
+    }
+    row_in_tree[i] = true;
+  }
+  if (!Check("insert in order", row_accel, row_intersector, row_in_tree)) {
+    return EXIT_FAILURE;
+  }
+
+  std::cout << "OK" << std::endl;
+  return EXIT_SUCCESS;
+}
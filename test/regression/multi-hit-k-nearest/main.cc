@@ -0,0 +1,138 @@
+// K-nearest MultiHitTraverse() compared against brute force.
+//
+// Overlapping triangles are traced with several `max_intersections` values
+// on binary, 4-wide and compressed BVHs. The returned hits must be the K
+// nearest hits sorted front to back, and the first one must equal the
+// closest hit of Traverse().
+#include "nanort.h"
+#include <algorithm>
+#include <cstdlib>
+#include <iostream>
+
+typedef nanort::TriangleIntersection<float> Isect;
+typedef nanort::TriangleIntersector<float, Isect> Intersector;
+
+static const unsigned int kNumTriangles = 256;
+static const int kNumRays = 256;
+
+static float Rand(float lo, float hi) {
+  return lo + (hi - lo) * (static_cast<float>(rand()) /
+                           static_cast<float>(RAND_MAX));
+}
+
+static bool Check(const char *name, const nanort::BVHAccel<float> &accel,
+                  const Intersector &intersector) {
+  const int kMaxHits[] = {1, 3, 8, 128};
+
+  srand(2);
+
+  for (int i = 0; i < kNumRays; i++) {
+    nanort::Ray<float> ray;
+    float target[3];
+    for (int k = 0; k < 3; k++) {
+      ray.org[k] = Rand(-2.0f, 3.0f);
+      target[k] = Rand(0.0f, 1.0f);
+    }
+    for (int k = 0; k < 3; k++) {
+      ray.dir[k] = target[k] - ray.org[k];
+    }
+    ray.min_t = 0.0f;
+    ray.max_t = 1.0e+30f;
+
+    nanort::BVHTraceOptions trace_options;
+    std::vector<std::pair<float, unsigned int> > expected;
+    for (unsigned int p = 0; p < kNumTriangles; p++) {
+      intersector.PrepareTraversal(ray, trace_options);
+      float t = ray.max_t;
+      if (intersector.Intersect(&t, p)) {
+        expected.push_back(std::make_pair(t, p));
+      }
+    }
+    std::sort(expected.begin(), expected.end());
+
+    for (size_t m = 0; m < sizeof(kMaxHits) / sizeof(kMaxHits[0]); m++) {
+      nanort::StackVector<Isect, 128> isects;
+      const bool hit =
+          accel.MultiHitTraverse(ray, kMaxHits[m], intersector, &isects);
+
+      const size_t num_expected =
+          std::min(expected.size(), static_cast<size_t>(kMaxHits[m]));
+      bool ok = (hit == (num_expected > 0)) &&
+                (isects->size() == num_expected);
+      for (size_t j = 0; ok && (j < num_expected); j++) {
+        ok = (isects[j].t == expected[j].first) &&
+             (isects[j].prim_id == expected[j].second);
+      }
+      if (!ok) {
+        std::cerr << name << ": K = " << kMaxHits[m]
+                  << " differs from brute force at ray " << i << std::endl;
+        return false;
+      }
+    }
+
+    Isect isect;
+    if (accel.Traverse(ray, intersector, &isect) &&
+        (isect.t != expected[0].first)) {
+      std::cerr << name << ": Traverse differs at ray " << i << std::endl;
+      return false;
+    }
+  }
+
+  return true;
+}
+
+int main(int argc, char **argv) {
+  (void)argc;
+  (void)argv;
+
+  srand(1);
+
+  std::vector<float> vertices(9 * kNumTriangles);
+  std::vector<unsigned int> faces(3 * kNumTriangles);
+  for (unsigned int i = 0; i < kNumTriangles; i++) {
+    float center[3];
+    for (int k = 0; k < 3; k++) {
+      center[k] = Rand(0.0f, 1.0f);
+    }
+    for (int j = 0; j < 3; j++) {
+      for (int k = 0; k < 3; k++) {
+        vertices[9 * i + 3 * j + k] = center[k] + Rand(-0.3f, 0.3f);
+      }
+      faces[3 * i + j] = 3 * i + j;
+    }
+  }
+
+  nanort::TriangleMesh<float> triangle_mesh(&vertices.at(0), &faces.at(0),
+                                            sizeof(float) * 3);
+  nanort::TriangleSAHPred<float> triangle_pred(&vertices.at(0), &faces.at(0),
+                                               sizeof(float) * 3);
+  Intersector triangle_intersector(&vertices.at(0), &faces.at(0),
+                                   sizeof(float) * 3);
+
+  for (int variant = 0; variant < 4; variant++) {
+    const char *names[] = {"SAH", "LBVH", "BVH4", "compressed"};
+
+    nanort::BVHBuildOptions<float> build_options;
+    if (variant == 1) {
+      build_options.build_method = nanort::kBVHBuildLBVH;
+    } else if (variant == 2) {
+      build_options.wide_bvh_width = 4;
+    } else if (variant == 3) {
+      build_options.compressed_bvh = true;
+    }
+
+    nanort::BVHAccel<float> accel;
+    if (!accel.Build(kNumTriangles, triangle_mesh, triangle_pred,
+                     build_options)) {
+      std::cerr << names[variant] << ": Failed to build BVH" << std::endl;
+      return EXIT_FAILURE;
+    }
+
+    if (!Check(names[variant], accel, triangle_intersector)) {
+      return EXIT_FAILURE;
+    }
+  }
+
+  std::cout << "OK" << std::endl;
+  return EXIT_SUCCESS;
+}